@@ -40,13 +40,33 @@ QuickCG can handle some things that standard C++ doesn't but that are commonly u
 
 #include "quickcg.h"
 
+#ifdef QUICKCG_SDL2
+#include <SDL2/SDL.h>
+#else
 #include <SDL/SDL.h>
+#endif
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <vector>
-#include <map>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#ifdef __SSE2__
+#include <immintrin.h> //the SSE2 and AVX2 color functions
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace QuickCG
 {
@@ -58,45 +78,313 @@ namespace QuickCG
 int w; //width of the screen
 int h; //height of the screen
 
-std::map<int, bool> keypressed; //for the "keyPressed" function to detect a keypress only once
+//the keyboard as readKeys left it, indexed by SDL1 keysym or SDL2 scancode
+const int KEY_STATES = 512;
+struct KeyState
+{
+  bool down;
+  bool pressed; //went down since keyPressed last returned true for it
+  Uint64 time; //getNanoseconds time of the last press or release
+};
+KeyState keys[KEY_STATES];
+bool quitRequested = false; //the window was closed
+unsigned keyDownEvents = 0; //for sleep() to see a key go down
+Uint64 lastInputTime = 0;
+const int TYPED_MAX = 64;
+Uint8 typed[TYPED_MAX]; //characters typed since getInputCharacter last took them, a ring buffer
+unsigned typedFirst = 0, typedEnd = 0;
 SDL_Surface* scr; //the single SDL surface used
-Uint8* inkeys;
+bool headless = false; //scr is a plain surface, there's no window
+#ifdef QUICKCG_SDL2
+SDL_Window* window; //scr is the framebuffer, presented through a streaming texture
+SDL_Renderer* renderer;
+SDL_Texture* texture;
+#endif
 SDL_Event event = {0};
+bool screenVsync = false;
+int screenScale = 1;
+
+//With two buffers, redraw hands the finished frame to a copy thread and scr moves on to the other buffer. The copy
+//thread only copies pixels, into the window surface (SDL1) or the locked texture (SDL2): SDL itself is only called
+//from the thread that set up the video, which presents what was copied the next time it gets to it
+int screenBuffers = 1;
+SDL_Surface* display; //the window surface (SDL1)
+std::vector<SDL_Surface*> freeFrames; //buffers nobody is drawing or copying
+SDL_Surface* copyFrame = NULL; //handed to the copy thread, not copied yet
+void* copyPixels = NULL; //where it goes, locked by the main thread
+int copyPitch = 0; //in bytes
+bool copyDone = false; //copied, waiting to be presented by the main thread
+bool stopCopy = false;
+std::mutex presentMutex; //guards the ones above
+std::condition_variable presentChanged;
+std::thread presenter;
+
+//frame pacing, see framePacing
+FramePacing pacingMode = PACING_UNCAPPED;
+Uint64 pacePeriod = 0; //nanoseconds between frames, 0 without a target rate
+Uint64 paceDeadline = 0; //when the next frame is due, in getNanoseconds time
+Uint64 paceLast = 0; //when the last frame started
+Uint64 paceSpin = 1000000; //the last stretch of a wait that's spun instead of slept, follows how late sleeps wake up
+const int PACE_HISTORY = 128;
+Uint64 paceIntervals[PACE_HISTORY]; //time between the last frames, a ring buffer
+int paceFrames = 0; //frames recorded so far
+double frameTime = 0, smoothFrameTime = 0; //the last of them and their running average, in seconds
+
+Uint64 clockStart = getNanoseconds(); //getTicks and getTime count from here
 
 ////////////////////////////////////////////////////////////////////////////////
 //KEYBOARD FUNCTIONS////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+#ifdef QUICKCG_SDL2
+static int keyIndex(int key) { return SDL_GetScancodeFromKey(key); } //SDL2 keycodes aren't array indices
+#else
+static int keyIndex(int key) { return key; }
+#endif
+
+static KeyState* keyState(int key)
+{
+  int index = keyIndex(key);
+  return index >= 0 && index < KEY_STATES ? &keys[index] : NULL;
+}
+
+//Gets the next event into event
+static int pollEvent()
+{
+  return SDL_PollEvent(&event);
+}
+
 bool keyDown(int key) //this checks if the key is held down, returns true all the time until the key is up
 {
-  return (inkeys[key] != 0);
+  KeyState* state = keyState(key);
+  return state && state->down;
 }
 
 bool keyPressed(int key) //this checks if the key is *just* pressed, returns true only once until the key is up again
 {
-  if(keypressed.find(key) == keypressed.end()) keypressed[key] = false;
-  if(inkeys[key])
+  KeyState* state = keyState(key);
+  if(state == NULL || !state->pressed) return false;
+  state->pressed = false;
+  return true;
+}
+
+Uint64 keyTime(int key)
+{
+  KeyState* state = keyState(key);
+  return state ? state->time : 0;
+}
+
+Uint64 inputTime()
+{
+  return lastInputTime;
+}
+
+static void typeCharacter(int ascii)
+{
+  if(typedEnd - typedFirst < unsigned(TYPED_MAX)) typed[typedEnd++ % TYPED_MAX] = ascii;
+}
+
+//applies one event to the key states
+static void handleEvent(const SDL_Event& e, Uint64 now)
+{
+  if(e.type == SDL_QUIT) quitRequested = true;
+  if(e.type != SDL_KEYDOWN && e.type != SDL_KEYUP)
   {
-    if(keypressed[key] == false)
-    {
-      keypressed[key] = true;
-      return true;
-    }
+#ifdef QUICKCG_SDL2
+    //typed characters come as text input events, enter and backspace only as key presses
+    if(e.type == SDL_TEXTINPUT && (e.text.text[0] & 0x80) == 0) typeCharacter(e.text.text[0]);
+#endif
+    return;
   }
-  else keypressed[key] = false;
 
-  return false;
+#ifdef QUICKCG_SDL2
+  int index = e.key.keysym.scancode;
+  Uint64 ticks = SDL_GetTicks();
+  Uint64 time = now - std::min<Uint64>(now, (ticks > e.key.timestamp ? ticks - e.key.timestamp : 0) * 1000000); //SDL2 stamps events in milliseconds
+  if(e.type == SDL_KEYDOWN && (e.key.keysym.sym == SDLK_RETURN || e.key.keysym.sym == SDLK_BACKSPACE)) typeCharacter(e.key.keysym.sym);
+  if(e.key.repeat) return;
+#else
+  int index = e.key.keysym.sym;
+  Uint64 time = now; //SDL1 events have no timestamp, this is when they were read
+  if(e.type == SDL_KEYDOWN && (e.key.keysym.unicode & 0xFF80) == 0) typeCharacter(e.key.keysym.unicode & 0x7F);
+#endif
+
+  if(e.type == SDL_KEYDOWN) keyDownEvents++;
+  if(index < 0 || index >= KEY_STATES) return;
+  KeyState& state = keys[index];
+  state.down = e.type == SDL_KEYDOWN;
+  if(state.down) state.pressed = true; //stays set until asked, even if the key is already up again
+  state.time = time;
+  lastInputTime = std::max(lastInputTime, time);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //BASIC SCREEN FUNCTIONS////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+void screenOptions(bool vsync, int scale, int buffers)
+{
+  screenVsync = vsync;
+  screenScale = std::max(1, scale);
+  screenBuffers = std::max(1, std::min(2, buffers));
+}
+
+#ifdef QUICKCG_SDL2
+//the renderer scales the texture up with nearest neighbour, by whole multiples when the window is resized
+static void createRenderer(int width, int height)
+{
+  renderer = SDL_CreateRenderer(window, -1, screenVsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+  if(renderer == NULL) return;
+  SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+  SDL_RenderSetLogicalSize(renderer, width, height);
+  SDL_RenderSetIntegerScale(renderer, SDL_TRUE);
+  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, width, height);
+}
+#endif
+
+//puts a finished frame on the screen
+static void presentFrame(SDL_Surface* frame)
+{
+#ifdef QUICKCG_SDL2
+  SDL_UpdateTexture(texture, NULL, frame->pixels, frame->pitch); //the one upload per frame
+  SDL_RenderClear(renderer);
+  SDL_RenderCopy(renderer, texture, NULL, NULL);
+  SDL_RenderPresent(renderer);
+#else
+  if(frame != display) SDL_BlitSurface(frame, NULL, display, NULL);
+  SDL_UpdateRect(display, 0, 0, 0, 0);
+#endif
+}
+
+//locks what the copy thread writes the next frame into
+static bool lockTarget(void*& pixels, int& pitch)
+{
+#ifdef QUICKCG_SDL2
+  return SDL_LockTexture(texture, NULL, &pixels, &pitch) == 0;
+#else
+  if(SDL_MUSTLOCK(display) && SDL_LockSurface(display) < 0) return false;
+  pixels = display->pixels;
+  pitch = display->pitch;
+  return true;
+#endif
+}
+
+//puts what the copy thread wrote on the screen
+static void presentTarget()
+{
+#ifdef QUICKCG_SDL2
+  SDL_UnlockTexture(texture);
+  SDL_RenderClear(renderer);
+  SDL_RenderCopy(renderer, texture, NULL, NULL);
+  SDL_RenderPresent(renderer);
+#else
+  if(SDL_MUSTLOCK(display)) SDL_UnlockSurface(display);
+  SDL_UpdateRect(display, 0, 0, 0, 0);
+#endif
+}
+
+//The copy thread: copies the frames redraw hands over and gives their buffers back. It never calls SDL
+static void copyLoop()
+{
+  std::unique_lock<std::mutex> lock(presentMutex);
+  for(;;)
+  {
+    presentChanged.wait(lock, []{ return copyFrame != NULL || stopCopy; });
+    if(copyFrame == NULL) return; //stopped, and every frame is copied
+
+    SDL_Surface* frame = copyFrame;
+    Uint8* pixels = (Uint8*)copyPixels;
+    int pitch = copyPitch;
+    lock.unlock();
+    size_t rowBytes = size_t(frame->w) * 4;
+    for(int y = 0; y < frame->h; y++) std::memcpy(pixels + size_t(y) * pitch, (Uint8*)frame->pixels + size_t(y) * frame->pitch, rowBytes);
+    lock.lock();
+    copyFrame = NULL;
+    copyDone = true;
+    freeFrames.push_back(frame);
+    presentChanged.notify_all();
+  }
+}
+
+//presents the frame the copy thread copied, if it's done or if wait is set (then it waits for the copy)
+static void finishPresent(bool wait)
+{
+  std::unique_lock<std::mutex> lock(presentMutex);
+  if(wait) presentChanged.wait(lock, []{ return copyFrame == NULL; });
+  if(!copyDone) return;
+  copyDone = false;
+  lock.unlock();
+  presentTarget();
+}
+
+//presents the last frame handed over and stops the copy thread, before SDL shuts down
+static void stopPresentThread()
+{
+  if(!presenter.joinable()) return;
+  finishPresent(true);
+  {
+    std::lock_guard<std::mutex> lock(presentMutex);
+    stopCopy = true;
+  }
+  presentChanged.notify_all();
+  presenter.join();
+}
+
+//creates the buffers scr takes turns with and starts copying them on another thread
+static void startPresentThread(int width, int height)
+{
+  for(int i = 0; i < screenBuffers; i++)
+  {
+    SDL_Surface* frame = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+    if(frame == NULL)
+    {
+      printf("Unable to create surface: %s\n", SDL_GetError());
+      SDL_Quit();
+      std::exit(1);
+    }
+    freeFrames.push_back(frame);
+  }
+  scr = freeFrames.back();
+  freeFrames.pop_back();
+
+  presenter = std::thread(copyLoop);
+  std::atexit(stopPresentThread); //runs before SDL_Quit, which was registered first
+}
+
 //The screen function: sets up the window for 32-bit color graphics.
 //Creates a graphical screen of width*height pixels in 32-bit color.
 //Set fullscreen to 0 for a window, or to 1 for fullscreen output
 //text is the caption or title of the window
 //also inits SDL
+#ifdef QUICKCG_SDL2
+void screen(int width, int height, bool fullscreen, const std::string& text)
+{
+  w = width;
+  h = height;
+
+  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) < 0)
+  {
+    printf("Unable to init SDL: %s\n", SDL_GetError());
+    SDL_Quit();
+    std::exit(1);
+  }
+  std::atexit(SDL_Quit);
+
+  window = SDL_CreateWindow(text.c_str(), SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width * screenScale, height * screenScale,
+                            fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : SDL_WINDOW_RESIZABLE);
+  if(window) createRenderer(width, height);
+  if(texture && screenBuffers > 1) startPresentThread(width, height);
+  else if(texture) scr = SDL_CreateRGBSurface(0, width, height, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0); //same layout as the texture
+  if(texture == NULL || scr == NULL)
+  {
+    printf("Unable to set video: %s\n", SDL_GetError());
+    SDL_Quit();
+    std::exit(1);
+  }
+
+  SDL_StartTextInput(); //for the text input things
+}
+#else
 void screen(int width, int height, bool fullscreen, const std::string& text)
 {
   int colorDepth = 32;
@@ -112,12 +400,12 @@ void screen(int width, int height, bool fullscreen, const std::string& text)
   std::atexit(SDL_Quit);
   if(fullscreen)
   {
-    scr = SDL_SetVideoMode(width, height, colorDepth, SDL_SWSURFACE | SDL_FULLSCREEN);
+    scr = display = SDL_SetVideoMode(width, height, colorDepth, SDL_SWSURFACE | SDL_FULLSCREEN);
     lock();
   }
   else
   {
-    scr = SDL_SetVideoMode(width, height, colorDepth, SDL_HWSURFACE | SDL_HWPALETTE);
+    scr = display = SDL_SetVideoMode(width, height, colorDepth, SDL_HWSURFACE | SDL_HWPALETTE);
   }
   if(scr == NULL)
   {
@@ -128,6 +416,33 @@ void screen(int width, int height, bool fullscreen, const std::string& text)
   SDL_WM_SetCaption(text.c_str(), NULL);
 
   SDL_EnableUNICODE(1); //for the text input things
+  //scr becomes the first of the buffers, which are copied straight into the window surface if it has their layout
+  SDL_PixelFormat* format = display->format;
+  bool sameLayout = format->BitsPerPixel == 32 && format->Rmask == 0x00FF0000 && format->Gmask == 0x0000FF00 && format->Bmask == 0x000000FF;
+  if(screenBuffers > 1 && sameLayout) startPresentThread(width, height);
+}
+#endif
+
+//Sets up a screen without a window: everything is drawn into a 32-bit surface in memory
+//and redraw does nothing. Only the timer is initialized, so this also works without a display.
+void screenHeadless(int width, int height)
+{
+  w = width;
+  h = height;
+
+  if(SDL_Init(SDL_INIT_TIMER) < 0)
+  {
+    printf("Unable to init SDL: %s\n", SDL_GetError());
+    std::exit(1);
+  }
+  std::atexit(SDL_Quit);
+  scr = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+  if(scr == NULL)
+  {
+    printf("Unable to create surface: %s\n", SDL_GetError());
+    std::exit(1);
+  }
+  headless = true;
 }
 
 //Locks the screen
@@ -147,25 +462,59 @@ void unlock()
 
 //Updates the screen.  Has to be called to view new pixels, but use only after
 //drawing the whole screen because it's slow.
+//With two buffers (see screenOptions) the frame is copied on another thread instead and presented by the next
+//redraw or readKeys after the copy, and scr moves on to the other buffer, which holds an older frame: draw every
+//pixel of the next frame, or clear it first.
 void redraw()
 {
-  SDL_UpdateRect(scr, 0, 0, 0, 0);
+  if(headless) return;
+  if(!presenter.joinable())
+  {
+    presentFrame(scr);
+    return;
+  }
+
+  finishPresent(true); //the previous frame, if readKeys didn't present it yet
+  void* pixels;
+  int pitch;
+  if(!lockTarget(pixels, pitch)) return; //nowhere to copy to, this frame is skipped
+
+  std::lock_guard<std::mutex> lock(presentMutex);
+  copyFrame = scr;
+  copyPixels = pixels;
+  copyPitch = pitch;
+  scr = freeFrames.back(); //the previous frame's buffer, it's copied
+  freeFrames.pop_back();
+  presentChanged.notify_all();
 }
 
 //Clears the screen to black
 void cls(const ColorRGB& color)
 {
-  SDL_FillRect(scr, NULL, 65536 * color.r + 256 * color.g + color.b);
+  SDL_FillRect(scr, NULL, framebuffer().pack(color));
+}
+
+//The pixel format of scr, read from SDL once per call instead of converting every color through SDL_MapRGB
+Framebuffer framebuffer()
+{
+  Framebuffer fb;
+  fb.pixels = (Uint32*)scr->pixels;
+  fb.width = w;
+  fb.height = h;
+  fb.pitch = scr->pitch / 4;
+  fb.rshift = scr->format->Rshift;
+  fb.gshift = scr->format->Gshift;
+  fb.bshift = scr->format->Bshift;
+  fb.alpha = scr->format->Amask;
+  return fb;
 }
 
 //Puts an RGB color pixel at position x,y
 void pset(int x, int y, const ColorRGB& color)
 {
   if(x < 0 || y < 0 || x >= w || y >= h) return;
-  Uint32 colorSDL = SDL_MapRGB(scr->format, color.r, color.g, color.b);
-  Uint32* bufp;
-  bufp = (Uint32*)scr->pixels + y * scr->pitch / 4 + x;
-  *bufp = colorSDL;
+  Framebuffer fb = framebuffer();
+  fb.pset(x, y, fb.pack(color));
 }
 
 //Gets RGB color of pixel at position x,y
@@ -231,16 +580,13 @@ bool onScreen(int x, int y)
 //Waits until you press a key. First the key has to be loose, this means, if you put two sleep functions in a row, the second will only work after you first released the key.
 void sleep()
 {
-  int done = 0;
-  SDL_PollEvent(&event);
-  while(done == 0)
+  readKeys();
+  unsigned downs = keyDownEvents;
+  while(keyDownEvents == downs)
   {
-    while(SDL_PollEvent(&event))
-    {
-      if(event.type == SDL_QUIT) end();
-      if(event.type == SDL_KEYDOWN) done = 1;
-    }
     SDL_Delay(5); //so it consumes less processing power
+    readKeys();
+    if(quitRequested) end();
   }
 }
 
@@ -249,47 +595,112 @@ void sleep(double seconds)
   SDL_Delay(seconds * 1000);
 }
 
-void waitFrame(double oldTime, double frameDuration) //in seconds
+//Waits until the getNanoseconds time target: sleeps most of the way, which can wake up late by anything from
+//tens of microseconds to a couple of milliseconds depending on the OS, and spins the rest
+static void waitUntil(Uint64 target)
 {
-  float time = getTime();
-  while(time - oldTime < frameDuration)
+  Uint64 now = getNanoseconds();
+  if(now + paceSpin < target)
   {
-    time = getTime();
-    SDL_PollEvent(&event);
-    if(event.type == SDL_QUIT) end();
-    inkeys = SDL_GetKeyState(NULL);
-    if(inkeys[SDLK_ESCAPE]) end();
-    SDL_Delay(5); //so it consumes less processing power
+    Uint64 wake = target - paceSpin;
+    std::this_thread::sleep_for(std::chrono::nanoseconds(wake - now));
+    now = getNanoseconds();
+    Uint64 late = now > wake ? now - wake : 0;
+    paceSpin = std::max<Uint64>(200000, std::min<Uint64>(2000000, (paceSpin * 7 + late * 2) / 8)); //twice the typical lateness
+  }
+  while(getNanoseconds() < target) {}
+}
+
+void framePacing(FramePacing mode, double fps)
+{
+  pacingMode = mode;
+  pacePeriod = fps > 0 ? Uint64(1e9 / fps) : 0;
+  paceDeadline = 0;
+#ifdef QUICKCG_SDL2
+  if(mode == PACING_VSYNC) screenVsync = true; //the present waits, done doesn't
+#endif
+}
+
+//called once per frame by done: waits for the frame's deadline if there is one, and records when it started
+static void paceFrame(bool wait)
+{
+  bool timed = pacingMode == PACING_FIXED;
+#ifndef QUICKCG_SDL2
+  timed = timed || pacingMode == PACING_VSYNC; //SDL1 can't wait for vertical sync, so frames are timed at the refresh rate
+#endif
+  Uint64 now = getNanoseconds();
+  if(wait && timed && pacePeriod)
+  {
+    if(paceDeadline == 0 || now > paceDeadline + pacePeriod) paceDeadline = now; //more than a frame behind, start over instead of rushing
+    else waitUntil(paceDeadline);
+    paceDeadline += pacePeriod; //from the deadline rather than from now, so lateness doesn't add up
+    now = getNanoseconds();
+  }
+
+  if(paceLast)
+  {
+    paceIntervals[paceFrames++ % PACE_HISTORY] = now - paceLast;
+    frameTime = (now - paceLast) / 1e9;
+    //a frame that took 4 times more or less than the average, such as a hitch, restarts it so it's never far off
+    bool restart = smoothFrameTime == 0 || frameTime > smoothFrameTime * 4 || frameTime * 4 < smoothFrameTime;
+    smoothFrameTime = restart ? frameTime : smoothFrameTime + (frameTime - smoothFrameTime) / 8;
+  }
+  paceLast = now;
+}
+
+FramePacingStats framePacingStats()
+{
+  FramePacingStats stats = {0, 0, 0, 0, 0};
+  int frames = std::min(paceFrames, PACE_HISTORY);
+  if(frames == 0) return stats;
+
+  double sum = 0, sumSquares = 0;
+  for(int i = 0; i < frames; i++)
+  {
+    double ms = paceIntervals[i] / 1000000.0;
+    sum += ms;
+    sumSquares += ms * ms;
+    stats.worstMs = std::max(stats.worstMs, ms);
+    if(pacePeriod && paceIntervals[i] > pacePeriod * 3 / 2) stats.late++;
   }
+  stats.meanMs = sum / frames;
+  stats.jitterMs = std::sqrt(std::max(0.0, sumSquares / frames - stats.meanMs * stats.meanMs));
+  stats.fps = 1000.0 / stats.meanMs;
+  return stats;
+}
+
+void waitFrame(double oldTime, double frameDuration) //in seconds
+{
+  readKeys();
+  if(quitRequested || keyDown(SDLK_ESCAPE)) end();
+  double remaining = frameDuration - (getTime() - oldTime);
+  if(remaining > 0) waitUntil(getNanoseconds() + Uint64(remaining * 1e9));
 }
 
-//Returns 1 if you close the window or press the escape key. Also handles everything that's needed per frame.
-//Never put key input code right before done() or SDL may see the key as SDL_QUIT
-bool done(bool quit_if_esc, bool delay) //delay makes CPU have some free time, use once per frame to avoid 100% usage of a CPU core
+//Returns 1 if you close the window or press the escape key. Also handles everything that's needed per frame:
+//waits for the next frame, then reads the input, so it's as fresh as it can be when the frame is drawn
+bool done(bool quit_if_esc, bool delay) //delay waits for the next frame as set by framePacing, use once per frame
 {
-  if(delay) SDL_Delay(5); //so it consumes less processing power
-  int done = 0;
-  if(!SDL_PollEvent(&event)) return 0;
+  paceFrame(delay);
   readKeys();
-  if(quit_if_esc && inkeys[SDLK_ESCAPE]) done = 1;
-  if(event.type == SDL_QUIT) done = 1;
-  return done;
+  return quitRequested || (quit_if_esc && keyDown(SDLK_ESCAPE));
 }
 
 //Ends the program
 void end()
 {
+  stopPresentThread();
   SDL_Quit();
   std::exit(1);
 }
 
-//Gives value of pressed key to inkeys.
-//the variable inkeys can then be used anywhere to check for input
-//Normally you have to use readkeys every time you want to use inkeys, but the done() function also uses inkeys so it's not needed to use readkeys if you use done().
+//Takes every queued event and updates the key states keyDown and keyPressed use.
+//done() already does this once per frame, call it again to sample the keys later in a frame
 void readKeys()
 {
-  SDL_PollEvent(&event);
-  inkeys = SDL_GetKeyState(NULL);
+  if(presenter.joinable()) finishPresent(false); //the frame redraw handed over, if it's copied by now
+  Uint64 now = getNanoseconds();
+  while(pollEvent()) handleEvent(event, now);
 }
 
 void getMouseState(int& mouseX, int& mouseY)
@@ -310,7 +721,22 @@ void getMouseState(int& mouseX, int& mouseY, bool& LMB, bool& RMB)
 //Returns the time in milliseconds since the program started
 unsigned long getTicks()
 {
-  return SDL_GetTicks();
+  return (getNanoseconds() - clockStart) / 1000000;
+}
+
+double getTime()
+{
+  return (getNanoseconds() - clockStart) / 1e9;
+}
+
+double getFrameTime()
+{
+  return frameTime;
+}
+
+double getSmoothFrameTime()
+{
+  return smoothFrameTime;
 }
 
 
@@ -327,14 +753,8 @@ bool horLine(int y, int x1, int x2, const ColorRGB& color)
   if(x1 < 0) x1 = 0; //clip
   if(x2 >= w) x2 = w - 1; //clip
 
-  Uint32 colorSDL = SDL_MapRGB(scr->format, color.r, color.g, color.b);
-  Uint32* bufp;
-  bufp = (Uint32*)scr->pixels + y * scr->pitch / 4 + x1;
-  for(int x = x1; x <= x2; x++)
-  {
-    *bufp = colorSDL;
-    bufp++;
-  }
+  Framebuffer fb = framebuffer();
+  fb.horSpan(y, x1, x2, fb.pack(color));
   return 1;
 }
 
@@ -347,15 +767,8 @@ bool verLine(int x, int y1, int y2, const ColorRGB& color)
   if(y1 < 0) y1 = 0; //clip
   if(y2 >= h) y2 = h - 1; //clip
 
-  Uint32 colorSDL = SDL_MapRGB(scr->format, color.r, color.g, color.b);
-  Uint32* bufp;
-
-  bufp = (Uint32*)scr->pixels + y1 * scr->pitch / 4 + x;
-  for(int y = y1; y <= y2; y++)
-  {
-     *bufp = colorSDL;
-     bufp += scr->pitch / 4;
-  }
+  Framebuffer fb = framebuffer();
+  fb.verSpan(x, y1, y2, fb.pack(color));
   return 1;
 }
 
@@ -367,10 +780,9 @@ int* verLineDepth(int x, int y1, int y2, const ColorRGB& color, int* buffer, int
   if(y1 < 0) y1 = 0; //clip
   if(y2 >= h) y2 = h - 1; //clip
 
-  Uint32 colorSDL = SDL_MapRGB(scr->format, color.r, color.g, color.b);
-  Uint32* bufp;
-
-  bufp = (Uint32*)scr->pixels + y1 * scr->pitch / 4 + x;
+  Framebuffer fb = framebuffer();
+  Uint32 colorSDL = fb.pack(color);
+  Uint32* bufp = fb.at(x, y1);
 
   for(int y = y1; y <= y2; y++)
   {    
@@ -381,7 +793,7 @@ int* verLineDepth(int x, int y1, int y2, const ColorRGB& color, int* buffer, int
      *count = *count + 1;
     }
     
-    bufp += scr->pitch / 4;
+    bufp += fb.pitch;
   }
   return buffer;
 }
@@ -397,17 +809,16 @@ double* verLineZDepth(int x, int y1, int y2, const ColorRGB& color, double* buff
   if(color.r == 0 && color.g == 0 && color.b == 0)
     std::cout << "PANIC\n";
     
-  Uint32 colorSDL = SDL_MapRGB(scr->format, color.r, color.g, color.b);
-  Uint32* bufp;
-
-  bufp = (Uint32*)scr->pixels + y1 * scr->pitch / 4 + x;
+  Framebuffer fb = framebuffer();
+  Uint32 colorSDL = fb.pack(color);
+  Uint32* bufp = fb.at(x, y1);
     //std::cout << buffer[y1] << " " << distance << "\n";
   for(int y = y1; y <= y2; y++)
   {      
     if(y < width && buffer[y] > distance)
     {
      *bufp = colorSDL;
-     bufp += scr->pitch / 4;
+     bufp += fb.pitch;
      buffer[y] = distance;
      *count = *count + 1;
     }
@@ -417,20 +828,24 @@ double* verLineZDepth(int x, int y1, int y2, const ColorRGB& color, double* buff
 
 //Fast vertical line from (x,y1) to (x,y2), with rgb color and depth buffer
 int* verLineTriDepth(int x, int y1, int y2, const ColorRGB& color, int* buffer, int width, int* count, int mode, int* buftwo)
+{
+  Framebuffer fb = framebuffer();
+  return verLineTriDepth(fb, x, y1, y2, fb.pack(color), buffer, width, count, mode, buftwo);
+}
+
+//The same with a packed color, for renderers that draw thousands of these per frame
+int* verLineTriDepth(const Framebuffer& fb, int x, int y1, int y2, Uint32 colorSDL, int* buffer, int width, int* count, int mode, int* buftwo)
 {
   if(y2 < y1) {y1 += y2; y2 = y1 - y2; y1 -= y2;} //swap y1 and y2
-  if(y2 < 0 || y1 >= h  || x < 0 || x >= w) return NULL; //no single point of the line is on screen
+  if(y2 < 0 || y1 >= fb.height || x < 0 || x >= fb.width) return NULL; //no single point of the line is on screen
   if(y1 < 0) y1 = 0; //clip
-  if(y2 >= h) y2 = h - 1; //clip
-    
-  Uint32 colorSDL = SDL_MapRGB(scr->format, color.r, color.g, color.b);
-  Uint32* bufp;
+  if(y2 >= fb.height) y2 = fb.height - 1; //clip
 
-  bufp = (Uint32*)scr->pixels + (y1 * scr->pitch /4 + x);
+  Uint32* bufp = fb.at(x, y1);
 
   for(int y = y1; y <= y2; y+=1)
   {      
-    bufp += scr->pitch / 4;
+    bufp += fb.pitch;
 
     if(y < width-1)
     {
@@ -595,8 +1010,7 @@ bool drawRect(int x1, int y1, int x2, int y2, const ColorRGB& color)
   rec.y = y1;
   rec.w = x2 - x1 + 1;
   rec.h = y2 - y1 + 1;
-  Uint32 colorSDL = SDL_MapRGB(scr->format, color.r, color.g, color.b);
-  SDL_FillRect(scr, &rec, colorSDL);  //SDL's ability to draw a hardware rectangle is used for now
+  SDL_FillRect(scr, &rec, framebuffer().pack(color));  //SDL's ability to draw a hardware rectangle is used for now
   return 1;
 }
 
@@ -787,6 +1201,100 @@ bool operator!=(const ColorRGB& color, const ColorRGB& color2)
   return(!(color.r == color2.r && color.g == color2.g && color.b == color2.b));
 }
 
+//The array versions of shade and blend. Each color is spread to 16 bits per channel, so channels can be
+//multiplied without spilling into each other, and packed back; 4 colors go through an SSE2 register at once,
+//8 through an AVX2 one. The colors the registers don't fit go through the single color versions.
+
+void shadeColors(Color32* colors, int count, Uint32 scale)
+{
+  if(scale >= 65536) return;
+  int i = 0;
+#if defined(__AVX2__)
+  __m256i zero8 = _mm256_setzero_si256(), scale8 = _mm256_set1_epi16(short(scale));
+  for(; i + 8 <= count; i += 8)
+  {
+    __m256i c = _mm256_loadu_si256((__m256i*)(colors + i));
+    __m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(c, zero8), scale8); //(channel * scale) >> 16
+    __m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(c, zero8), scale8);
+    _mm256_storeu_si256((__m256i*)(colors + i), _mm256_packus_epi16(lo, hi));
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128(), scale4 = _mm_set1_epi16(short(scale));
+  for(; i + 4 <= count; i += 4)
+  {
+    __m128i c = _mm_loadu_si128((__m128i*)(colors + i));
+    __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(c, zero), scale4);
+    __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(c, zero), scale4);
+    _mm_storeu_si128((__m128i*)(colors + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for(; i < count; i++) colors[i] = shade(colors[i], scale);
+}
+
+void blendColors(Color32* colors, const Color32* colors2, int count, Uint32 t)
+{
+  int i = 0;
+#if defined(__AVX2__)
+  __m256i zero8 = _mm256_setzero_si256(), t8 = _mm256_set1_epi16(short(t)), u8 = _mm256_set1_epi16(short(256 - t));
+  for(; i + 8 <= count; i += 8)
+  {
+    __m256i a = _mm256_loadu_si256((__m256i*)(colors + i)), b = _mm256_loadu_si256((__m256i*)(colors2 + i));
+    //a * (256 - t) + b * t never exceeds 255 * 256, so it fits the 16 bits
+    __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero8), u8), _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero8), t8));
+    __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero8), u8), _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero8), t8));
+    _mm256_storeu_si256((__m256i*)(colors + i), _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128(), t4 = _mm_set1_epi16(short(t)), u4 = _mm_set1_epi16(short(256 - t));
+  for(; i + 4 <= count; i += 4)
+  {
+    __m128i a = _mm_loadu_si128((__m128i*)(colors + i)), b = _mm_loadu_si128((__m128i*)(colors2 + i));
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), u4), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), t4));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), u4), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), t4));
+    _mm_storeu_si128((__m128i*)(colors + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+  }
+#endif
+  for(; i < count; i++) colors[i] = blend(colors[i], colors2[i], t);
+}
+
+void fogColors(Color32* colors, int count, Color32 fog, const Uint16* amounts)
+{
+  int i = 0;
+#if defined(__AVX2__)
+  __m256i zero8 = _mm256_setzero_si256(), full8 = _mm256_set1_epi16(256);
+  __m256i fog8 = _mm256_unpacklo_epi8(_mm256_set1_epi32(fog.value), zero8);
+  for(; i + 8 <= count; i += 8)
+  {
+    //every color's amount for each of its 4 channels, in the order unpacklo and unpackhi leave the colors in:
+    //0 1 4 5 and 2 3 6 7
+    __m128i t = _mm_loadu_si128((const __m128i*)(amounts + i));
+    __m256i tt = _mm256_set_m128i(_mm_unpackhi_epi16(t, t), _mm_unpacklo_epi16(t, t));
+    __m256i tlo = _mm256_unpacklo_epi32(tt, tt), thi = _mm256_unpackhi_epi32(tt, tt);
+    __m256i c = _mm256_loadu_si256((__m256i*)(colors + i));
+    __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(c, zero8), _mm256_sub_epi16(full8, tlo)), _mm256_mullo_epi16(fog8, tlo));
+    __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(c, zero8), _mm256_sub_epi16(full8, thi)), _mm256_mullo_epi16(fog8, thi));
+    _mm256_storeu_si256((__m256i*)(colors + i), _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128(), full4 = _mm_set1_epi16(256);
+  __m128i fog4 = _mm_unpacklo_epi8(_mm_set1_epi32(fog.value), zero);
+  for(; i + 4 <= count; i += 4)
+  {
+    __m128i t = _mm_loadl_epi64((const __m128i*)(amounts + i));
+    __m128i tt = _mm_unpacklo_epi16(t, t);
+    __m128i tlo = _mm_unpacklo_epi32(tt, tt), thi = _mm_unpackhi_epi32(tt, tt); //colors 0 1 and 2 3
+    __m128i c = _mm_loadu_si128((__m128i*)(colors + i));
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(c, zero), _mm_sub_epi16(full4, tlo)), _mm_mullo_epi16(fog4, tlo));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(c, zero), _mm_sub_epi16(full4, thi)), _mm_mullo_epi16(fog4, thi));
+    _mm_storeu_si128((__m128i*)(colors + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+  }
+#endif
+  for(; i < count; i++) colors[i] = blend(colors[i], fog, amounts[i]);
+}
+
 ColorHSL::ColorHSL(Uint8 h, Uint8 s, Uint8 l)
 {
   this->h = h;
@@ -1037,20 +1545,166 @@ void saveFile(const std::vector<unsigned char>& buffer, const std::string& filen
 //IMAGE FUNCTIONS///////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-int loadImage(std::vector<ColorRGB>& out, unsigned long& w, unsigned long& h, const std::string& filename)
+/*
+Decoded images are cached as raw RGBA in imageCacheDir, one file per PNG named after a hash of its absolute path,
+size and modification time: "QCGI", version, width, height (32 bit), that hash and the size of the PNG (64 bit),
+then the pixels. Later loads map that file without reading the PNG at all. Changing the PNG changes its time, so
+stale entries are simply never used again.
+*/
+#define imageCacheVersion 2 //version 1 was named after a hash of the whole PNG
+#define imageCacheHeaderSize 32
+
+static bool imageCacheDirSet = false;
+static std::string imageCacheDir;
+
+void setImageCacheDir(const std::string& dir)
+{
+  imageCacheDir = dir;
+  imageCacheDirSet = true;
+}
+
+static const std::string& getImageCacheDir()
+{
+  if(!imageCacheDirSet)
+  {
+    const char* xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if(xdg && xdg[0]) imageCacheDir = std::string(xdg) + "/quickcg";
+    else if(home && home[0]) imageCacheDir = std::string(home) + "/.cache/quickcg";
+    imageCacheDirSet = true;
+  }
+  return imageCacheDir;
+}
+
+static unsigned long long hashBytes(const void* data, size_t size, unsigned long long hash = 14695981039346656037ull) //FNV-1a
+{
+  for(size_t i = 0; i < size; i++) hash = (hash ^ ((const unsigned char*)data)[i]) * 1099511628211ull;
+  return hash;
+}
+
+//RGBA pixels of a loaded image, either mapped from the cache or decoded
+struct ImagePixels
 {
-  std::vector<unsigned char> file, image;
+  std::vector<unsigned char> decoded;
+  const unsigned char* pixels;
+  void* mapping;
+  size_t mappingSize;
+
+  ImagePixels() : pixels(0), mapping(0), mappingSize(0) {}
+  ~ImagePixels()
+  {
+#ifdef __linux__
+    if(mapping) munmap(mapping, mappingSize);
+#endif
+  }
+};
+
+#ifdef __linux__
+static bool mapCachedImage(ImagePixels& image, unsigned long& w, unsigned long& h, const std::string& name, unsigned long long hash, size_t pngSize)
+{
+  int fd = open(name.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+
+  struct stat st;
+  void* mapping = MAP_FAILED;
+  if(fstat(fd, &st) == 0 && size_t(st.st_size) >= imageCacheHeaderSize)
+    mapping = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED) return false;
+
+  const unsigned char* header = (const unsigned char*)mapping;
+  unsigned long long cachedHash, cachedSize;
+  unsigned int version, width, height;
+  memcpy(&version, header + 4, 4); memcpy(&width, header + 8, 4); memcpy(&height, header + 12, 4);
+  memcpy(&cachedHash, header + 16, 8); memcpy(&cachedSize, header + 24, 8);
+
+  //a torn or foreign file is ignored, and replaced when the image has been decoded
+  if(memcmp(header, "QCGI", 4) != 0 || version != imageCacheVersion || cachedHash != hash || cachedSize != pngSize
+  || size_t(st.st_size) != imageCacheHeaderSize + 4 * size_t(width) * height)
+  {
+    munmap(mapping, st.st_size);
+    return false;
+  }
+
+  image.mapping = mapping;
+  image.mappingSize = st.st_size;
+  image.pixels = header + imageCacheHeaderSize;
+  w = width;
+  h = height;
+  return true;
+}
+
+static void cacheImage(const ImagePixels& image, unsigned long w, unsigned long h, const std::string& name, unsigned long long hash, size_t pngSize)
+{
+  //creates the directory and its parents, existing ones are fine
+  const std::string& dir = getImageCacheDir();
+  for(size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1))
+  {
+    mkdir(dir.substr(0, slash).c_str(), 0755);
+    if(slash == std::string::npos) break;
+  }
+
+  unsigned char header[imageCacheHeaderSize];
+  unsigned int version = imageCacheVersion, width = w, height = h;
+  unsigned long long size = pngSize;
+  memcpy(header, "QCGI", 4); memcpy(header + 4, &version, 4); memcpy(header + 8, &width, 4); memcpy(header + 12, &height, 4);
+  memcpy(header + 16, &hash, 8); memcpy(header + 24, &size, 8);
+
+  //written under a temporary name and renamed, so a viewer starting at the same time never maps half a file
+  std::string temp = name + "." + std::to_string(getpid()) + ".tmp";
+  std::ofstream file(temp.c_str(), std::ios::out|std::ios::binary);
+  file.write((const char*)header, imageCacheHeaderSize);
+  file.write((const char*)image.pixels, std::streamsize(4 * w * h));
+  file.close();
+  if(!file.good() || rename(temp.c_str(), name.c_str()) != 0) remove(temp.c_str());
+}
+#endif
+
+//maps the image from the cache if it's there, otherwise decodes it and adds it to the cache
+static int loadImagePixels(ImagePixels& image, unsigned long& w, unsigned long& h, const std::string& filename)
+{
+#ifdef __linux__
+  const std::string& dir = getImageCacheDir();
+  unsigned long long hash = 0;
+  std::string name;
+  struct stat st;
+  char* path = dir.empty() || stat(filename.c_str(), &st) != 0 ? 0 : realpath(filename.c_str(), 0);
+  if(path)
+  {
+    long long stamp[3] = {(long long)st.st_size, (long long)st.st_mtim.tv_sec, (long long)st.st_mtim.tv_nsec};
+    hash = hashBytes(stamp, sizeof(stamp), hashBytes(path, strlen(path)));
+    free(path);
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", hash);
+    name = dir + "/" + hex + ".rgba";
+    if(mapCachedImage(image, w, h, name, hash, st.st_size)) return 0;
+  }
+#endif
+
+  std::vector<unsigned char> file;
   loadFile(file, filename);
-  if(decodePNG(image, w, h, file)) return 1;
 
-  out.resize(image.size() / 4);
+  if(decodePNG(image.decoded, w, h, file)) return 1;
+  image.pixels = image.decoded.empty() ? 0 : &image.decoded[0];
+
+#ifdef __linux__
+  if(!name.empty() && file.size() == size_t(st.st_size)) cacheImage(image, w, h, name, hash, file.size());
+#endif
+  return 0;
+}
+
+int loadImage(std::vector<ColorRGB>& out, unsigned long& w, unsigned long& h, const std::string& filename)
+{
+  ImagePixels image;
+  if(loadImagePixels(image, w, h, filename)) return 1;
+
+  out.resize(w * h);
 
   for(size_t i = 0; i < out.size(); i++)
   {
-    out[i].r = image[i * 4 + 0];
-    out[i].g = image[i * 4 + 1];
-    out[i].b = image[i * 4 + 2];
-    //out[i].a = image[i * 4 + 3];
+    out[i].r = image.pixels[i * 4 + 0];
+    out[i].g = image.pixels[i * 4 + 1];
+    out[i].b = image.pixels[i * 4 + 2];
+    //out[i].a = image.pixels[i * 4 + 3];
   }
 
   return 0;
@@ -1058,15 +1712,14 @@ int loadImage(std::vector<ColorRGB>& out, unsigned long& w, unsigned long& h, co
 
 int loadImage(std::vector<Uint32>& out, unsigned long& w, unsigned long& h, const std::string& filename)
 {
-  std::vector<unsigned char> file, image;
-  loadFile(file, filename);
-  if(decodePNG(image, w, h, file)) return 1;
+  ImagePixels image;
+  if(loadImagePixels(image, w, h, filename)) return 1;
 
-  out.resize(image.size() / 4);
+  out.resize(w * h);
 
   for(size_t i = 0; i < out.size(); i++)
   {
-    out[i] = 0x1000000 * image[i * 4 + 3] + 0x10000 * image[i * 4 + 0] + 0x100 * image[i * 4 + 1] + image[i * 4 + 2];
+    out[i] = 0x1000000 * image.pixels[i * 4 + 3] + 0x10000 * image.pixels[i * 4 + 0] + 0x100 * image.pixels[i * 4 + 1] + image.pixels[i * 4 + 2];
   }
 
   return 0;
@@ -1076,17 +1729,43 @@ int loadImage(std::vector<Uint32>& out, unsigned long& w, unsigned long& h, cons
 //TEXT FUNCTIONS////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-//Draws character n at position x,y with color RGB and, if enabled, background color
-//This function is used by the text printing functions below, and uses the font data
-//defined below to draw the letter pixel by pixel
+//Draws glyph n a row at a time straight into the framebuffer: every bit of a font row picks the text color or
+//what's behind it (or bgColor), without a branch per pixel. The glyph has to be completely on screen
+static void blitLetter(const Framebuffer& fb, unsigned char n, int x, int y, Uint32 color, bool bg, Uint32 bgColor)
+{
+  for(int v = 0; v < 8; v++)
+  {
+    Uint32* p = fb.at(x, y + v);
+    unsigned bits = font[n][v];
+    for(int u = 0; u < 8; u++)
+    {
+      Uint32 mask = 0u - ((bits >> u) & 1);
+      p[u] = (color & mask) | ((bg ? bgColor : p[u]) & ~mask);
+    }
+  }
+}
+
+static bool letterOnScreen(int x, int y)
+{
+  return x >= 0 && y >= 0 && x <= w - 8 && y <= h - 8;
+}
+
+//Draws character n at x, y with an 8x8 font; bg also fills the pixels around the letter with color2
 void drawLetter(unsigned char n, int x, int y, const ColorRGB& color, bool bg, const ColorRGB& color2)
 {
+  if(letterOnScreen(x, y))
+  {
+    Framebuffer fb = framebuffer();
+    blitLetter(fb, n, x, y, fb.pack(color), bg, fb.pack(color2));
+    return;
+  }
+
   int u,v;
 
   for (v = 0; v < 8; v++)
   for (u = 0; u < 8; u++)
   {
-    if(font[n][u][v]) pset(x + u, y + v, color);
+    if((font[n][v] >> u) & 1) pset(x + u, y + v, color);
     else if(bg) pset(x + u, y + v, color2);
   }
 }
@@ -1094,19 +1773,21 @@ void drawLetter(unsigned char n, int x, int y, const ColorRGB& color, bool bg, c
 //Draws a string of text
 int printString(const std::string& text, int x, int y, const ColorRGB& color, bool bg, const ColorRGB& color2, int forceLength)
 {
+  return printChars(text.data(), int(text.size()), x, y, color, bg, color2, forceLength);
+}
+
+//Draws length characters of text, packing the colors once for all of them
+int printChars(const char* text, int length, int x, int y, const ColorRGB& color, bool bg, const ColorRGB& color2, int forceLength)
+{
+  Framebuffer fb = framebuffer();
+  Uint32 packed = fb.pack(color), packedBg = fb.pack(color2);
   int amount = 0;
-  for(size_t i = 0; i < text.size(); i++)
-  {
-    amount++;
-    drawLetter(text[i], x, y, color, bg, color2);
-    x += 8;
-    if(x > w - 8) {x %= 8; y += 8;}
-    if(y > h - 8) {y %= 8;}
-  }
-  while(amount < forceLength)
+  while(amount < length || amount < forceLength)
   {
+    unsigned char n = amount < length ? text[amount] : ' ';
     amount++;
-    drawLetter(' ', x, y, color, bg, color2);
+    if(letterOnScreen(x, y)) blitLetter(fb, n, x, y, packed, bg, packedBg);
+    else drawLetter(n, x, y, color, bg, color2);
     x += 8;
     if(x > w - 8) {x %= 8; y += 8;}
     if(y > h - 8) {y %= 8;}
@@ -1122,25 +1803,15 @@ const int ASCII_ENTER = 13;
 const int ASCII_BACKSPACE = 8;
 const int ASCII_SPACE = 32; //smallest printable ascii char
 
+//the next character typed since the last call (readKeys collects them), 0 if there are none
 Uint8 getInputCharacter()
 {
-  int ascii = 0;
-  static int previouschar = 0;
-
-  if ((event.key.keysym.unicode & 0xFF80) == 0)
+  while(typedFirst != typedEnd)
   {
-    if(event.type == SDL_KEYDOWN)
-    {
-      ascii = event.key.keysym.unicode & 0x7F;
-    }
+    int ascii = typed[typedFirst++ % TYPED_MAX];
+    if(ascii >= ASCII_SPACE || ascii == ASCII_ENTER || ascii == ASCII_BACKSPACE) return ascii; //<32 ones, except enter and backspace
   }
-
-  if(ascii < ASCII_SPACE && ascii != ASCII_ENTER && ascii != ASCII_BACKSPACE) ascii = 0; //<32 ones, except enter and backspace
-
-  if(ascii != previouschar) previouschar = ascii;
-  else ascii = 0;
-
-  return ascii;
+  return 0;
 }
 //returns a string, length is the maximum length of the given string array
 void getInputString(std::string& text, const std::string& message, bool clear, int x, int y, const ColorRGB& color, bool bg, const ColorRGB& color2)
@@ -1293,180 +1964,184 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
   static const unsigned long CLCL[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15}; //code length code lengths
   struct Zlib //nested functions for zlib decompression
   {
-    static unsigned long readBitFromStream(size_t& bitp, const unsigned char* bits) { unsigned long result = (bits[bitp >> 3] >> (bitp & 0x7)) & 1; bitp++; return result;}
-    static unsigned long readBitsFromStream(size_t& bitp, const unsigned char* bits, size_t nbits)
+    struct BitReader //reads the stream LSB first through a 64 bit buffer that's refilled a word at a time
     {
-      unsigned long result = 0;
-      for(size_t i = 0; i < nbits; i++) result += (readBitFromStream(bitp, bits)) << i;
-      return result;
-    }
-    struct HuffmanTree
+      const unsigned char* in; size_t size, pos; //pos is the next byte to go into the buffer
+      unsigned long long buffer; unsigned long count; //count is the number of bits in the buffer
+      BitReader(const unsigned char* in, size_t size) : in(in), size(size), pos(0), buffer(0), count(0) {}
+      void refill() //tops the buffer up to at least 56 bits, past the end of the stream it's filled with zeros
+      {
+        if(pos + 8 <= size)
+        {
+          unsigned long long word = 0;
+          for(int i = 0; i < 8; i++) word |= (unsigned long long)in[pos + i] << (8 * i); //compiles to a single load on little endian machines
+          buffer |= word << count;
+          pos += (63 - count) >> 3; count |= 56;
+        }
+        else for(; count <= 56; count += 8) buffer |= (unsigned long long)(pos < size ? in[pos++] : (pos++, 0)) << count;
+      }
+      unsigned long peek(unsigned long nbits) const { return (unsigned long)(buffer & ((1ull << nbits) - 1)); }
+      void skip(unsigned long nbits) { buffer >>= nbits; count -= nbits; }
+      unsigned long read(unsigned long nbits) { if(count < nbits) refill(); unsigned long result = peek(nbits); skip(nbits); return result; } //up to 56 bits
+      bool pastEnd() const { return pos * 8 - count > size * 8; } //true if bits were used that aren't in the stream
+      size_t alignToByte() { skip(count & 7); size_t p = pos - count / 8; pos = p; buffer = 0; count = 0; return p; } //returns the byte position
+    };
+    struct HuffmanTree //canonical Huffman code, codes up to FASTBITS long are decoded with a single table lookup
     {
-      int makeFromLengths(const std::vector<unsigned long>& bitlen, unsigned long maxbitlen)
-      { //make tree given the lengths
-        unsigned long numcodes = (unsigned long)(bitlen.size()), treepos = 0, nodefilled = 0;
-        std::vector<unsigned long> tree1d(numcodes), blcount(maxbitlen + 1, 0), nextcode(maxbitlen + 1, 0);
-        for(unsigned long bits = 0; bits < numcodes; bits++) blcount[bitlen[bits]]++; //count number of instances of each code length
-        for(unsigned long bits = 1; bits <= maxbitlen; bits++) nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
-        for(unsigned long n = 0; n < numcodes; n++) if(bitlen[n] != 0) tree1d[n] = nextcode[bitlen[n]]++; //generate all the codes
-        tree2d.clear(); tree2d.resize(numcodes * 2, 32767); //32767 here means the tree2d isn't filled there yet
-        for(unsigned long n = 0; n < numcodes; n++) //the codes
-        for(unsigned long i = 0; i < bitlen[n]; i++) //the bits for this code
+      enum { FASTBITS = 10 };
+      unsigned short fast[1 << FASTBITS]; //(symbol << 4) + length of the code that starts with these bits, 0 if the code is longer
+      unsigned long maxcode[17], firstcode[16], firstsymbol[16]; //per code length, maxcode is left aligned to 16 bits
+      unsigned short symbols[288]; //symbols sorted by code
+      static unsigned long reverse(unsigned long code, unsigned long nbits) { unsigned long result = 0; for(unsigned long i = 0; i < nbits; i++) { result = (result << 1) | (code & 1); code >>= 1; } return result; }
+      int makeFromLengths(const unsigned long* bitlen, unsigned long numcodes)
+      { //make the tables given the lengths, codes are at most 15 bits
+        unsigned long blcount[16] = {0}, nextcode[16];
+        for(unsigned long n = 0; n < numcodes; n++) blcount[bitlen[n]]++; //count number of instances of each code length
+        memset(fast, 0, sizeof(fast));
+        unsigned long code = 0, k = 0;
+        for(unsigned long bits = 1; bits < 16; bits++)
         {
-          unsigned long bit = (tree1d[n] >> (bitlen[n] - i - 1)) & 1;
-          if(treepos > numcodes - 2) return 55;
-          if(tree2d[2 * treepos + bit] == 32767) //not yet filled in
-          {
-            if(i + 1 == bitlen[n]) { tree2d[2 * treepos + bit] = n; treepos = 0; } //last bit
-            else { tree2d[2 * treepos + bit] = ++nodefilled + numcodes; treepos = nodefilled; } //addresses are encoded as values > numcodes
-          }
-          else treepos = tree2d[2 * treepos + bit] - numcodes; //subtract numcodes from address to get address value
+          nextcode[bits] = firstcode[bits] = code; firstsymbol[bits] = k;
+          code += blcount[bits]; k += blcount[bits];
+          if(code > (1ul << bits)) return 55; //error: more codes of this length than fit
+          maxcode[bits] = code << (16 - bits);
+          code <<= 1;
+        }
+        maxcode[16] = 0x10000;
+        for(unsigned long n = 0; n < numcodes; n++) if(bitlen[n] != 0)
+        {
+          unsigned long len = bitlen[n], c = nextcode[len]++;
+          symbols[firstsymbol[len] + c - firstcode[len]] = (unsigned short)n;
+          if(len <= FASTBITS) for(unsigned long j = reverse(c, len); j < (1 << FASTBITS); j += (1ul << len)) fast[j] = (unsigned short)((n << 4) | len); //every pattern that starts with this code
         }
         return 0;
       }
-      int decode(bool& decoded, unsigned long& result, size_t& treepos, unsigned long bit) const
-      { //Decodes a symbol from the tree
-        unsigned long numcodes = (unsigned long)tree2d.size() / 2;
-        if(treepos >= numcodes) return 11; //error: you appeared outside the codetree
-        result = tree2d[2 * treepos + bit];
-        decoded = (result < numcodes);
-        treepos = decoded ? 0 : result - numcodes;
-        return 0;
+      long decode(BitReader& br) const
+      { //Decodes a symbol, the buffer must hold at least 15 bits. Returns -1 for a code that doesn't exist
+        unsigned long entry = fast[br.peek(FASTBITS)];
+        if(entry) { br.skip(entry & 15); return (long)(entry >> 4); }
+        unsigned long k = reverse(br.peek(16), 16), len = FASTBITS + 1; //longer codes are compared left aligned
+        while(k >= maxcode[len]) len++;
+        if(len > 15) return -1;
+        br.skip(len);
+        return symbols[firstsymbol[len] + (k >> (16 - len)) - firstcode[len]];
       }
-      std::vector<unsigned long> tree2d; //2D representation of a huffman tree: The one dimension is "0" or "1", the other contains all nodes and leaves of the tree.
     };
     struct Inflator
     {
       int error;
       void inflate(std::vector<unsigned char>& out, const std::vector<unsigned char>& in, size_t inpos = 0)
-      {
-        size_t bp = 0, pos = 0; //bit pointer and byte pointer
+      { //out may be given the expected size up front, it's only grown if the data turns out to be bigger
+        size_t pos = 0; //byte pointer in out
         error = 0;
+        if(inpos >= in.size()) { error = 52; return; } //error, bit pointer will jump past memory
+        BitReader br(&in[inpos], in.size() - inpos);
         unsigned long BFINAL = 0;
         while(!BFINAL && !error)
         {
-          if(bp >> 3 >= in.size()) { error = 52; return; } //error, bit pointer will jump past memory
-          BFINAL = readBitFromStream(bp, &in[inpos]);
-          unsigned long BTYPE = readBitFromStream(bp, &in[inpos]); BTYPE += 2 * readBitFromStream(bp, &in[inpos]);
+          if(br.pastEnd()) { error = 52; return; } //error, bit pointer will jump past memory
+          BFINAL = br.read(1);
+          unsigned long BTYPE = br.read(2);
           if(BTYPE == 3) { error = 20; return; } //error: invalid BTYPE
-          else if(BTYPE == 0) inflateNoCompression(out, &in[inpos], bp, pos, in.size());
-          else inflateHuffmanBlock(out, &in[inpos], bp, pos, in.size(), BTYPE);
+          else if(BTYPE == 0) inflateNoCompression(out, br, pos);
+          else inflateHuffmanBlock(out, br, pos, BTYPE);
         }
         if(!error) out.resize(pos); //Only now we know the true size of out, resize it to that
       }
       void generateFixedTrees(HuffmanTree& tree, HuffmanTree& treeD) //get the tree of a deflated block with fixed tree
       {
-        std::vector<unsigned long> bitlen(288, 8), bitlenD(32, 5);;
-        for(size_t i = 144; i <= 255; i++) bitlen[i] = 9;
-        for(size_t i = 256; i <= 279; i++) bitlen[i] = 7;
-        tree.makeFromLengths(bitlen, 15);
-        treeD.makeFromLengths(bitlenD, 15);
+        unsigned long bitlen[288], bitlenD[32];
+        for(size_t i = 0; i < 288; i++) bitlen[i] = (i <= 143 || i >= 280) ? 8 : (i <= 255 ? 9 : 7);
+        for(size_t i = 0; i < 32; i++) bitlenD[i] = 5;
+        tree.makeFromLengths(bitlen, 288);
+        treeD.makeFromLengths(bitlenD, 32);
       }
       HuffmanTree codetree, codetreeD, codelengthcodetree; //the code tree for Huffman codes, dist codes, and code length codes
-      unsigned long huffmanDecodeSymbol(const unsigned char* in, size_t& bp, const HuffmanTree& codetree, size_t inlength)
-      { //decode a single symbol from given list of bits with given code tree. return value is the symbol
-        bool decoded; unsigned long ct;
-        for(size_t treepos = 0;;)
-        {
-          if((bp & 0x07) == 0 && (bp >> 3) > inlength) { error = 10; return 0; } //error: end reached without endcode
-          error = codetree.decode(decoded, ct, treepos, readBitFromStream(bp, in)); if(error) return 0; //stop, an error happened
-          if(decoded) return ct;
-        }
-      }
-      void getTreeInflateDynamic(HuffmanTree& tree, HuffmanTree& treeD, const unsigned char* in, size_t& bp, size_t inlength)
+      void getTreeInflateDynamic(HuffmanTree& tree, HuffmanTree& treeD, BitReader& br)
       { //get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree
-        std::vector<unsigned long> bitlen(288, 0), bitlenD(32, 0);
-        if(bp >> 3 >= inlength - 2) { error = 49; return; } //the bit pointer is or will go past the memory
-        size_t HLIT =  readBitsFromStream(bp, in, 5) + 257; //number of literal/length codes + 257
-        size_t HDIST = readBitsFromStream(bp, in, 5) + 1; //number of dist codes + 1
-        size_t HCLEN = readBitsFromStream(bp, in, 4) + 4; //number of code length codes + 4
-        std::vector<unsigned long> codelengthcode(19); //lengths of tree to decode the lengths of the dynamic tree
-        for(size_t i = 0; i < 19; i++) codelengthcode[CLCL[i]] = (i < HCLEN) ? readBitsFromStream(bp, in, 3) : 0;
-        error = codelengthcodetree.makeFromLengths(codelengthcode, 7); if(error) return;
+        unsigned long bitlen[320] = {0}; //the literal/length and dist code lengths are one sequence, repeats may cross from one to the other
+        size_t HLIT =  br.read(5) + 257; //number of literal/length codes + 257
+        size_t HDIST = br.read(5) + 1; //number of dist codes + 1
+        size_t HCLEN = br.read(4) + 4; //number of code length codes + 4
+        if(HLIT > 286 || HDIST > 30) { error = 49; return; } //error: more codes than deflate has
+        unsigned long codelengthcode[19]; //lengths of tree to decode the lengths of the dynamic tree
+        for(size_t i = 0; i < 19; i++) codelengthcode[CLCL[i]] = (i < HCLEN) ? br.read(3) : 0;
+        error = codelengthcodetree.makeFromLengths(codelengthcode, 19); if(error) return;
         size_t i = 0, replength;
         while(i < HLIT + HDIST)
         {
-          unsigned long code = huffmanDecodeSymbol(in, bp, codelengthcodetree, inlength); if(error) return;
-          if(code <= 15)  { if(i < HLIT) bitlen[i++] = code; else bitlenD[i++ - HLIT] = code; } //a length code
-          else if(code == 16) //repeat previous
-          {
-            if(bp >> 3 >= inlength) { error = 50; return; } //error, bit pointer jumps past memory
-            replength = 3 + readBitsFromStream(bp, in, 2);
-            unsigned long value; //set value to the previous code
-            if((i - 1) < HLIT) value = bitlen[i - 1];
-            else value = bitlenD[i - HLIT - 1];
-            for(size_t n = 0; n < replength; n++) //repeat this value in the next lengths
-            {
-              if(i >= HLIT + HDIST) { error = 13; return; } //error: i is larger than the amount of codes
-              if(i < HLIT) bitlen[i++] = value; else bitlenD[i++ - HLIT] = value;
-            }
-          }
-          else if(code == 17) //repeat "0" 3-10 times
-          {
-            if(bp >> 3 >= inlength) { error = 50; return; } //error, bit pointer jumps past memory
-            replength = 3 + readBitsFromStream(bp, in, 3);
-            for(size_t n = 0; n < replength; n++) //repeat this value in the next lengths
-            {
-              if(i >= HLIT + HDIST) { error = 14; return; } //error: i is larger than the amount of codes
-              if(i < HLIT) bitlen[i++] = 0; else bitlenD[i++ - HLIT] = 0;
-            }
-          }
-          else if(code == 18) //repeat "0" 11-138 times
+          br.refill();
+          if(br.pastEnd()) { error = 50; return; } //error, bit pointer jumps past memory
+          long code = codelengthcodetree.decode(br);
+          if(code < 0) { error = 11; return; } //error: the code isn't in the code length tree
+          if(code <= 15) { bitlen[i++] = code; continue; } //a length code
+          unsigned long value = 0; //repeats 0 unless it's code 16
+          if(code == 16) //repeat previous
           {
-            if(bp >> 3 >= inlength) { error = 50; return; } //error, bit pointer jumps past memory
-            replength = 11 + readBitsFromStream(bp, in, 7);
-            for(size_t n = 0; n < replength; n++) //repeat this value in the next lengths
-            {
-              if(i >= HLIT + HDIST) { error = 15; return; } //error: i is larger than the amount of codes
-              if(i < HLIT) bitlen[i++] = 0; else bitlenD[i++ - HLIT] = 0;
-            }
+            if(i == 0) { error = 54; return; } //error: there's no previous length to repeat
+            value = bitlen[i - 1]; replength = 3 + br.read(2);
           }
-          else { error = 16; return; } //error: somehow an unexisting code appeared. This can never happen.
+          else if(code == 17) replength = 3 + br.read(3); //repeat "0" 3-10 times
+          else replength = 11 + br.read(7); //code 18, repeat "0" 11-138 times
+          if(i + replength > HLIT + HDIST) { error = 13 + (code - 16); return; } //error: i is larger than the amount of codes
+          for(size_t n = 0; n < replength; n++) bitlen[i++] = value; //repeat this value in the next lengths
         }
         if(bitlen[256] == 0) { error = 64; return; } //the length of the end code 256 must be larger than 0
-        error = tree.makeFromLengths(bitlen, 15); if(error) return; //now we've finally got HLIT and HDIST, so generate the code trees, and the function is done
-        error = treeD.makeFromLengths(bitlenD, 15); if(error) return;
+        error = tree.makeFromLengths(bitlen, HLIT); if(error) return; //now we've finally got HLIT and HDIST, so generate the code trees, and the function is done
+        error = treeD.makeFromLengths(bitlen + HLIT, HDIST); if(error) return;
       }
-      void inflateHuffmanBlock(std::vector<unsigned char>& out, const unsigned char* in, size_t& bp, size_t& pos, size_t inlength, unsigned long btype)
+      void inflateHuffmanBlock(std::vector<unsigned char>& out, BitReader& br, size_t& pos, unsigned long btype)
       {
         if(btype == 1) { generateFixedTrees(codetree, codetreeD); }
-        else if(btype == 2) { getTreeInflateDynamic(codetree, codetreeD, in, bp, inlength); if(error) return; }
+        else if(btype == 2) { getTreeInflateDynamic(codetree, codetreeD, br); if(error) return; }
+        unsigned char* out_ = out.empty() ? 0 : &out[0]; //regular pointer, refreshed whenever out grows
+        size_t outsize = out.size();
         for(;;)
         {
-          unsigned long code = huffmanDecodeSymbol(in, bp, codetree, inlength); if(error) return;
-          if(code == 256) return; //end code
-          else if(code <= 255) //literal symbol
+          br.refill(); //56 bits hold a whole length/distance pair: 15 + 5 + 15 + 13 bits
+          if(br.pastEnd()) { error = 10; return; } //error: end reached without endcode
+          long code = codetree.decode(br);
+          if(code < 0) { error = 11; return; } //error: the code isn't in the codetree
+          if(code <= 255) //literal symbol, up to two more are decoded from the same refill
           {
-            if(pos >= out.size()) out.resize((pos + 1) * 2); //reserve more room
-            out[pos++] = (unsigned char)(code);
+            if(pos + 3 > outsize) { out.resize((pos + 3) * 2); out_ = &out[0]; outsize = out.size(); } //reserve more room
+            out_[pos++] = (unsigned char)(code);
+            for(int n = 0; n < 2 && br.count >= 15; n++)
+            {
+              unsigned long entry = codetree.fast[br.peek(HuffmanTree::FASTBITS)];
+              if(!entry || (entry >> 4) > 255) break; //longer codes and lengths go through the full path
+              br.skip(entry & 15);
+              out_[pos++] = (unsigned char)(entry >> 4);
+            }
           }
-          else if(code >= 257 && code <= 285) //length code
+          else if(code == 256) return; //end code
+          else if(code <= 285) //length code
           {
-            size_t length = LENBASE[code - 257], numextrabits = LENEXTRA[code - 257];
-            if((bp >> 3) >= inlength) { error = 51; return; } //error, bit pointer will jump past memory
-            length += readBitsFromStream(bp, in, numextrabits);
-            unsigned long codeD = huffmanDecodeSymbol(in, bp, codetreeD, inlength); if(error) return;
-            if(codeD > 29) { error = 18; return; } //error: invalid dist code (30-31 are never used)
-            unsigned long dist = DISTBASE[codeD], numextrabitsD = DISTEXTRA[codeD];
-            if((bp >> 3) >= inlength) { error = 51; return; } //error, bit pointer will jump past memory
-            dist += readBitsFromStream(bp, in, numextrabitsD);
-            size_t start = pos, back = start - dist; //backwards
-            if(pos + length >= out.size()) out.resize((pos + length) * 2); //reserve more room
-            for(size_t i = 0; i < length; i++) { out[pos++] = out[back++]; if(back >= start) back = start - dist; }
+            size_t length = LENBASE[code - 257] + br.read(LENEXTRA[code - 257]);
+            long codeD = codetreeD.decode(br);
+            if(codeD < 0 || codeD > 29) { error = 18; return; } //error: invalid dist code (30-31 are never used)
+            size_t dist = DISTBASE[codeD] + br.read(DISTEXTRA[codeD]);
+            if(dist > pos) { error = 17; return; } //error: the distance goes back past the start of the output
+            if(pos + length + 8 > outsize) { out.resize((pos + length + 8) * 2); out_ = &out[0]; outsize = out.size(); } //reserve more room, with slack for the word copies
+            unsigned char* dst = out_ + pos; const unsigned char* src = dst - dist;
+            if(dist >= 8) for(size_t i = 0; i < length; i += 8) memcpy(dst + i, src + i, 8); //8 bytes at a time, may write up to 7 bytes past the end
+            else if(dist == 1) memset(dst, *src, length); //a run of one byte
+            else for(size_t i = 0; i < length; i++) dst[i] = src[i]; //short overlapping distance, the copy repeats the pattern
+            pos += length;
           }
+          else { error = 16; return; } //error: literal/length codes 286-287 are never used
         }
       }
-      void inflateNoCompression(std::vector<unsigned char>& out, const unsigned char* in, size_t& bp, size_t& pos, size_t inlength)
+      void inflateNoCompression(std::vector<unsigned char>& out, BitReader& br, size_t& pos)
       {
-        while((bp & 0x7) != 0) bp++; //go to first boundary of byte
-        size_t p = bp / 8;
-        if(p >= inlength - 4) { error = 52; return; } //error, bit pointer will jump past memory
-        unsigned long LEN = in[p] + 256 * in[p + 1], NLEN = in[p + 2] + 256 * in[p + 3]; p += 4;
+        size_t p = br.alignToByte(), inlength = br.size; //go to first boundary of byte
+        if(p + 4 > inlength) { error = 52; return; } //error, bit pointer will jump past memory
+        unsigned long LEN = br.in[p] + 256 * br.in[p + 1], NLEN = br.in[p + 2] + 256 * br.in[p + 3]; p += 4;
         if(LEN + NLEN != 65535) { error = 21; return; } //error: NLEN is not one's complement of LEN
-        if(pos + LEN >= out.size()) out.resize(pos + LEN);
         if(p + LEN > inlength) { error = 23; return; } //error: reading outside of in buffer
-        for(unsigned long n = 0; n < LEN; n++) out[pos++] = in[p++]; //read LEN bytes of literal data
-        bp = p * 8;
+        if(pos + LEN > out.size()) out.resize(pos + LEN);
+        if(LEN) memcpy(&out[pos], &br.in[p], LEN); //read LEN bytes of literal data
+        pos += LEN; br.pos = p + LEN;
       }
     };
     int decompress(std::vector<unsigned char>& out, const std::vector<unsigned char>& in) //returns error value
@@ -1554,9 +2229,10 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
         pos += 4; //step over CRC (which is ignored)
       }
       unsigned long bpp = getBpp(info);
-      std::vector<unsigned char> scanlines(((info.width * (info.height * bpp + 7)) / 8) + info.height); //now the out buffer will be filled
+      std::vector<unsigned char> scanlines(getScanlinesSize(info, bpp)); //sized from the header so the decompressor never has to grow it
       Zlib zlib; //decompress with the Zlib decompressor
       error = zlib.decompress(scanlines, idat); if(error) return; //stop if the zlib decompressor returned an error
+      if(scanlines.size() < getScanlinesSize(info, bpp)) { error = 91; return; } //error: the image data is shorter than the header says
       size_t bytewidth = (bpp + 7) / 8, outlength = (info.height * info.width * bpp + 7) / 8;
       out.resize(outlength); //time to fill the out buffer
       unsigned char* out_ = outlength ? &out[0] : 0; //use a regular pointer to the std::vector for faster code if compiled without optimization
@@ -1573,11 +2249,12 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
         }
         else //less than 8 bits per pixel, so fill it up bit per bit
         {
-          std::vector<unsigned char> templine((info.width * bpp + 7) >> 3); //only used if bpp < 8
+          std::vector<unsigned char> templine((info.width * bpp + 7) >> 3), prevtempline(templine.size()); //only used if bpp < 8
           for(size_t y = 0, obp = 0; y < info.height; y++)
           {
             unsigned long filterType = scanlines[linestart];
-            const unsigned char* prevline = (y == 0) ? 0 : &out_[(y - 1) * info.width * bytewidth];
+            templine.swap(prevtempline); //the filters work on the packed scanline above, not on the output
+            const unsigned char* prevline = (y == 0) ? 0 : &prevtempline[0];
             unFilterScanline(&templine[0], &scanlines[linestart + 1], prevline, bytewidth, filterType, linelength); if(error) return;
             for(size_t bp = 0; bp < info.width * bpp;) setBitOfReversedStream(obp, out_, readBitFromReversedStream(bp, &templine[0]));
             linestart += (1 + linelength); //go to start of next scanline
@@ -1597,10 +2274,22 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
       }
       if(convert_to_rgba32 && (info.colorType != 6 || info.bitDepth != 8)) //conversion needed
       {
-        std::vector<unsigned char> data = out;
+        std::vector<unsigned char> data; data.swap(out); //convert writes a new out, no need to copy the old one
         error = convert(out, &data[0], info, info.width, info.height);
       }
     }
+    static size_t getScanlinesSize(const Info& info, unsigned long bpp) //size of the decompressed data, with a filter type byte per scanline
+    {
+      if(info.interlaceMethod == 0) return info.height * (1 + (info.width * bpp + 7) / 8);
+      size_t size = 0; //sum of the 7 Adam7 passes, passes without pixels have no filter bytes either
+      static const unsigned long ADAM7[28] = {0,4,0,2,0,1,0, 0,0,4,0,2,0,1, 8,8,4,4,2,2,1, 8,8,8,4,4,2,2}; //left, top, x spacing, y spacing
+      for(int i = 0; i < 7; i++)
+      {
+        size_t passw = (info.width + ADAM7[i + 14] - 1 - ADAM7[i]) / ADAM7[i + 14], passh = (info.height + ADAM7[i + 21] - 1 - ADAM7[i + 7]) / ADAM7[i + 21];
+        if(passw) size += passh * (1 + (passw * bpp + 7) / 8);
+      }
+      return size;
+    }
     void readPngHeader(const unsigned char* in, size_t inlength) //read the information from the header and store it in the Info
     {
       if(inlength < 29) { error = 27; return; } //error: the data length is smaller than the length of the header
@@ -1660,7 +2349,7 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
       for(unsigned long y = 0; y < passh; y++)
       {
         unsigned char filterType = in[y * linelength], *prevline = (y == 0) ? 0 : lineo;
-        unFilterScanline(linen, &in[y * linelength + 1], prevline, bytewidth, filterType, (w * bpp + 7) / 8); if(error) return;
+        unFilterScanline(linen, &in[y * linelength + 1], prevline, bytewidth, filterType, linelength - 1); if(error) return;
         if(bpp >= 8) for(size_t i = 0; i < passw; i++) for(size_t b = 0; b < bytewidth; b++) //b = current byte of this pixel
           out[bytewidth * w * (passtop + spacey * y) + bytewidth * (passleft + spacex * i) + b] = linen[bytewidth * i + b];
         else for(size_t i = 0; i < passw; i++)
@@ -1698,7 +2387,13 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
       size_t numpixels = w * h, bp = 0;
       out.resize(numpixels * 4);
       unsigned char* out_ = out.empty() ? 0 : &out[0]; //faster if compiled without optimization
-      if(infoIn.bitDepth == 8 && infoIn.colorType == 0) //greyscale
+      if(infoIn.bitDepth == 8 && infoIn.colorType == 0 && !infoIn.key_defined) //greyscale, the common case gets a loop without the color key test
+      for(size_t i = 0; i < numpixels; i++)
+      {
+        out_[4 * i + 0] = out_[4 * i + 1] = out_[4 * i + 2] = in[i];
+        out_[4 * i + 3] = 255;
+      }
+      else if(infoIn.bitDepth == 8 && infoIn.colorType == 0) //greyscale
       for(size_t i = 0; i < numpixels; i++)
       {
         out_[4 * i + 0] = out_[4 * i + 1] = out_[4 * i + 2] = in[i];
@@ -1761,7 +2456,8 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
     unsigned char paethPredictor(short a, short b, short c) //Paeth predicter, used by PNG filter type 4
     {
       short p = a + b - c, pa = p > a ? (p - a) : (a - p), pb = p > b ? (p - b) : (b - p), pc = p > c ? (p - c) : (c - p);
-      return (unsigned char)((pa <= pb && pa <= pc) ? a : pb <= pc ? b : c);
+      short bc = pb <= pc ? b : c; //no short-circuit, so this compiles to conditional moves instead of unpredictable branches
+      return (unsigned char)(((pa <= pb) & (pa <= pc)) ? a : bc);
     }
   };
   PNG decoder; decoder.decode(out_image, in_png, in_size, convert_to_rgba32);
@@ -1779,98 +2475,126 @@ int decodePNG(std::vector<unsigned char>& out_image_32bit, unsigned long& image_
 ////////////////////////////////////////////////////////////////////////////////
 
 
-bool font[256][8][8];
-struct GenerateFont
-{
-  GenerateFont()
-  {
-    /*
-    The full extended ASCII character set, in the form 256 bitmap symbols of 8x8
-    pixels in one 128x128 PNG, base64-encoded.
-    The background color is black, not transparent.
-    */
-    const std::string font8x8string = "\
-iVBORw0KGgoAAAANSUhEUgAAAIAAAACAAQAAAADrRVxmAAAEjklEQVR4AY2TBYhsyRWG/9hqPcEP\n\
-TLOO24n1u8Bdxd3iWK1VrICOdQ6kcmeDRXGJJ0gch6CxgoGKHV7Qx8A8aWxdOjZ7gaLuVt2RdfnL\n\
-mq//I9eAYfDnu/OYMJ3r7939IfCNqXShgn7vevfBhz8F/PKghK6jJ9wPz7l7d/vZUUro9x7409cd\n\
-P/wE8Ke9EEppQPsZ/PCJrrsUWojS6tNzyPmqllSH7eOfamWBrmtlhTbxh3js3eR2BxARjrQ527uD\n\
-PfQ9EeMumjDeM7gDqYFkbHT9hFLIfU1bSClxGobqILej1TA0x9TXHAN2ZOipJy53TVSr9G7ne0Or\n\
-ciICRkw4FXvP6CxZNF0HiPchecvsGIBpoETtoqWej+IZXmgNS1NGBjdQDF/GsWPO5EenaDlW4DiH\n\
-cFqjVWHwYzjViV9YZJG7LAIQrEC3qn20qjqHKC6zMX6MRpXZZjLI3HVqRpLAHGEIz7I1xSirAaqD\n\
-oaxa/VaJVwwGJGcxIlZWzATLr2sDgXOfS+lVbnl8m1KHJM75hx5yysbZ5x/3uKouus98JlbgbTlM\n\
-FYToRGJmI/bS1Qry7LiorP6hdDEhasthXQXOpeQh2qps71GRx0ur8jplqUM1JS0S5Tzg1OnvZ6DW\n\
-UjeDDVfg9QeWyQNBQ1fBpU7YEiXAXpZFBcXzQ9YQKhCvrPJ84mSva2C7eFwkc0pS5N2C12kCY4MF\n\
-OmyYNquGGBYGvu7H948kiBG79itx/OwogHEadKtrJs9FFQguarbqmIQvNaBONdrgmiM1sP6jrGVr\n\
-Hpf9xyWp4FgjsMKpzmPWgjbro5+MWUx8ucPl9X4I8w3KFcDDqY/HN6hdQ2pA5huk3BwJIVjzIZXi\n\
-wyNHwJrtSGv2yeRaBQXbW17uZJZgMeiGUTcNG2WoYg/gtiGBGRHSi0io26pbCaCq1xljolNlYhWI\n\
-5ntCCHHIuQEFaftTg42xgpxhBrl3GIbrWqJeVCGY1eNEC9wjaDgpdbo9C8CrburoQF73d5B3FbOC\n\
-Do/IPsGaIiKqmjRu8/8GyK7OasCyVoceKdeQx/NVqjkuisgwmE4os+7jRCNAwNkVFh2A3PcMpHTc\n\
-2mKEdwBU6YMKWQFQ7xjY34dzMCw6PntPb3O+57+kH0TgVhOI0Tz8aaoObeDyMGg0F//V1xyDyKAK\n\
-CPCDn/d4lW59DwG446NXiGgJLJd1VvKt33311WB2jEuMh8tyuBxfdtB1y+uuO3GM42GpjsNSxvHE\n\
-saxzCYCa49XgdQ6qE41gHm8Kbl1euPfF6cL04nTqYAZ4vqJpavPCvfXv2YHZQ3OCtr0D0Ca1RZiw\n\
-PTe9Aajz1lvr8SoH1eMETNN076231jbH2s72HABattUu4h2DqgIgd90C1/UCSCkObs3eM4xVrDV5\n\
-HtxlSYmGISouj9GTOtKSwsFBVvxNo+cGkteDg2OH00DivQ5DyxGjL2KJu+cFtlcgAm3LR0cVWzpL\n\
-jA44JwIgM/MO8Rc9YLxBI2R3CD+ZQdcfOYgyOqrA9kc5iPBFED3rQ3MAoH3+CQAPNEfOuYJXf6q0\n\
-QtOibS8BEX/cffjo+7IAAAAASUVORK5CYII=";
-
-    std::vector<unsigned char> png, image;
-    decodeBase64(png, font8x8string);
-    unsigned long w, h;
-    decodePNG(image, w, h, &png[0], png.size());
-    for(size_t c = 0; c < 256; c++)
-    for(size_t y = 0; y < 8; y++)
-    for(size_t x = 0; x < 8; x++)
-    {
-      font[c][x][y] = image[4 * 128 * (8 * (c / 16) + y) + 4 * (8 * (c % 16) + x)] != 0;
-    }
-  }
+/*
+The full extended ASCII character set, 256 bitmap symbols of 8x8 pixels. Each symbol is 8 rows from top to
+bottom, bit x of a row (lowest bit first) is set if pixel x is on. It used to be a base64-encoded PNG that was
+decoded before main() ran; as a constant table it's ready as soon as the program is loaded.
+*/
+constexpr unsigned char font[256][8] =
+{
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, {0x7e,0x81,0xa5,0x81,0xbd,0x99,0x81,0x7e}, {0x7e,0xff,0xdb,0xff,0xc3,0xe7,0xff,0x7e}, {0x36,0x7f,0x7f,0x7f,0x3e,0x1c,0x08,0x00}, //0-3
+  {0x08,0x1c,0x3e,0x7f,0x3e,0x1c,0x08,0x00}, {0x1c,0x3e,0x1c,0x7f,0x7f,0x6b,0x08,0x1c}, {0x08,0x08,0x1c,0x3e,0x7f,0x3e,0x08,0x1c}, {0x00,0x00,0x18,0x3c,0x3c,0x18,0x00,0x00}, //4-7
+  {0xff,0xff,0xe7,0xc3,0xc3,0xe7,0xff,0xff}, {0x00,0x3c,0x66,0x42,0x42,0x66,0x3c,0x00}, {0xff,0xc3,0x99,0xbd,0xbd,0x99,0xc3,0xff}, {0xf0,0xe0,0xf0,0xbe,0x33,0x33,0x33,0x1e}, //8-11
+  {0x3c,0x66,0x66,0x66,0x3c,0x18,0x7e,0x18}, {0xfc,0xcc,0xfc,0x0c,0x0c,0x0e,0x0f,0x07}, {0xfe,0xc6,0xfe,0xc6,0xc6,0xe6,0x67,0x03}, {0x99,0x5a,0x3c,0xe7,0xe7,0x3c,0x5a,0x99}, //12-15
+  {0x01,0x07,0x1f,0x7f,0x1f,0x07,0x01,0x00}, {0x40,0x70,0x7c,0x7f,0x7c,0x70,0x40,0x00}, {0x18,0x3c,0x7e,0x18,0x18,0x7e,0x3c,0x18}, {0x66,0x66,0x66,0x66,0x66,0x00,0x66,0x00}, //16-19
+  {0xfe,0xdb,0xdb,0xde,0xd8,0xd8,0xd8,0x00}, {0x7e,0xc3,0x1e,0x33,0x33,0x1e,0x31,0x1f}, {0x00,0x00,0x00,0x00,0x7e,0x7e,0x7e,0x00}, {0x18,0x3c,0x7e,0x18,0x7e,0x3c,0x18,0xff}, //20-23
+  {0x18,0x3c,0x7e,0x18,0x18,0x18,0x18,0x00}, {0x18,0x18,0x18,0x18,0x7e,0x3c,0x18,0x00}, {0x00,0x18,0x30,0x7f,0x30,0x18,0x00,0x00}, {0x00,0x0c,0x06,0x7f,0x06,0x0c,0x00,0x00}, //24-27
+  {0x00,0x00,0x03,0x03,0x03,0x7f,0x00,0x00}, {0x00,0x24,0x66,0xff,0x66,0x24,0x00,0x00}, {0x00,0x18,0x3c,0x7e,0xff,0xff,0x00,0x00}, {0x00,0xff,0xff,0x7e,0x3c,0x18,0x00,0x00}, //28-31
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, {0x0c,0x1e,0x1e,0x0c,0x0c,0x00,0x0c,0x00}, {0x36,0x36,0x36,0x00,0x00,0x00,0x00,0x00}, {0x36,0x36,0x7f,0x36,0x7f,0x36,0x36,0x00}, //32-35
+  {0x0c,0x3e,0x03,0x1e,0x30,0x1f,0x0c,0x00}, {0x00,0x63,0x33,0x18,0x0c,0x66,0x63,0x00}, {0x1c,0x36,0x1c,0x6e,0x3b,0x33,0x6e,0x00}, {0x06,0x06,0x03,0x00,0x00,0x00,0x00,0x00}, //36-39
+  {0x18,0x0c,0x06,0x06,0x06,0x0c,0x18,0x00}, {0x06,0x0c,0x18,0x18,0x18,0x0c,0x06,0x00}, {0x00,0x66,0x3c,0xff,0x3c,0x66,0x00,0x00}, {0x00,0x0c,0x0c,0x3f,0x0c,0x0c,0x00,0x00}, //40-43
+  {0x00,0x00,0x00,0x00,0x00,0x0e,0x0c,0x06}, {0x00,0x00,0x00,0x3f,0x00,0x00,0x00,0x00}, {0x00,0x00,0x00,0x00,0x00,0x0c,0x0c,0x00}, {0x60,0x30,0x18,0x0c,0x06,0x03,0x01,0x00}, //44-47
+  {0x1e,0x33,0x3b,0x3f,0x37,0x33,0x1e,0x00}, {0x0c,0x0f,0x0c,0x0c,0x0c,0x0c,0x3f,0x00}, {0x1e,0x33,0x30,0x1c,0x06,0x33,0x3f,0x00}, {0x1e,0x33,0x30,0x1c,0x30,0x33,0x1e,0x00}, //48-51
+  {0x38,0x3c,0x36,0x33,0x7f,0x30,0x30,0x00}, {0x3f,0x03,0x1f,0x30,0x30,0x33,0x1e,0x00}, {0x1c,0x06,0x03,0x1f,0x33,0x33,0x1e,0x00}, {0x3f,0x33,0x30,0x18,0x0c,0x06,0x06,0x00}, //52-55
+  {0x1e,0x33,0x33,0x1e,0x33,0x33,0x1e,0x00}, {0x1e,0x33,0x33,0x3e,0x30,0x18,0x0e,0x00}, {0x00,0x00,0x0c,0x0c,0x00,0x0c,0x0c,0x00}, {0x00,0x00,0x0c,0x0c,0x00,0x0e,0x0c,0x06}, //56-59
+  {0x18,0x0c,0x06,0x03,0x06,0x0c,0x18,0x00}, {0x00,0x00,0x3f,0x00,0x3f,0x00,0x00,0x00}, {0x06,0x0c,0x18,0x30,0x18,0x0c,0x06,0x00}, {0x1e,0x33,0x30,0x18,0x0c,0x00,0x0c,0x00}, //60-63
+  {0x3e,0x63,0x7b,0x7b,0x7b,0x03,0x1e,0x00}, {0x0c,0x1e,0x33,0x33,0x3f,0x33,0x33,0x00}, {0x3f,0x66,0x66,0x3e,0x66,0x66,0x3f,0x00}, {0x3c,0x66,0x03,0x03,0x03,0x66,0x3c,0x00}, //64-67
+  {0x3f,0x36,0x66,0x66,0x66,0x36,0x3f,0x00}, {0x7f,0x46,0x16,0x1e,0x16,0x46,0x7f,0x00}, {0x7f,0x46,0x16,0x1e,0x16,0x06,0x0f,0x00}, {0x3c,0x66,0x03,0x03,0x73,0x66,0x7c,0x00}, //68-71
+  {0x33,0x33,0x33,0x3f,0x33,0x33,0x33,0x00}, {0x1e,0x0c,0x0c,0x0c,0x0c,0x0c,0x1e,0x00}, {0x78,0x30,0x30,0x30,0x33,0x33,0x1e,0x00}, {0x67,0x66,0x36,0x1e,0x36,0x66,0x67,0x00}, //72-75
+  {0x0f,0x06,0x06,0x06,0x46,0x66,0x7f,0x00}, {0x63,0x77,0x7f,0x6b,0x63,0x63,0x63,0x00}, {0x63,0x67,0x6f,0x7b,0x73,0x63,0x63,0x00}, {0x1c,0x36,0x63,0x63,0x63,0x36,0x1c,0x00}, //76-79
+  {0x3f,0x66,0x66,0x3e,0x06,0x06,0x0f,0x00}, {0x1e,0x33,0x33,0x33,0x3b,0x1e,0x38,0x00}, {0x3f,0x66,0x66,0x3e,0x1e,0x36,0x67,0x00}, {0x1e,0x33,0x07,0x1c,0x38,0x33,0x1e,0x00}, //80-83
+  {0x3f,0x2d,0x0c,0x0c,0x0c,0x0c,0x1e,0x00}, {0x33,0x33,0x33,0x33,0x33,0x33,0x3f,0x00}, {0x33,0x33,0x33,0x33,0x33,0x1e,0x0c,0x00}, {0x63,0x63,0x63,0x6b,0x7f,0x77,0x63,0x00}, //84-87
+  {0x63,0x63,0x36,0x1c,0x36,0x63,0x63,0x00}, {0x33,0x33,0x33,0x1e,0x0c,0x0c,0x1e,0x00}, {0x7f,0x33,0x19,0x0c,0x46,0x63,0x7f,0x00}, {0x1e,0x06,0x06,0x06,0x06,0x06,0x1e,0x00}, //88-91
+  {0x03,0x06,0x0c,0x18,0x30,0x60,0x40,0x00}, {0x1e,0x18,0x18,0x18,0x18,0x18,0x1e,0x00}, {0x08,0x1c,0x36,0x63,0x00,0x00,0x00,0x00}, {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xff}, //92-95
+  {0x0c,0x0c,0x18,0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x1e,0x30,0x3e,0x33,0x6e,0x00}, {0x07,0x06,0x3e,0x66,0x66,0x66,0x3d,0x00}, {0x00,0x00,0x1e,0x33,0x03,0x33,0x1e,0x00}, //96-99
+  {0x38,0x30,0x30,0x3e,0x33,0x33,0x6e,0x00}, {0x00,0x00,0x1e,0x33,0x3f,0x03,0x1e,0x00}, {0x1c,0x36,0x06,0x0f,0x06,0x06,0x0f,0x00}, {0x00,0x00,0x6e,0x33,0x33,0x3e,0x30,0x1f}, //100-103
+  {0x07,0x06,0x36,0x6e,0x66,0x66,0x67,0x00}, {0x0c,0x00,0x0e,0x0c,0x0c,0x0c,0x1e,0x00}, {0x18,0x00,0x1e,0x18,0x18,0x18,0x1b,0x0e}, {0x07,0x06,0x66,0x36,0x1e,0x36,0x67,0x00}, //104-107
+  {0x0e,0x0c,0x0c,0x0c,0x0c,0x0c,0x1e,0x00}, {0x00,0x00,0x37,0x7f,0x6b,0x63,0x63,0x00}, {0x00,0x00,0x1f,0x33,0x33,0x33,0x33,0x00}, {0x00,0x00,0x1e,0x33,0x33,0x33,0x1e,0x00}, //108-111
+  {0x00,0x00,0x3b,0x66,0x66,0x3e,0x06,0x0f}, {0x00,0x00,0x6e,0x33,0x33,0x3e,0x30,0x78}, {0x00,0x00,0x1b,0x36,0x36,0x06,0x0f,0x00}, {0x00,0x00,0x3e,0x03,0x1e,0x30,0x1f,0x00}, //112-115
+  {0x08,0x0c,0x3e,0x0c,0x0c,0x2c,0x18,0x00}, {0x00,0x00,0x33,0x33,0x33,0x33,0x6e,0x00}, {0x00,0x00,0x33,0x33,0x33,0x1e,0x0c,0x00}, {0x00,0x00,0x63,0x63,0x6b,0x7f,0x36,0x00}, //116-119
+  {0x00,0x00,0x63,0x36,0x1c,0x36,0x63,0x00}, {0x00,0x00,0x33,0x33,0x33,0x3e,0x30,0x1f}, {0x00,0x00,0x3f,0x19,0x0c,0x26,0x3f,0x00}, {0x38,0x0c,0x0c,0x07,0x0c,0x0c,0x38,0x00}, //120-123
+  {0x18,0x18,0x18,0x00,0x18,0x18,0x18,0x00}, {0x07,0x0c,0x0c,0x38,0x0c,0x0c,0x07,0x00}, {0x6e,0x3b,0x00,0x00,0x00,0x00,0x00,0x00}, {0x08,0x1c,0x36,0x63,0x63,0x63,0x7f,0x00}, //124-127
+  {0x1e,0x33,0x03,0x33,0x1e,0x18,0x30,0x1e}, {0x00,0x33,0x00,0x33,0x33,0x33,0x7e,0x00}, {0x38,0x00,0x1e,0x33,0x3f,0x03,0x1e,0x00}, {0x7e,0xc3,0x3c,0x60,0x7c,0x66,0xfc,0x00}, //128-131
+  {0x33,0x00,0x1e,0x30,0x3e,0x33,0x7e,0x00}, {0x07,0x00,0x1e,0x30,0x3e,0x33,0x7e,0x00}, {0x0c,0x0c,0x1e,0x30,0x3e,0x33,0x7e,0x00}, {0x00,0x00,0x3e,0x03,0x03,0x3e,0x60,0x3c}, //132-135
+  {0x7e,0xc3,0x3c,0x66,0x7e,0x06,0x3c,0x00}, {0x33,0x00,0x1e,0x33,0x3f,0x03,0x1e,0x00}, {0x07,0x00,0x1e,0x33,0x3f,0x03,0x1e,0x00}, {0x33,0x00,0x0e,0x0c,0x0c,0x0c,0x1e,0x00}, //136-139
+  {0x3e,0x63,0x1c,0x18,0x18,0x18,0x3c,0x00}, {0x07,0x00,0x0e,0x0c,0x0c,0x0c,0x1e,0x00}, {0x33,0x0c,0x1e,0x33,0x33,0x3f,0x33,0x00}, {0x0c,0x0c,0x00,0x1e,0x33,0x3f,0x33,0x00}, //140-143
+  {0x38,0x00,0x3f,0x06,0x1e,0x06,0x3f,0x00}, {0x00,0x00,0xfe,0x30,0xfe,0x33,0xfe,0x00}, {0x7c,0x36,0x33,0x7f,0x33,0x33,0x73,0x00}, {0x1e,0x33,0x00,0x1e,0x33,0x33,0x1e,0x00}, //144-147
+  {0x00,0x33,0x00,0x1e,0x33,0x33,0x1e,0x00}, {0x00,0x07,0x00,0x1e,0x33,0x33,0x1e,0x00}, {0x1e,0x33,0x00,0x33,0x33,0x33,0x7e,0x00}, {0x00,0x07,0x00,0x33,0x33,0x33,0x7e,0x00}, //148-151
+  {0x00,0x33,0x00,0x33,0x33,0x3f,0x30,0x1f}, {0x63,0x1c,0x3e,0x63,0x63,0x3e,0x1c,0x00}, {0x33,0x00,0x33,0x33,0x33,0x33,0x1e,0x00}, {0x18,0x18,0x7e,0x03,0x03,0x7e,0x18,0x18}, //152-155
+  {0x1c,0x36,0x26,0x0f,0x06,0x67,0x3f,0x00}, {0x33,0x33,0x1e,0x3f,0x0c,0x3f,0x0c,0x00}, {0x0f,0x1b,0x1b,0x2f,0x33,0x7b,0x33,0x70}, {0x70,0xd8,0x18,0x7e,0x18,0x18,0x1b,0x0e}, //156-159
+  {0x38,0x00,0x1e,0x30,0x3e,0x33,0x7e,0x00}, {0x1c,0x00,0x0e,0x0c,0x0c,0x0c,0x1e,0x00}, {0x00,0x38,0x00,0x1e,0x33,0x33,0x1e,0x00}, {0x00,0x38,0x00,0x33,0x33,0x33,0x7e,0x00}, //160-163
+  {0x00,0x1f,0x00,0x1f,0x33,0x33,0x33,0x00}, {0x3f,0x00,0x33,0x37,0x3f,0x3b,0x33,0x00}, {0x3c,0x36,0x36,0x7c,0x00,0x7e,0x00,0x00}, {0x3c,0x66,0x66,0x3c,0x00,0x7e,0x00,0x00}, //164-167
+  {0x0c,0x00,0x0c,0x06,0x03,0x33,0x1e,0x00}, {0x00,0x00,0x00,0x3f,0x03,0x03,0x00,0x00}, {0x00,0x00,0x00,0x3f,0x30,0x30,0x00,0x00}, {0x63,0x33,0x1b,0x7c,0xc6,0x73,0x19,0xf8}, //168-171
+  {0x63,0x33,0x1b,0xcf,0xe6,0xf3,0xf9,0xc0}, {0x00,0x18,0x00,0x18,0x18,0x3c,0x3c,0x18}, {0x00,0xcc,0x66,0x33,0x66,0xcc,0x00,0x00}, {0x00,0x33,0x66,0xcc,0x66,0x33,0x00,0x00}, //172-175
+  {0x44,0x11,0x44,0x11,0x44,0x11,0x44,0x11}, {0xaa,0x55,0xaa,0x55,0xaa,0x55,0xaa,0x55}, {0xbb,0xee,0xbb,0xee,0xbb,0xee,0xbb,0xee}, {0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x18}, //176-179
+  {0x18,0x18,0x18,0x18,0x1f,0x18,0x18,0x18}, {0x18,0x18,0x1f,0x18,0x1f,0x18,0x18,0x18}, {0x6c,0x6c,0x6c,0x6c,0x6f,0x6c,0x6c,0x6c}, {0x00,0x00,0x00,0x00,0x7f,0x6c,0x6c,0x6c}, //180-183
+  {0x00,0x00,0x1f,0x18,0x1f,0x18,0x18,0x18}, {0x6c,0x6c,0x6f,0x60,0x6f,0x6c,0x6c,0x6c}, {0x6c,0x6c,0x6c,0x6c,0x6c,0x6c,0x6c,0x6c}, {0x00,0x00,0x7f,0x60,0x6f,0x6c,0x6c,0x6c}, //184-187
+  {0x6c,0x6c,0x6f,0x60,0x7f,0x00,0x00,0x00}, {0x6c,0x6c,0x6c,0x6c,0x7f,0x00,0x00,0x00}, {0x18,0x18,0x1f,0x18,0x1f,0x00,0x00,0x00}, {0x00,0x00,0x00,0x00,0x1f,0x18,0x18,0x18}, //188-191
+  {0x18,0x18,0x18,0x18,0xf8,0x00,0x00,0x00}, {0x18,0x18,0x18,0x18,0xff,0x00,0x00,0x00}, {0x00,0x00,0x00,0x00,0xff,0x18,0x18,0x18}, {0x18,0x18,0x18,0x18,0xf8,0x18,0x18,0x18}, //192-195
+  {0x00,0x00,0x00,0x00,0xff,0x00,0x00,0x00}, {0x18,0x18,0x18,0x18,0xff,0x18,0x18,0x18}, {0x18,0x18,0xf8,0x18,0xf8,0x18,0x18,0x18}, {0x6c,0x6c,0x6c,0x6c,0xec,0x6c,0x6c,0x6c}, //196-199
+  {0x6c,0x6c,0xec,0x0c,0xfc,0x00,0x00,0x00}, {0x00,0x00,0xfc,0x0c,0xec,0x6c,0x6c,0x6c}, {0x6c,0x6c,0xef,0x00,0xff,0x00,0x00,0x00}, {0x00,0x00,0xff,0x00,0xef,0x6c,0x6c,0x6c}, //200-203
+  {0x6c,0x6c,0xec,0x0c,0xec,0x6c,0x6c,0x6c}, {0x00,0x00,0xff,0x00,0xff,0x00,0x00,0x00}, {0x6c,0x6c,0xef,0x00,0xef,0x6c,0x6c,0x6c}, {0x18,0x18,0xff,0x00,0xff,0x00,0x00,0x00}, //204-207
+  {0x6c,0x6c,0x6c,0x6c,0xff,0x00,0x00,0x00}, {0x00,0x00,0xff,0x00,0xff,0x18,0x18,0x18}, {0x00,0x00,0x00,0x00,0xff,0x6c,0x6c,0x6c}, {0x6c,0x6c,0x6c,0x6c,0xfc,0x00,0x00,0x00}, //208-211
+  {0x18,0x18,0xf8,0x18,0xf8,0x00,0x00,0x00}, {0x00,0x00,0xf8,0x18,0xf8,0x18,0x18,0x18}, {0x00,0x00,0x00,0x00,0xfc,0x6c,0x6c,0x6c}, {0x6c,0x6c,0x6c,0x6c,0xef,0x6c,0x6c,0x6c}, //212-215
+  {0x18,0x18,0xff,0x00,0xff,0x18,0x18,0x18}, {0x18,0x18,0x18,0x18,0x1f,0x00,0x00,0x00}, {0x00,0x00,0x00,0x00,0xf8,0x18,0x18,0x18}, {0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff}, //216-219
+  {0x00,0x00,0x00,0x00,0xff,0xff,0xff,0xff}, {0x0f,0x0f,0x0f,0x0f,0x0f,0x0f,0x0f,0x0f}, {0xf0,0xf0,0xf0,0xf0,0xf0,0xf0,0xf0,0xf0}, {0xff,0xff,0xff,0xff,0x00,0x00,0x00,0x00}, //220-223
+  {0x00,0x00,0x6e,0x3b,0x13,0x3b,0x6e,0x00}, {0x00,0x1e,0x33,0x1f,0x33,0x1f,0x03,0x03}, {0x00,0x7f,0x63,0x03,0x03,0x03,0x03,0x00}, {0x00,0x7f,0x36,0x36,0x36,0x36,0x36,0x00}, //224-227
+  {0x7f,0x66,0x0c,0x18,0x0c,0x66,0x7f,0x00}, {0x00,0x00,0x7e,0x33,0x33,0x33,0x1e,0x00}, {0x00,0x66,0x66,0x66,0x66,0x3e,0x06,0x03}, {0x00,0x6e,0x3b,0x18,0x18,0x18,0x18,0x00}, //228-231
+  {0x3f,0x0c,0x1e,0x33,0x33,0x1e,0x0c,0x3f}, {0x1c,0x36,0x63,0x7f,0x63,0x36,0x1c,0x00}, {0x1c,0x36,0x63,0x63,0x36,0x36,0x77,0x00}, {0x38,0x0c,0x18,0x3e,0x33,0x33,0x1e,0x00}, //232-235
+  {0x00,0x00,0x7e,0xdb,0xdb,0x7e,0x00,0x00}, {0x60,0x30,0x7e,0xdb,0xdb,0x7e,0x06,0x03}, {0x3c,0x06,0x03,0x3f,0x03,0x06,0x3c,0x00}, {0x1e,0x33,0x33,0x33,0x33,0x33,0x33,0x00}, //236-239
+  {0x00,0x3f,0x00,0x3f,0x00,0x3f,0x00,0x00}, {0x0c,0x0c,0x3f,0x0c,0x0c,0x00,0x3f,0x00}, {0x06,0x0c,0x18,0x0c,0x06,0x00,0x3f,0x00}, {0x18,0x0c,0x06,0x0c,0x18,0x00,0x3f,0x00}, //240-243
+  {0x70,0xd8,0xd8,0x18,0x18,0x18,0x18,0x18}, {0x18,0x18,0x18,0x18,0x18,0x1b,0x1b,0x0e}, {0x0c,0x0c,0x00,0x3f,0x00,0x0c,0x0c,0x00}, {0x00,0x4e,0x39,0x00,0x4e,0x39,0x00,0x00}, //244-247
+  {0x1c,0x36,0x36,0x1c,0x00,0x00,0x00,0x00}, {0x00,0x00,0x00,0x18,0x18,0x00,0x00,0x00}, {0x00,0x00,0x00,0x00,0x18,0x00,0x00,0x00}, {0xf0,0x30,0x30,0x30,0x37,0x36,0x3c,0x38}, //248-251
+  {0x1e,0x36,0x36,0x36,0x36,0x00,0x00,0x00}, {0x1e,0x30,0x1c,0x06,0x3e,0x00,0x00,0x00}, {0x00,0x00,0x3c,0x3c,0x3c,0x3c,0x00,0x00}, {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00} //252-255
 };
-GenerateFont generateFont;
 
 ////////////////////////////////////////////////////////////////////////////////
 //Multithreading helper functions///////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-//SDL's C functions don't have destructors and such so therefore this here is needed
-
-//currently only needed for audio, therefor it's not in a different cpp file.
+/*
+A ring of N elements that one thread pushes to and one other thread pulls from, without locks: neither side
+ever waits for the other. head and tail only ever grow, N is a power of two so they wrap with a mask, and each
+side publishes its counter with a release store after it's done with the elements, which the other side picks
+up with an acquire load before it touches them. push and pull move what fits and return how much that was.
 
-//this creates SDL mutexes and makes sure that they're destroyed at the end. MutexFactory does the deletion!
-struct MutexFactory
+currently only needed for audio, therefor it's not in a different cpp file.
+*/
+template<typename T, size_t N>
+struct SPSCRing
 {
-  SDL_mutex* createMutex()
-  {
-    mutexes.push_back(SDL_CreateMutex());
-    return mutexes.back();
-  }
+  static_assert((N & (N - 1)) == 0, "SPSCRing size must be a power of two");
+  static const size_t MASK = N - 1;
+
+  T items[N];
+  alignas(64) std::atomic<size_t> head{0}; //next item to pull, only written by the consumer
+  alignas(64) std::atomic<size_t> tail{0}; //next free slot, only written by the producer
 
-  ~MutexFactory()
+  size_t size() const //how many items are waiting, from either side
   {
-    for(size_t i = 0; i < mutexes.size(); i++)
-      SDL_DestroyMutex(mutexes[i]);
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
   }
 
-  private:
-
-  std::vector<SDL_mutex*> mutexes;
-};
-
-MutexFactory mutexFactory;
-
-//this does SDL_mutexP in the ctor and SDL_mutexV in the dtor so no matter where you leave a function, SDL_mutexV is called
-struct Mutex
-{
-  SDL_mutex** m;
-
-  Mutex(SDL_mutex*& mutex)
+  size_t push(const T* in, size_t n) //producer only
   {
-    m = &mutex;
-    SDL_mutexP(*m);
+    size_t t = tail.load(std::memory_order_relaxed);
+    n = std::min(n, N - (t - head.load(std::memory_order_acquire)));
+    size_t first = std::min(n, N - (t & MASK)); //up to the end of the array, the rest wraps to the start
+    std::copy(in, in + first, items + (t & MASK));
+    std::copy(in + first, in + n, items);
+    tail.store(t + n, std::memory_order_release);
+    return n;
   }
 
-  ~Mutex()
+  size_t pull(T* out, size_t n) //consumer only
   {
-    SDL_mutexV(*m);
+    size_t hd = head.load(std::memory_order_relaxed);
+    n = std::min(n, tail.load(std::memory_order_acquire) - hd);
+    size_t first = std::min(n, N - (hd & MASK));
+    std::copy(items + (hd & MASK), items + (hd & MASK) + first, out);
+    std::copy(items, items + (n - first), out + first);
+    head.store(hd + n, std::memory_order_release);
+    return n;
   }
 };
 
@@ -1901,63 +2625,144 @@ void audioSetVolume(double volume) //multiplier used if mode is 2 (volume-contro
 }
 
 /*
-Avoid the callback function and pushSamples function to be called at the same time,
-or the std::vector can be invalid as two threads at the same time change it.
-This SDL_mutex helps eliminate that problem.
+The program is the only producer and the audio callback the only consumer, so they share lock-free rings instead
+of a vector behind a mutex: the callback can't be held up by a frame that's being rendered. Volume is applied by
+the program before samples go in, so the callback only mixes and converts.
+Samples are converted and mixed AUDIO_CHUNK at a time, a constant count the compiler vectorizes the loops for.
+The device is stereo: pushed samples play on both channels, voices are mixed into each with their own gain.
 */
-SDL_mutex* audio_lock = mutexFactory.createMutex();
+const size_t AUDIO_CHUNK = 256;
+const int AUDIO_MAX_VOICES = 64;
+const size_t AUDIO_RING_SAMPLES = 65536; //more than audio_max_samples ever needs to be, a push beyond it is dropped
 
-std::vector<double> audio_data(audio_min_samples, 0);
+SPSCRing<float, AUDIO_RING_SAMPLES> audio_data; //audioPushSamples -> callback
+
+/*
+A fixed pool of voices, each playing one sound started by audioPlay or audioPlayAt. A voice's samples are written
+by the program while the voice is free and only read by the callback once the voice plays. The program changes
+a playing voice through commands; the callback sends the voices it's done with back through audio_donevoices, and
+only then the program reuses them. So the callback never waits, allocates or frees, and once every voice has
+played a sound as long as the next one, the program doesn't allocate either.
+*/
+struct AudioVoice
+{
+  //written by the program while the voice is free
+  std::vector<float> samples; //followed by AUDIO_CHUNK zeros, so a whole chunk can always be mixed
+  size_t length;
+
+  //owned by the callback
+  size_t pos;
+  float gainL, gainR;
+
+  //owned by the program
+  bool busy; //playing, or played and not yet reclaimed
+  int generation; //counts the sounds this voice played, to tell stale handles apart
+  bool positional; //gain and pan follow x, y, z and the listener
+  double x, y, z;
+  double volume; //the gain the sound was given
+  double gain, pan; //what it plays with
+};
+
+AudioVoice audio_voices[AUDIO_MAX_VOICES];
+
+enum AudioCommandType {AUDIO_START, AUDIO_GAINS, AUDIO_STOP};
+struct AudioCommand
+{
+  AudioCommandType type;
+  int voice;
+  float gainL, gainR;
+};
+
+SPSCRing<AudioCommand, 256> audio_commands; //program -> callback
+SPSCRing<int, AUDIO_MAX_VOICES> audio_donevoices; //callback -> program, every voice is in it at most once
+int audio_playing[AUDIO_MAX_VOICES]; //the voices the callback mixes
+int audio_numplaying = 0;
+
+//the listener of positional sounds
+double audio_listenerx = 0, audio_listenery = 0, audio_listenerz = 0;
+double audio_rightx = 0, audio_righty = 1, audio_rightz = 0;
+double audio_distance = 16.0;
 
 SDL_AudioSpec audiospec_wanted, audiospec_obtained;
 
 size_t audioSamplesShortage() //returns value > 0 if the soundcard is consuming more samples than you're producing
 {
-  if(audio_data.size() < audio_min_samples) return audio_min_samples - audio_data.size();
+  size_t queued = audio_data.size();
+  if(queued < audio_min_samples) return audio_min_samples - queued;
   else return 0;
 }
 
 size_t audioSamplesOverflow() //returns value > 0 if you're producing more samples than the soundard is consuming - so take it easy a bit
 {
-  if(audio_data.size() > audio_max_samples) return audio_data.size() - audio_max_samples;
+  size_t queued = audio_data.size();
+  if(queued > audio_max_samples) return queued - audio_max_samples;
   else return 0;
 }
 
 void audioCallback(void* /*userdata*/, Uint8* stream, int len)
 {
-  Mutex mutex(audio_lock);
-
-  int dataLengthLeft = audio_data.size();
-
-  //only play if we have data left
-  if(dataLengthLeft <= 0) return;
+  Sint16* out = (Sint16*)stream;
+  size_t nframes = len / 4; //16-bit stereo, 4 bytes per frame
 
-  int nsamples = len / 2; //always 16-bit, so always 2 bytes per sample, hence the amount of samples being len / 2
-  int fill_len = (nsamples < dataLengthLeft ? nsamples : dataLengthLeft);
+  AudioCommand command;
+  while(audio_commands.pull(&command, 1))
+  {
+    AudioVoice& voice = audio_voices[command.voice];
+    if(command.type == AUDIO_START)
+    {
+      voice.pos = 0;
+      audio_playing[audio_numplaying++] = command.voice; //the program only starts free voices, so there's room
+    }
+    if(command.type == AUDIO_STOP) voice.pos = voice.length;
+    voice.gainL = command.gainL;
+    voice.gainR = command.gainR;
+  }
 
-  for(int i = 0; i < nsamples; i++)
+  float left[AUDIO_CHUNK], right[AUDIO_CHUNK];
+  Sint16 pcm[AUDIO_CHUNK * 2];
+  for(size_t done = 0; done < nframes; done += AUDIO_CHUNK)
   {
-    if(i < fill_len)
+    size_t n = std::min(AUDIO_CHUNK, nframes - done);
+    size_t got = audio_data.pull(left, n);
+    std::fill(left + got, left + AUDIO_CHUNK, 0.0f); //silence if the program fell behind
+    std::copy(left, left + AUDIO_CHUNK, right);
+
+    for(int v = 0; v < audio_numplaying; v++)
     {
-      int s = int(audio_data[i] * 32768);
-      if(s < -32768) s = -32768;
-      if(s > 32767) s = 32767;
+      AudioVoice& voice = audio_voices[audio_playing[v]];
+      const float* in = voice.samples.data() + voice.pos;
+      float gainL = voice.gainL, gainR = voice.gainR;
+      for(size_t i = 0; i < AUDIO_CHUNK; i++) //past n or the end of the sound doesn't matter
+      {
+        left[i] += in[i] * gainL;
+        right[i] += in[i] * gainR;
+      }
+      voice.pos += std::min(n, voice.length - voice.pos);
+    }
 
-      stream[i * 2 + 0] = Uint8(s % 256);
-      stream[i * 2 + 1] = Uint8(s / 256);
+    for(size_t i = 0; i < AUDIO_CHUNK; i++)
+    {
+      pcm[i * 2 + 0] = Sint16(std::min(std::max(left[i] * 32768.0f, -32768.0f), 32767.0f));
+      pcm[i * 2 + 1] = Sint16(std::min(std::max(right[i] * 32768.0f, -32768.0f), 32767.0f));
     }
-    else stream[i * 2 + 0] = stream[i * 2 + 1] = 0;
+    std::copy(pcm, pcm + n * 2, out + done * 2);
   }
 
-  audio_data.erase(audio_data.begin(), audio_data.begin() + fill_len);
+  //hand finished voices back, the last one takes the place of each
+  for(int v = 0; v < audio_numplaying; v++)
+  {
+    if(audio_voices[audio_playing[v]].pos < audio_voices[audio_playing[v]].length) continue;
+    audio_donevoices.push(&audio_playing[v], 1);
+    audio_playing[v--] = audio_playing[--audio_numplaying];
+  }
 }
 
-int audioOpen(int samplerate, int framesize) //always 16-bit mono sound for now
+int audioOpen(int samplerate, int framesize) //16-bit stereo, pushed samples play on both channels
 {
   //set the audio format
   audiospec_wanted.freq = samplerate;
-  audiospec_wanted.format = AUDIO_S16;
-  audiospec_wanted.channels = 1;  //1 = mono, 2 = stereo
+  audiospec_wanted.format = AUDIO_S16SYS; //the callback writes native Sint16
+  audiospec_wanted.channels = 2;  //1 = mono, 2 = stereo
   audiospec_wanted.samples = framesize;
   audiospec_wanted.callback = audioCallback;
   audiospec_wanted.userdata = NULL;
@@ -1996,41 +2801,514 @@ int audioReOpen() //closes and opens again with same parameters
   return 0;
 }
 
+//frees the voices the callback is done with
+static void audioReclaimVoices()
+{
+  int voice;
+  while(audio_donevoices.pull(&voice, 1)) audio_voices[voice].busy = false;
+}
+
+//the voice a handle from audioPlay refers to, or 0 if its sound is over
+static AudioVoice* audioVoice(int handle)
+{
+  if(handle < 0) return 0;
+  audioReclaimVoices();
+  AudioVoice& voice = audio_voices[handle % AUDIO_MAX_VOICES];
+  if(!voice.busy || voice.generation != handle / AUDIO_MAX_VOICES) return 0;
+  return &voice;
+}
+
+//gain and pan of a positional voice: full gain within audio_distance of the listener and 1/distance beyond, the
+//pan is how far the sound is toward the listener's right
+static void audioPosition(AudioVoice& voice)
+{
+  double dx = voice.x - audio_listenerx, dy = voice.y - audio_listenery, dz = voice.z - audio_listenerz;
+  double distance = std::sqrt(dx * dx + dy * dy + dz * dz);
+  double rightLength = std::sqrt(audio_rightx * audio_rightx + audio_righty * audio_righty + audio_rightz * audio_rightz);
+  voice.pan = 0.0;
+  if(distance > 0.0 && rightLength > 0.0) voice.pan = (dx * audio_rightx + dy * audio_righty + dz * audio_rightz) / (distance * rightLength);
+  voice.gain = distance > audio_distance ? voice.volume * audio_distance / distance : voice.volume;
+}
+
+//sends a voice's gain and pan to the callback, as one gain per channel: a sound panned to one side keeps its
+//gain there and fades out of the other side, a centered one plays at full gain on both like a mono sound
+static bool audioSendGains(int index, AudioCommandType type)
+{
+  AudioVoice& voice = audio_voices[index];
+  double gain = audio_mode == 2 ? voice.gain * audio_volume : voice.gain;
+  double pan = std::min(std::max(voice.pan, -1.0), 1.0);
+  AudioCommand command = {type, index, float(gain * std::min(1.0, 1.0 - pan)), float(gain * std::min(1.0, 1.0 + pan))};
+  return audio_commands.push(&command, 1) == 1;
+}
 
 //only works correct for 16 bit audio currently
 void audioPushSamples(const std::vector<double>& samples, size_t pos, size_t end)
 {
   if(audio_mode == 0) return;
 
-  Mutex mutex(audio_lock);
+  float gain = audio_mode == 2 ? float(audio_volume) : 1.0f;
+  float chunk[AUDIO_CHUNK];
+  while(pos < end)
+  {
+    size_t n = std::min(AUDIO_CHUNK, end - pos);
+    const double* in = samples.data() + pos;
+    if(n == AUDIO_CHUNK)
+    {
+      for(size_t i = 0; i < AUDIO_CHUNK; i++) chunk[i] = float(in[i]);
+      if(gain != 1.0f) for(size_t i = 0; i < AUDIO_CHUNK; i++) chunk[i] *= gain;
+    }
+    else for(size_t i = 0; i < n; i++) chunk[i] = float(in[i]) * gain; //the tail, only n samples are set
+    if(audio_data.push(chunk, n) < n) return; //ring full, the rest is dropped
+    pos += n;
+  }
+}
+
+static int audioStart(const std::vector<double>& samples, double gain, double pan, bool positional, double x, double y, double z)
+{
+  if(audio_mode == 0 || samples.empty()) return -1;
+
+  audioReclaimVoices();
+  int index = 0;
+  while(index < AUDIO_MAX_VOICES && audio_voices[index].busy) index++;
+  if(index == AUDIO_MAX_VOICES) return -1; //all voices are playing
 
-  if(audio_mode == 1)
+  AudioVoice& voice = audio_voices[index];
+  voice.length = samples.size();
+  voice.samples.assign(voice.length + AUDIO_CHUNK, 0.0f);
+  for(size_t i = 0; i < voice.length; i++) voice.samples[i] = float(samples[i]);
+  voice.positional = positional;
+  voice.x = x;
+  voice.y = y;
+  voice.z = z;
+  voice.volume = voice.gain = gain;
+  voice.pan = pan;
+  if(positional) audioPosition(voice);
+
+  if(!audioSendGains(index, AUDIO_START)) return -1; //the callback is far behind on commands
+  voice.busy = true;
+  voice.generation = (voice.generation + 1) & 0xffffff;
+  return voice.generation * AUDIO_MAX_VOICES + index;
+}
+
+int audioPlay(const std::vector<double>& samples, double gain, double pan)
+{
+  return audioStart(samples, gain, pan, false, 0, 0, 0);
+}
+
+int audioPlayAt(const std::vector<double>& samples, double x, double y, double z, double gain)
+{
+  return audioStart(samples, gain, 0.0, true, x, y, z);
+}
+
+void audioVoiceSet(int handle, double gain, double pan)
+{
+  AudioVoice* voice = audioVoice(handle);
+  if(!voice) return;
+  voice->positional = false;
+  voice->volume = voice->gain = gain;
+  voice->pan = pan;
+  audioSendGains(handle % AUDIO_MAX_VOICES, AUDIO_GAINS);
+}
+
+void audioVoiceMove(int handle, double x, double y, double z)
+{
+  AudioVoice* voice = audioVoice(handle);
+  if(!voice) return;
+  voice->positional = true;
+  voice->x = x;
+  voice->y = y;
+  voice->z = z;
+  audioPosition(*voice);
+  audioSendGains(handle % AUDIO_MAX_VOICES, AUDIO_GAINS);
+}
+
+void audioVoiceStop(int handle)
+{
+  if(audioVoice(handle)) audioSendGains(handle % AUDIO_MAX_VOICES, AUDIO_STOP);
+}
+
+bool audioVoicePlaying(int handle)
+{
+  return audioVoice(handle) != 0;
+}
+
+void audioListener(double x, double y, double z, double rightX, double rightY, double rightZ, double distance)
+{
+  audio_listenerx = x;
+  audio_listenery = y;
+  audio_listenerz = z;
+  audio_rightx = rightX;
+  audio_righty = rightY;
+  audio_rightz = rightZ;
+  audio_distance = distance;
+
+  audioReclaimVoices();
+  for(int i = 0; i < AUDIO_MAX_VOICES; i++)
   {
-    audio_data.insert(audio_data.end(), samples.begin() + pos, samples.begin() + end);
+    AudioVoice& voice = audio_voices[i];
+    if(!voice.busy || !voice.positional) continue;
+    audioPosition(voice);
+    audioSendGains(i, AUDIO_GAINS);
   }
-  else if(audio_mode == 2)
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//Performance counter functions/////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+bool perf_open = false;
+bool profile_sampling = false;
+bool profile_samplewanted = false;
+Uint64 perf_overhead[PERF_NUM_COUNTERS]; //what a perfRead adds to the counters themselves
+Uint64 perf_overheadticks = 0; //and how long it takes, in profileTicks
+
+#ifdef __linux__
+
+int perf_fd[PERF_NUM_COUNTERS] = {-1, -1, -1, -1, -1};
+perf_event_mmap_page* perf_page[PERF_NUM_COUNTERS]; //lets us use rdpmc instead of a syscall per read
+
+bool perfOpen()
+{
+  if(perf_open) return true;
+
+  static const Uint32 types[PERF_NUM_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+  static const Uint64 configs[PERF_NUM_COUNTERS] =
   {
-    size_t j = audio_data.size();
-    audio_data.resize(j + samples.size());
-    for(size_t i = 0; i < samples.size(); i++)
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+  };
+
+  for(int i = 0; i < PERF_NUM_COUNTERS; i++)
+  {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = types[i];
+    attr.config = configs[i];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0); //this thread, any cpu, no group
+    perf_page[i] = 0;
+    if(perf_fd[i] < 0) continue;
+
+    void* page = mmap(0, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, perf_fd[i], 0);
+    if(page != MAP_FAILED) perf_page[i] = (perf_event_mmap_page*)page;
+    perf_open = true;
+  }
+
+  //two reads in a row measure the cost of reading, scopes take that off what they count
+  for(int c = 0; c < PERF_NUM_COUNTERS; c++) perf_overhead[c] = Uint64(-1);
+  perf_overheadticks = Uint64(-1);
+  for(int i = 0; i < 64 && perf_open; i++)
+  {
+    Uint64 a[PERF_NUM_COUNTERS], b[PERF_NUM_COUNTERS];
+    perfRead(a);
+    Uint64 ticks = profileTicks();
+    perfRead(b);
+    perf_overheadticks = std::min(perf_overheadticks, profileTicks() - ticks);
+    for(int c = 0; c < PERF_NUM_COUNTERS; c++) perf_overhead[c] = std::min(perf_overhead[c], b[c] - a[c]);
+  }
+
+  profile_sampling = profile_samplewanted && perf_open;
+  return perf_open;
+}
+
+void perfClose()
+{
+  for(int i = 0; i < PERF_NUM_COUNTERS; i++)
+  {
+    if(perf_page[i]) munmap(perf_page[i], sysconf(_SC_PAGESIZE));
+    if(perf_fd[i] >= 0) close(perf_fd[i]);
+    perf_page[i] = 0;
+    perf_fd[i] = -1;
+  }
+  perf_open = false;
+  profile_sampling = false;
+}
+
+bool perfCounterAvailable(int counter)
+{
+  return counter >= 0 && counter < PERF_NUM_COUNTERS && perf_fd[counter] >= 0;
+}
+
+static Uint64 perfReadCounter(int counter)
+{
+  Uint64 value = 0;
+  const perf_event_mmap_page* page = perf_page[counter];
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  if(page && page->cap_user_rdpmc)
+  {
+    Uint32 seq;
+    bool ok;
+    do //the kernel bumps lock while it updates the page, retry if that happened under us
     {
-      audio_data[j + i] = samples[i] * audio_volume;
+      seq = page->lock;
+      __sync_synchronize();
+      Uint32 index = page->index;
+      ok = index != 0; //0 means the counter isn't on the PMU right now
+      if(ok)
+      {
+        Uint64 pmc = __rdpmc(index - 1);
+        int shift = 64 - page->pmc_width;
+        value = page->offset + Uint64(Sint64(pmc << shift) >> shift);
+      }
+      __sync_synchronize();
     }
+    while(page->lock != seq);
+    if(ok) return value;
   }
+#endif
+  if(read(perf_fd[counter], &value, sizeof(value)) != sizeof(value)) value = 0;
+  return value;
 }
 
-void audioPlay(const std::vector<double>& samples)
+void perfRead(Uint64 values[PERF_NUM_COUNTERS])
 {
-  if(audio_mode == 0) return;
+  for(int i = 0; i < PERF_NUM_COUNTERS; i++) values[i] = (perf_fd[i] >= 0) ? perfReadCounter(i) : 0;
+}
+
+#else //no perf_event_open
+
+bool perfOpen() { return false; }
+void perfClose() {}
+bool perfCounterAvailable(int /*counter*/) { return false; }
+void perfRead(Uint64 values[PERF_NUM_COUNTERS]) { for(int i = 0; i < PERF_NUM_COUNTERS; i++) values[i] = 0; }
+
+#endif
+
+bool perfAvailable()
+{
+  return perf_open;
+}
+
+const char* perfCounterName(int counter)
+{
+  static const char* names[PERF_NUM_COUNTERS] = {"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"};
+  return (counter >= 0 && counter < PERF_NUM_COUNTERS) ? names[counter] : "";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//Profiling functions///////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+bool profile_enabled = false;
+ProfileScope* profile_current = 0;
+
+int profile_numphases = 0;
+std::string profile_names[PROFILE_MAX_PHASES];
+Uint64 profile_phase[PROFILE_MAX_PHASES]; //ticks charged to each phase during the current frame
+Uint64 profile_history[PROFILE_HISTORY][PROFILE_MAX_PHASES + 1]; //in nanoseconds, the last entry is the whole frame
+size_t profile_frames = 0; //amount of frames stored since the start, the ring buffer keeps the last PROFILE_HISTORY
+Uint64 profile_framestart = 0;
+Uint64 profile_framestartticks = 0;
+
+Uint64 profile_sampledticks[PROFILE_MAX_PHASES]; //ticks of the scopes that read the counters during the current frame
+Uint64 profile_counters[PROFILE_MAX_PHASES][PERF_NUM_COUNTERS]; //what those scopes counted
+Uint64 profile_framecounters[PERF_NUM_COUNTERS]; //counter values at the start of the frame
+Uint64 profile_counterhistory[PROFILE_HISTORY][PROFILE_MAX_PHASES + 1][PERF_NUM_COUNTERS]; //scaled to the whole phase, the last entry is the whole frame
+bool profile_hadcounters = false; //the ring buffer holds counter values
 
-  Mutex mutex(audio_lock);
+int profileRegister(const std::string& name)
+{
+  if(profile_numphases >= PROFILE_MAX_PHASES) return -1;
+  profile_names[profile_numphases] = name;
+  return profile_numphases++;
+}
+
+void profileEnable(bool enable)
+{
+  if(enable && !profile_enabled) //start a fresh frame, the time while disabled doesn't count
+  {
+    for(int i = 0; i < PROFILE_MAX_PHASES; i++)
+    {
+      profile_phase[i] = profile_sampledticks[i] = 0;
+      for(int c = 0; c < PERF_NUM_COUNTERS; c++) profile_counters[i][c] = 0;
+    }
+    perfRead(profile_framecounters);
+    profile_framestart = getNanoseconds();
+    profile_framestartticks = profileTicks();
+  }
+  profile_enabled = enable;
+}
 
-  //the *current* time is at the first sample of audio_data, the rest has been played through soundcard already
+void profileSampleCounters(bool sample)
+{
+  profile_samplewanted = sample;
+  profile_sampling = sample && perf_open;
+}
 
-  if(samples.size() > audio_data.size()) audio_data.resize(samples.size(), 0.0);
+void profileScopeStartCounters(ProfileScope* scope)
+{
+  scope->sampled = true;
+  perfRead(scope->counters);
+  for(int c = 0; c < PERF_NUM_COUNTERS; c++) scope->childcounters[c] = 0;
+}
 
-  if(audio_mode == 1) for(size_t i = 0; i < samples.size(); i++) audio_data[i] += samples[i];
-  else if(audio_mode == 2) for(size_t i = 0; i < samples.size(); i++) audio_data[i] += samples[i] * audio_volume;
+void profileScopeEndCounters(ProfileScope* scope, Uint64 ticks)
+{
+  Uint64 now[PERF_NUM_COUNTERS];
+  perfRead(now);
+  bool phaseok = scope->phase >= 0 && scope->phase < profile_numphases;
+  if(phaseok) profile_sampledticks[scope->phase] += ticks;
+  for(int c = 0; c < PERF_NUM_COUNTERS; c++)
+  {
+    Uint64 counted = now[c] - scope->counters[c];
+    Uint64 own = counted - std::min(counted, scope->childcounters[c] + perf_overhead[c]);
+    if(phaseok) profile_counters[scope->phase][c] += own;
+    if(scope->parent && scope->parent->sampled) scope->parent->childcounters[c] += counted + perf_overhead[c]; //our reads happened inside the parent too
+  }
+  if(scope->parent) scope->parent->children += 2 * perf_overheadticks; //don't charge the parent for the time of our two reads either
+}
+
+void profileAdd(int phase, Uint64 ticks)
+{
+  if(phase >= 0 && phase < profile_numphases) profile_phase[phase] += ticks;
+}
+
+void profileFrame()
+{
+  if(!profile_enabled) return;
+  Uint64 now = getNanoseconds(), nowticks = profileTicks();
+  Uint64* entry = profile_history[profile_frames % PROFILE_HISTORY];
+  double tickns = (nowticks > profile_framestartticks) ? double(now - profile_framestart) / (nowticks - profile_framestartticks) : 1.0;
+  for(int i = 0; i < PROFILE_MAX_PHASES; i++)
+  {
+    entry[i] = Uint64(profile_phase[i] * tickns);
+    profile_phase[i] = 0;
+  }
+  entry[PROFILE_MAX_PHASES] = now - profile_framestart;
+  profile_framestart = now;
+  profile_framestartticks = nowticks;
+
+  Uint64 (*counters)[PERF_NUM_COUNTERS] = profile_counterhistory[profile_frames % PROFILE_HISTORY];
+  Uint64 framecounters[PERF_NUM_COUNTERS];
+  perfRead(framecounters);
+  for(int i = 0; i < PROFILE_MAX_PHASES; i++)
+  {
+    //the sampled scopes stand in for all of the phase's time
+    double ratio = profile_sampledticks[i] ? double(entry[i]) / (profile_sampledticks[i] * tickns) : 0.0;
+    for(int c = 0; c < PERF_NUM_COUNTERS; c++)
+    {
+      counters[i][c] = Uint64(profile_counters[i][c] * ratio);
+      profile_counters[i][c] = 0;
+    }
+    profile_sampledticks[i] = 0;
+  }
+  for(int c = 0; c < PERF_NUM_COUNTERS; c++)
+  {
+    counters[PROFILE_MAX_PHASES][c] = framecounters[c] - profile_framecounters[c];
+    profile_framecounters[c] = framecounters[c];
+  }
+  if(perf_open) profile_hadcounters = true;
+  profile_frames++;
+}
+
+double profileAverage(int phase, int frames)
+{
+  if(phase < 0) phase = PROFILE_MAX_PHASES;
+  size_t n = std::min(profile_frames, std::min(size_t(frames), size_t(PROFILE_HISTORY)));
+  if(n == 0 || phase > PROFILE_MAX_PHASES) return 0.0;
+  Uint64 total = 0;
+  for(size_t i = profile_frames - n; i < profile_frames; i++) total += profile_history[i % PROFILE_HISTORY][phase];
+  return total / (n * 1000000.0);
+}
+
+double profileAverageCounter(int phase, int counter, int frames)
+{
+  if(phase < 0) phase = PROFILE_MAX_PHASES;
+  size_t n = std::min(profile_frames, std::min(size_t(frames), size_t(PROFILE_HISTORY)));
+  if(n == 0 || phase > PROFILE_MAX_PHASES || counter < 0 || counter >= PERF_NUM_COUNTERS) return 0.0;
+  double total = 0;
+  for(size_t i = profile_frames - n; i < profile_frames; i++) total += profile_counterhistory[i % PROFILE_HISTORY][phase][counter];
+  return total / n;
+}
+
+void profileDrawGraph(int x, int y, int width, int height)
+{
+  static const ColorRGB colors[PROFILE_MAX_PHASES] = {RGB_Red, RGB_Green, RGB_Blue, RGB_Yellow, RGB_Cyan, RGB_Magenta, RGB_Olive, RGB_Teal,
+                                                      RGB_Purple, RGB_Maroon, RGB_Darkgreen, RGB_Navy, RGB_Grey, RGB_White, RGB_Gray, RGB_Grey};
+  size_t frames = std::min(profile_frames, std::min(size_t(width), size_t(PROFILE_HISTORY)));
+
+  //scale the graph to the slowest frame shown, in powers of two milliseconds
+  Uint64 slowest = 0;
+  for(size_t i = profile_frames - frames; i < profile_frames; i++) slowest = std::max(slowest, profile_history[i % PROFILE_HISTORY][PROFILE_MAX_PHASES]);
+  double top = 1.0;
+  while(top * 1000000.0 < slowest) top *= 2;
+  double scale = height / (top * 1000000.0); //pixels per nanosecond
+
+  int bottom = y + height - 1;
+  for(size_t i = 0; i < frames; i++)
+  {
+    const Uint64* entry = profile_history[(profile_frames - frames + i) % PROFILE_HISTORY];
+    int column = x + width - int(frames) + int(i);
+    Uint64 stacked = 0;
+    for(int p = 0; p <= profile_numphases; p++)
+    {
+      //after the phases comes the time spent outside of any phase
+      Uint64 length = (p < profile_numphases) ? entry[p] : entry[PROFILE_MAX_PHASES] - std::min(stacked, entry[PROFILE_MAX_PHASES]);
+      int y1 = bottom - int(stacked * scale);
+      stacked += length;
+      int y2 = bottom - int(stacked * scale);
+      if(y2 < y1) verLine(column, y2 + 1, y1, (p < profile_numphases) ? colors[p] : RGB_Gray);
+    }
+  }
+  if(16.667 < top) horLine(bottom - int(16667000 * scale), x, x + width - 1, RGB_White); //60 fps
+
+  //legend with the averages over the frames shown
+  int line = y;
+  print(TextLine().add(profileAverage(-1, int(frames)), 2).add(" ms/frame (graph ").add(top, 0).add(" ms)"), x, line, RGB_White, 1);
+  for(int p = 0; p < profile_numphases; p++)
+  {
+    line += 8;
+    print(TextLine().add(profile_names[p]).add(" ").add(profileAverage(p, int(frames)), 2), x, line, colors[p], 1);
+  }
+  if(perf_open)
+  {
+    //instructions per cycle and misses per thousand instructions for the whole frame
+    double cycles = profileAverageCounter(-1, PERF_CYCLES, int(frames)), instructions = profileAverageCounter(-1, PERF_INSTRUCTIONS, int(frames));
+    double kilo = instructions > 0 ? instructions / 1000.0 : 1.0;
+    line += 8;
+    print(TextLine().add("IPC ").add(cycles > 0 ? instructions / cycles : 0.0, 2).add(" L1 ").add(profileAverageCounter(-1, PERF_L1D_MISSES, int(frames)) / kilo, 1), x, line, RGB_White, 1);
+    line += 8;
+    print(TextLine().add("LLC ").add(profileAverageCounter(-1, PERF_LLC_MISSES, int(frames)) / kilo, 2).add(" br ").add(profileAverageCounter(-1, PERF_BRANCH_MISSES, int(frames)) / kilo, 1).add(" /ki"), x, line, RGB_White, 1);
+  }
+}
+
+bool profileDumpCSV(const std::string& filename)
+{
+  std::ofstream file(filename.c_str());
+  if(!file) return false;
+
+  file << "frame,frame_ms";
+  for(int p = 0; p < profile_numphases; p++) file << "," << profile_names[p] << "_ms";
+  if(profile_hadcounters)
+  {
+    for(int c = 0; c < PERF_NUM_COUNTERS; c++) file << ",frame_" << perfCounterName(c);
+    for(int p = 0; p < profile_numphases; p++)
+    for(int c = 0; c < PERF_NUM_COUNTERS; c++) file << "," << profile_names[p] << "_" << perfCounterName(c);
+  }
+  file << "\n" << std::fixed << std::setprecision(4);
+
+  size_t first = profile_frames > size_t(PROFILE_HISTORY) ? profile_frames - PROFILE_HISTORY : 0;
+  for(size_t i = first; i < profile_frames; i++)
+  {
+    const Uint64* entry = profile_history[i % PROFILE_HISTORY];
+    file << i << "," << entry[PROFILE_MAX_PHASES] / 1000000.0;
+    for(int p = 0; p < profile_numphases; p++) file << "," << entry[p] / 1000000.0;
+    if(profile_hadcounters)
+    {
+      const Uint64 (*counters)[PERF_NUM_COUNTERS] = profile_counterhistory[i % PROFILE_HISTORY];
+      for(int c = 0; c < PERF_NUM_COUNTERS; c++) file << "," << counters[PROFILE_MAX_PHASES][c];
+      for(int p = 0; p < profile_numphases; p++)
+      for(int c = 0; c < PERF_NUM_COUNTERS; c++) file << "," << counters[p][c];
+    }
+    file << "\n";
+  }
+  return file.good();
 }
 
 }
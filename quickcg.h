@@ -26,6 +26,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 /*
 QuickCG is an SDL 1.2 codebase that wraps some of the SDL 1.2 functionality.
+Compiled with QUICKCG_SDL2 defined, it uses SDL2 instead: everything is drawn into a framebuffer in memory
+and redraw uploads it to a streaming texture once per frame.
 It's used by Lode's Computer Graphics Tutorial to work with simple function calls
 to demonstrate graphical programs. It may or may not be of industrial strength
 for games, though I've actually used it for some.
@@ -48,13 +50,25 @@ Account: lode dot vandevenne.
 #ifndef _quickcg_h_included
 #define _quickcg_h_included
 
+#ifdef QUICKCG_SDL2
+#include <SDL2/SDL.h>
+#else
 #include <SDL/SDL.h>
+#endif
 
 #include <string>
 #include <sstream>
 #include <iomanip>
 #include <vector>
 #include <algorithm> //std::min and std::max
+#include <chrono>
+#include <ctime> //clock_gettime
+#include <atomic>
+#include <charconv> //std::to_chars for TextLine
+#include <type_traits>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h> //__rdtsc for the profiler
+#endif
 
 namespace QuickCG
 {
@@ -175,6 +189,53 @@ struct ColorHSV
   ColorHSV();
 };
 
+/*
+A color packed in 32 bits as 0x00RRGGBB, the layout of RGBtoINT and getScreenBuffer. It's a single register
+instead of three ints, so comparing it is one test, and the operations below work on all channels at once:
+on one color with integer tricks, on arrays with SSE2 (or AVX2 if it's compiled with -mavx2) several colors
+per instruction. The results are the same either way.
+*/
+struct Color32
+{
+  Uint32 value;
+
+  Color32() : value(0) {}
+  explicit Color32(Uint32 value) : value(value & 0xFFFFFF) {}
+  Color32(Uint8 r, Uint8 g, Uint8 b) : value((Uint32(r) << 16) | (Uint32(g) << 8) | b) {}
+  Color32(const ColorRGB& color) : Color32(Uint8(color.r), Uint8(color.g), Uint8(color.b)) {}
+
+  int r() const { return value >> 16; }
+  int g() const { return (value >> 8) & 255; }
+  int b() const { return value & 255; }
+  ColorRGB rgb() const { return ColorRGB(r(), g(), b()); }
+  bool isBlack() const { return value == 0; }
+};
+
+inline bool operator==(Color32 color, Color32 color2) { return color.value == color2.value; }
+inline bool operator!=(Color32 color, Color32 color2) { return color.value != color2.value; }
+
+//every channel times scale / 65536, rounded down; scale goes up to 65536. 65536 / n rounded up divides by n
+//exactly (32768 halves, 21846 takes a third)
+inline Color32 shade(Color32 color, Uint32 scale)
+{
+  Uint32 c = color.value;
+  return Color32((((c >> 16) * scale >> 16) << 16) | ((((c >> 8) & 255) * scale >> 16) << 8) | ((c & 255) * scale >> 16));
+}
+
+//from color (t = 0) to color2 (t = 256), red and blue are done in one multiply and green in another
+inline Color32 blend(Color32 color, Color32 color2, Uint32 t)
+{
+  Uint32 a = color.value, b = color2.value, u = 256 - t;
+  Uint32 rb = (((a & 0xFF00FF) * u + (b & 0xFF00FF) * t) >> 8) & 0xFF00FF;
+  Uint32 g = (((a & 0x00FF00) * u + (b & 0x00FF00) * t) >> 8) & 0x00FF00;
+  return Color32(rb | g);
+}
+
+//the same on arrays, in place
+void shadeColors(Color32* colors, int count, Uint32 scale);
+void blendColors(Color32* colors, const Color32* colors2, int count, Uint32 t); //colors[i] = blend(colors[i], colors2[i], t)
+void fogColors(Color32* colors, int count, Color32 fog, const Uint16* amounts); //colors[i] = blend(colors[i], fog, amounts[i])
+
 ////////////////////////////////////////////////////////////////////////////////
 //GLOBAL VARIABLES//////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -188,12 +249,20 @@ extern int h;
 
 bool keyDown(int key); //this checks if the key is held down, returns true all the time until the key is up
 bool keyPressed(int key); //this checks if the key is *just* pressed, returns true only once until the key is up again
+Uint64 keyTime(int key); //getNanoseconds time of the key's last press or release (with SDL1, when the event was read)
+Uint64 inputTime(); //getNanoseconds time of the latest key event, to measure input latency from
 
 ////////////////////////////////////////////////////////////////////////////////
 //BASIC SCREEN FUNCTIONS////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
 void screen(int width = 640, int height = 400, bool fullscreen = 0, const std::string& text = " ");
+//call before screen: wait for vertical sync when presenting, and show every pixel as scale x scale pixels (the
+//window is made scale times bigger and keeps integer scaling when resized). Only the SDL2 backend uses these.
+//buffers 2 copies each frame to the window on a separate thread while the next one is drawn, and presents it from
+//the next redraw or readKeys (SDL is only ever called from the main thread). The new buffer isn't cleared
+void screenOptions(bool vsync, int scale = 1, int buffers = 1);
+void screenHeadless(int width, int height); //draws into a plain buffer instead of a window, for tests and offline rendering
 void lock();
 void unlock();
 void redraw();
@@ -201,8 +270,61 @@ void cls(const ColorRGB& color = RGB_Black);
 void pset(int x, int y, const ColorRGB& color);
 ColorRGB pget(int x, int y);
 void drawBuffer(Uint32* buffer);
+void getScreenBuffer(std::vector<Uint32>& buffer); //the screen as 0xRRGGBB pixels
 bool onScreen(int x, int y);
 
+struct ColumnSpan //rows y1 to y2 of a column, both included
+{
+  int y1;
+  int y2;
+  Uint32 color; //packed with Framebuffer::pack
+};
+
+//The screen as raw memory, for drawing code that can't afford a function call and a color conversion per line.
+//Colors are packed once with pack, the primitives don't clip (that's up to the caller) and write straight into
+//the pixels. Get it again after every redraw: with more than one buffer, redraw moves the screen to another one
+struct Framebuffer
+{
+  Uint32* pixels;
+  int width;
+  int height;
+  int pitch; //in pixels
+  Uint8 rshift; //where each channel goes in a pixel
+  Uint8 gshift;
+  Uint8 bshift;
+  Uint32 alpha; //set in every pixel, like SDL_MapRGB does
+
+  Uint32 pack(const ColorRGB& color) const
+  {
+    return (Uint32(Uint8(color.r)) << rshift) | (Uint32(Uint8(color.g)) << gshift) | (Uint32(Uint8(color.b)) << bshift) | alpha;
+  }
+  Uint32 pack(Color32 color) const
+  {
+    return ((color.value >> 16) << rshift) | (((color.value >> 8) & 255) << gshift) | ((color.value & 255) << bshift) | alpha;
+  }
+  Uint32* row(int y) const { return pixels + y * pitch; }
+  Uint32* at(int x, int y) const { return pixels + y * pitch + x; }
+
+  void pset(int x, int y, Uint32 color) const { *at(x, y) = color; }
+  void horSpan(int y, int x1, int x2, Uint32 color) const { std::fill(at(x1, y), at(x2 + 1, y), color); }
+  void verSpan(int x, int y1, int y2, Uint32 color) const
+  {
+    Uint32* p = at(x, y1);
+    for(int y = y1; y <= y2; y++, p += pitch) *p = color;
+  }
+  void verSpans(int x, const ColumnSpan* spans, int count) const //count spans of column x at once
+  {
+    Uint32* column = pixels + x;
+    for(int i = 0; i < count; i++)
+    {
+      Uint32* p = column + spans[i].y1 * pitch;
+      for(int y = spans[i].y1; y <= spans[i].y2; y++, p += pitch) *p = spans[i].color;
+    }
+  }
+};
+
+Framebuffer framebuffer(); //the buffer that's drawn into now, valid until the next redraw
+
 ////////////////////////////////////////////////////////////////////////////////
 //NON GRAPHICAL FUNCTIONS///////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -211,12 +333,75 @@ void sleep();
 void sleep(double seconds);
 void waitFrame(double oldTime, double frameDuration); //in seconds
 bool done(bool quit_if_esc = true, bool delay = true);
+
+//how done() paces the frames. A fixed rate sleeps until shortly before each frame is due and spins the rest, and
+//counts from the deadlines so lateness doesn't add up. Vsync lets the present wait for vertical sync instead (call
+//framePacing before screen); fps is then the display's refresh rate, which only SDL1 uses to time the frames as
+//it can't wait for vsync. Uncapped (the default) doesn't wait at all
+enum FramePacing
+{
+  PACING_UNCAPPED,
+  PACING_FIXED,
+  PACING_VSYNC
+};
+
+struct FramePacingStats //over the last 128 frames
+{
+  double fps;
+  double meanMs; //time between frames
+  double jitterMs; //its standard deviation
+  double worstMs;
+  int late; //frames that came more than half a frame late, only counted with a rate to keep
+};
+
+void framePacing(FramePacing mode, double fps = 0);
+FramePacingStats framePacingStats();
 void end();
-void readKeys();
+void readKeys(); //takes all queued events, done() calls it after waiting for the frame
 void getMouseState(int& mouseX, int& mouseY);
 void getMouseState(int& mouseX, int& mouseY, bool& LMB, bool& RMB);
-unsigned long getTicks(); //ticks in milliseconds
-inline double getTime() { return getTicks() / 1000.0; } //time in seconds
+
+/*
+The clock: getNanoseconds reads a monotonic clock (clock_gettime(CLOCK_MONOTONIC) where there is one, else
+std::chrono::steady_clock) that doesn't jump when the system time is set. Only differences between its values
+mean anything. It's cheap and can be read from any thread, like everything below that's built on it.
+*/
+inline Uint64 getNanoseconds()
+{
+#ifdef CLOCK_MONOTONIC
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return Uint64(now.tv_sec) * 1000000000 + now.tv_nsec;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+unsigned long getTicks(); //milliseconds since the program started
+double getTime(); //seconds since the program started, to the nanosecond
+double getFrameTime(); //seconds between the last two done() calls, 0 before the second one
+double getSmoothFrameTime(); //getFrameTime averaged over about 8 frames, steadier to move things and count FPS with
+
+//measures the time since it was created or restarted
+struct Timer
+{
+  Uint64 start;
+
+  Timer() : start(getNanoseconds()) {}
+  void restart() { start = getNanoseconds(); }
+  Uint64 nanoseconds() const { return getNanoseconds() - start; }
+  double seconds() const { return nanoseconds() / 1e9; }
+};
+
+//adds the time the enclosing block took to total, which several threads can add to at the same time
+struct ScopedTimer
+{
+  std::atomic<Uint64>& total;
+  Uint64 start;
+
+  ScopedTimer(std::atomic<Uint64>& total) : total(total), start(getNanoseconds()) {}
+  ~ScopedTimer() { total.fetch_add(getNanoseconds() - start, std::memory_order_relaxed); }
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 //2D SHAPES/////////////////////////////////////////////////////////////////////
@@ -227,6 +412,7 @@ bool verLine(int x, int y1, int y2, const ColorRGB& color);
 int* verLineDepth(int x, int y1, int y2, const ColorRGB& color, int* buffer, int width, int* count);
 double* verLineZDepth(int x, int y1, int y2, const ColorRGB& color, double* buffer, int width, int* count, double distance);
 int* verLineTriDepth(int x, int y1, int y2, const ColorRGB& color, int* buffer, int width, int* count, int mode, int* buftwo);
+int* verLineTriDepth(const Framebuffer& fb, int x, int y1, int y2, Uint32 color, int* buffer, int width, int* count, int mode, int* buftwo); //color packed with fb.pack
 bool drawLine(int x1, int y1, int x2, int y2, const ColorRGB& color);
 bool drawCircle(int xc, int yc, int radius, const ColorRGB& color);
 bool drawDisk(int xc, int yc, int radius, const ColorRGB& color);
@@ -254,6 +440,9 @@ void saveFile(const std::vector<unsigned char>& buffer, const std::string& filen
 //IMAGE FUNCTIONS///////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+//loadImage caches the decoded pixels in dir and maps them on later loads instead of decoding the PNG again.
+//The default is $XDG_CACHE_HOME/quickcg or ~/.cache/quickcg, an empty dir turns the cache off
+void setImageCacheDir(const std::string& dir);
 int loadImage(std::vector<ColorRGB>& out, unsigned long& w, unsigned long& h, const std::string& filename);
 int loadImage(std::vector<Uint32>& out, unsigned long& w, unsigned long& h, const std::string& filename);
 int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width, unsigned long& image_height, const unsigned char* in_png, size_t in_size, bool convert_to_rgba32 = true);
@@ -262,9 +451,52 @@ int decodePNG(std::vector<unsigned char>& out_image_32bit, unsigned long& image_
 ////////////////////////////////////////////////////////////////////////////////
 //TEXT FUNCTIONS////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
-extern bool font[256][8][8];
+extern const unsigned char font[256][8]; //8x8 pixels per character, bit x of font[c][y] is pixel (x, y)
 void drawLetter(unsigned char n, int x, int y, const ColorRGB& color = RGB_White, bool bg = 0, const ColorRGB& color2 = RGB_Black);
 int printString(const std::string& text, int x = 0, int y = 0, const ColorRGB& color = RGB_White, bool bg = 0, const ColorRGB& color2 = RGB_Black, int forceLength = 0);
+int printChars(const char* text, int length, int x = 0, int y = 0, const ColorRGB& color = RGB_White, bool bg = 0, const ColorRGB& color2 = RGB_Black, int forceLength = 0);
+
+//A line of text built without allocating, for text that's drawn every frame. Numbers are formatted with
+//std::to_chars; whatever doesn't fit in the line is left out.
+//usage: print(TextLine().add("X: ").add(posX, 2).add(" chunks: ").add(chunks), 300, 0);
+struct TextLine
+{
+  char text[128];
+  int length;
+
+  TextLine() : length(0) {}
+
+  TextLine& add(const char* s)
+  {
+    while(*s && length < int(sizeof(text))) text[length++] = *s++;
+    return *this;
+  }
+  TextLine& add(const std::string& s)
+  {
+    int n = std::min(int(s.size()), int(sizeof(text)) - length);
+    std::copy(s.data(), s.data() + n, text + length);
+    length += n;
+    return *this;
+  }
+  template<typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+  TextLine& add(T value)
+  {
+    std::to_chars_result result = std::to_chars(text + length, text + sizeof(text), value);
+    if(result.ec == std::errc()) length = int(result.ptr - text);
+    return *this;
+  }
+  TextLine& add(double value, int decimals)
+  {
+    std::to_chars_result result = std::to_chars(text + length, text + sizeof(text), value, std::chars_format::fixed, decimals);
+    if(result.ec == std::errc()) length = int(result.ptr - text);
+    return *this;
+  }
+};
+
+inline int print(const TextLine& line, int x = 0, int y = 0, const ColorRGB& color = RGB_White, bool bg = 0, const ColorRGB& color2 = RGB_Black, int forceLength = 0)
+{
+  return printChars(line.text, line.length, x, y, color, bg, color2, forceLength);
+}
 
 //print something (string, int, float, ...)
 template<typename T>
@@ -300,7 +532,7 @@ T getInput(const std::string& message = "", bool clear = false, int x = 0, int y
 //SOUNDCARD FUNCTIONS///////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-int audioOpen(int samplerate, int framesize); //always 16-bit mono sound for now; returns 0 if no error happened
+int audioOpen(int samplerate, int framesize); //16-bit stereo, pushed samples play on both channels; returns 0 if no error happened
 void audioClose();
 int audioReOpen(); //closes and opens again with same parameters
 
@@ -318,14 +550,139 @@ void audioSetBufferSamplesRange(size_t min_samples, size_t max_samples); //set s
 This plays the sound starting at this time, until it's done
 The difference with audioPushSamples is:
 audioPlay allows playing multiple sounds at the same time: it doesn't push at the end,
-but elementwise-adds or pushes back samples if needed.
+but the sound is mixed over the pushed samples from the next audio callback on.
 The duration depends on samplerate, make sure the samples in the vector have the correct samplerate.
+Each sound plays on one of 64 voices, with its own gain and a pan from -1 (left only) over 0 (both channels at
+full gain) to 1 (right only). It returns a handle to the voice, or -1 if all of them are playing.
 */
-void audioPlay(const std::vector<double>& samples);
+int audioPlay(const std::vector<double>& samples, double gain = 1.0, double pan = 0.0);
+
+/*
+Positional sound: audioPlayAt plays a sound at a position in the world (voxels for voxel7), with its gain and pan
+following the listener. The listener is at x, y, z; sounds pan fully right in the direction of rightX, rightY,
+rightZ (the camera plane in voxel7), and fall off with 1 / distance beyond distance.
+*/
+int audioPlayAt(const std::vector<double>& samples, double x, double y, double z, double gain = 1.0);
+void audioListener(double x, double y, double z, double rightX, double rightY, double rightZ, double distance = 16.0);
+
+void audioVoiceSet(int voice, double gain, double pan); //changes a playing voice, it no longer follows a position
+void audioVoiceMove(int voice, double x, double y, double z); //moves a playing voice, it follows the listener from now on
+void audioVoiceStop(int voice);
+bool audioVoicePlaying(int voice); //false once the sound is over or stopped
 
 void audioSetMode(int mode); //0: silent, 1: full (no volume calculations ==> faster), 2: volume-controlled (= default value)
 void audioSetVolume(double volume); //multiplier used if mode is 2 (volume-controlled). Default value is 1.0.
 
+////////////////////////////////////////////////////////////////////////////////
+//PERFORMANCE COUNTER FUNCTIONS/////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+Hardware performance counters of the calling thread, through Linux perf_event_open.
+Counters are read from user space with rdpmc when the kernel allows it, otherwise
+with a read() per counter, which is too slow to say much about very short scopes.
+Counters the CPU (or VM) doesn't have stay at 0. On other systems perfOpen always fails.
+*/
+enum PerfCounter
+{
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES, //L1 data cache read misses
+  PERF_LLC_MISSES, //last level cache misses
+  PERF_BRANCH_MISSES,
+  PERF_NUM_COUNTERS
+};
+
+bool perfOpen(); //returns false if none of the counters is available, e.g. because of perf_event_paranoid
+void perfClose();
+bool perfAvailable(); //true between a successful perfOpen and perfClose
+bool perfCounterAvailable(int counter);
+const char* perfCounterName(int counter);
+void perfRead(Uint64 values[PERF_NUM_COUNTERS]); //current counter values, only differences between two reads mean something
+
+////////////////////////////////////////////////////////////////////////////////
+//PROFILING FUNCTIONS///////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+A small per-phase frame profiler.
+Register the phases once with profileRegister, wrap each phase in a ProfileScope and
+call profileFrame at the end of every frame. Each frame is stored in a ring buffer of
+PROFILE_HISTORY frames, which can be drawn as a graph or written to a CSV file.
+Scopes can be nested: a phase is only charged for the time not spent in its children.
+Scopes count CPU timestamp ticks where available, which are much cheaper to read than
+the clock, and profileFrame converts them to nanoseconds using the frame's wall time.
+If perfOpen succeeded, every frame also records the hardware counters, and scopes created
+while profileSampleCounters is on record them per phase. Reading the counters costs more
+than the timer, so sample only some of the scopes (e.g. every 16th column): the counters
+of each phase are scaled up by the ratio of its total time to its sampled time.
+Not thread safe, only profile from the thread that calls profileFrame.
+*/
+const int PROFILE_MAX_PHASES = 16;
+const int PROFILE_HISTORY = 4096; //frames kept in the ring buffer
+
+extern bool profile_enabled;
+extern bool profile_sampling; //profile_enabled, a sampled scope is wanted and perfAvailable
+
+inline Uint64 profileTicks() //the unit the scopes count in
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __rdtsc();
+#else
+  return getNanoseconds();
+#endif
+}
+
+int profileRegister(const std::string& name); //returns the phase id, or -1 if there are already PROFILE_MAX_PHASES phases
+void profileEnable(bool enable);
+inline bool profileEnabled() { return profile_enabled; }
+void profileAdd(int phase, Uint64 ticks);
+void profileSampleCounters(bool sample); //scopes created from now on read the hardware counters too
+void profileFrame(); //closes the current frame and stores it in the ring buffer
+double profileAverage(int phase, int frames); //average milliseconds per frame over the last frames, -1 is the whole frame
+double profileAverageCounter(int phase, int counter, int frames); //average counter value per frame, -1 is the whole frame
+void profileDrawGraph(int x, int y, int width, int height); //stacked graph of the last width frames, with a legend
+bool profileDumpCSV(const std::string& filename); //writes every frame still in the ring buffer, returns false on failure
+
+//times the enclosing block, does nothing (but one test) if profiling is disabled
+struct ProfileScope
+{
+  int phase;
+  Uint64 start; //in profileTicks
+  Uint64 children; //ticks spent in nested scopes, not charged to this phase
+  ProfileScope* parent;
+  bool sampled; //also reads the hardware counters
+  Uint64 counters[PERF_NUM_COUNTERS]; //counter values at the start
+  Uint64 childcounters[PERF_NUM_COUNTERS]; //counts of nested sampled scopes, not charged to this phase
+
+  ProfileScope(int phase);
+  ~ProfileScope();
+};
+
+void profileScopeStartCounters(ProfileScope* scope);
+void profileScopeEndCounters(ProfileScope* scope, Uint64 ticks);
+
+extern ProfileScope* profile_current;
+
+inline ProfileScope::ProfileScope(int phase) : phase(phase), start(0), children(0), parent(0), sampled(false)
+{
+  if(!profile_enabled) return;
+  parent = profile_current;
+  profile_current = this;
+  if(profile_sampling) profileScopeStartCounters(this);
+  start = profileTicks();
+}
+
+inline ProfileScope::~ProfileScope()
+{
+  if(!start) return;
+  Uint64 elapsed = profileTicks() - start;
+  profileAdd(phase, elapsed - children);
+  if(sampled) profileScopeEndCounters(this, elapsed - children);
+  if(parent) parent->children += elapsed;
+  profile_current = parent;
+}
+
 } //end of namespace QuickCG
 
 #endif
@@ -26,13 +26,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <cmath>
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <sys/stat.h>
 #include "quickcg.h"
+#include "voxworld.h"
 using namespace QuickCG;
 
+//size of the default map, and of every headerless .vx5 file
 #define mapWidth 96
 #define mapHeight 96
 #define mapDepth 12
@@ -40,16 +44,54 @@ using namespace QuickCG;
 #define windowWidth 512
 #define windowHeight 384
 
-typedef struct VoxelCell
+World world;
+StreamingWorld streaming;
+WorldSaver saver;
+Journal journal;
+
+//ray traversal statistics for the heatmap debug mode
+typedef struct ColumnStats
 {
-    ColorRGB color;
-    int runLength;
-} VoxelCell;
+    int ddaSteps;
+    int spanIterations;
+    int verLineCalls;
+    int endX, endY; //map cell the ray stopped in
+    bool capped; //gave up at the step limit
+} ColumnStats;
+
+#define maxDDASteps 900
+
+ColumnStats columnStats[windowWidth];
+int pixelStep[windowWidth*windowHeight]; //DDA step that filled each pixel, 0 if none did
+int pixelCalls[windowWidth*windowHeight]; //verLineTriDepth calls that tested each pixel
+
+const char* heatmapNames[] = {"", "DDA steps per column", "span iterations per column", "verLineTriDepth calls per column",
+                              "DDA step that filled each pixel", "verLineTriDepth calls per pixel"};
+const int heatmapModes = 6;
+
+typedef struct Camera
+{
+    double posX, posY, posZ;
+    double dirX, dirY; //direction vector
+    double planeX, planeY; //the 2d raycaster version of camera plane
+    int pitch; //tilt of camera
+} Camera;
+
+int depth[windowHeight];
+int depthrear[windowHeight];
 
-VoxelCell worldMap[mapWidth][mapHeight][mapDepth];
+//frame profiler phases, the overlay is toggled with O
+int profRaySetup = -1, profDDA = -1, profSpans = -1, profVerLine = -1;
 
+bool loadMap(const std::string& filename);
+bool saveMap(const World& map, const std::string& filename);
 void defaultMap();
-void encodeMap();
+bool walkable(double x, double y);
+void renderView(const Camera& camera, bool collectStats, int frameNumber);
+int runGolden(const std::string& directory, bool record, int tolerance);
+void countStripe(int x, int y1, int y2);
+void drawHeatmap(int mode);
+bool writeRayStats(const std::string& prefix);
 
 int main(int argc, char** argv)
 {
@@ -59,37 +101,121 @@ int main(int argc, char** argv)
 
     int pitch = 200; //tilt of camera
     
-    double time = 0; //time of current frame
-    double oldTime = 0; //time of previous frame
+    double time = 0; //time of current frame, in milliseconds
     
-    std::vector<unsigned char> mapFile;
+    std::string mapName, profileName, goldenDir, convertName, heightName, colorName;
+    bool goldenRecord = false;
+    int tolerance = 0;
+    int genWidth = 0, genHeight = 0, genDepth = 0;
+    int streamBudget = 0; //MB, stream the map instead of loading it if set
+    int heightDepth = 256; //depth of a world made from a heightmap
+    int buffers = 2; //frames in flight, 2 copies the finished frame to the window on another thread, 1 does it inline
+    FramePacing pacing = PACING_UNCAPPED;
+    double pacingRate = 0; //frames per second, or the refresh rate with vsync
+    GeneratorSettings genSettings = defaultGeneratorSettings();
     
-    if(argc > 1)
+    for(int i = 1; i < argc; i++)
     {
-        loadFile(mapFile, argv[1]);
+        std::string arg = argv[i];
         
-        if(mapFile.size() < mapHeight*mapWidth*mapDepth*3)
+        if(arg == "-p" && i + 1 < argc)
+            profileName = argv[++i]; //profile every frame and write the CSV here on exit
+        else if((arg == "--golden-check" || arg == "--golden-record") && i + 1 < argc)
         {
-            std::cout << "File \"" << argv[1] << "\" is corrupt - using defaults\n";
-            defaultMap();
+            goldenRecord = (arg == "--golden-record");
+            goldenDir = argv[++i];
+        }
+        else if(arg == "--tolerance" && i + 1 < argc)
+            tolerance = std::stoi(argv[++i]);
+        else if(arg == "-g" && i + 1 < argc)
+        {
+            //generate a world of the given size instead of loading one, e.g. -g 4096x4096x256
+            if(sscanf(argv[++i], "%dx%dx%d", &genWidth, &genHeight, &genDepth) != 3)
+                genWidth = genHeight = genDepth = 0;
+        }
+        else if(arg == "--heightmap" && i + 1 < argc)
+            heightName = argv[++i]; //build the world from a height PNG, and optionally a color PNG
+        else if(arg == "--colormap" && i + 1 < argc)
+            colorName = argv[++i];
+        else if(arg == "--depth" && i + 1 < argc)
+            heightDepth = std::stoi(argv[++i]);
+        else if(arg == "--fps" && i + 1 < argc)
+        {
+            pacing = PACING_FIXED;
+            pacingRate = std::stod(argv[++i]);
+        }
+        else if(arg == "--vsync" && i + 1 < argc)
+        {
+            pacing = PACING_VSYNC;
+            pacingRate = std::stod(argv[++i]); //refresh rate of the display
         }
+        else if(arg == "--buffers" && i + 1 < argc)
+            buffers = std::stoi(argv[++i]);
+        else if(arg == "--stream" && i + 1 < argc)
+            streamBudget = std::stoi(argv[++i]);
+        else if(arg == "--convert" && i + 1 < argc)
+            convertName = argv[++i]; //save the loaded or generated world to this file and quit
+        else if(arg == "--seed" && i + 1 < argc)
+            genSettings.seed = std::stoul(argv[++i]);
+        else if(arg == "--hills" && i + 1 < argc)
+            genSettings.hills = std::stod(argv[++i]);
+        else if(arg == "--caves" && i + 1 < argc)
+            genSettings.caves = std::stod(argv[++i]);
+        else if(arg == "--buildings" && i + 1 < argc)
+            genSettings.buildings = std::stod(argv[++i]);
         else
+            mapName = arg;
+    }
+    
+    if(!goldenDir.empty())
+        return runGolden(goldenDir, goldenRecord, tolerance);
+    
+    if(genWidth > 0 && genHeight > 0 && genDepth > 0)
+    {
+        if(!createWorld(world, genWidth, genHeight, genDepth))
+        {
+            std::cout << "Not enough memory for a " << genWidth << "x" << genHeight << "x" << genDepth << " world\n";
+            return 1;
+        }
+        
+        Timer timer;
+        generateWorld(world, genSettings);
+        std::cout << "Generated a " << genWidth << "x" << genHeight << "x" << genDepth << " world in " << timer.seconds() << " s\n";
+    }
+    else if(!heightName.empty())
+    {
+        Timer timer;
+        if(!loadHeightmap(world, heightName, colorName, heightDepth))
+        {
+            std::cout << "Could not build a world from \"" << heightName << "\"\n";
+            return 1;
+        }
+        
+        std::cout << "Built a " << world.width << "x" << world.height << "x" << world.depth << " world from \"" << heightName << "\" in " << timer.seconds() << " s\n";
+    }
+    else if(!mapName.empty() && streamBudget > 0 && streamOpen(streaming, world, mapName, size_t(streamBudget) << 20))
+    {
+        std::cout << "Streaming file \"" << mapName << "\" in " << streamBudget << " MB\n";
+    }
+    else if(!mapName.empty())
+    {
+        if(loadMap(mapName))
         {
-            int counter = 0;
+            std::cout << "Loaded file \"" << mapName << "\"\n";
             
-            for(int x=0;x<mapWidth;x++)
+            //edits go to a journal next to the map, only maps voxel7 can write back are journaled
+            std::string extension = mapName.substr(mapName.find_last_of('.') + 1);
+            if(convertName.empty() && extension != "vxl")
             {
-                for(int y=0;y<mapHeight;y++)
-                {
-                    for(int z=0;z<mapDepth;z++)
-                    {
-                        worldMap[x][y][z].color = ColorRGB{mapFile[counter], mapFile[counter+1], mapFile[counter+2]};
-                        counter += 3;
-                    }
-                }
+                int replayed = journalOpen(journal, world, mapName);
+                if(replayed < 0) std::cout << "Could not open the journal, edits won't be kept\n";
+                else if(replayed > 0) std::cout << "Replayed " << replayed << " edits from the journal\n";
             }
-            
-            std::cout << "Loaded file \"" << argv[1] << "\"\n";
+        }
+        else
+        {
+            std::cout << "File \"" << mapName << "\" is corrupt - using defaults\n";
+            defaultMap();
         }
     }
     else
@@ -97,288 +223,74 @@ int main(int argc, char** argv)
         std::cout << "No map loaded - using defaults\n";
         defaultMap();
     }
-
-    encodeMap();
-
-    screen(windowWidth, windowHeight, 0, "Vox7 Application");
-
-    int* depth = (int*)malloc(windowHeight*sizeof(int)); //new int[384];
-    int* depthrear = (int*)malloc(windowHeight*sizeof(int)); //new int[384];
-            
-    while(!done())
+    
+    //worlds that aren't the default size start in the middle, a few voxels above the ground
+    if(world.width != mapWidth || world.height != mapHeight || world.depth != mapDepth)
     {
-        for(int x = 0; x < w; x++)
+        posX = world.width / 2 + 0.5;
+        posY = world.height / 2 + 0.5;
+        if(world.stream) streamPreload(*world.stream, posX, posY);
+        posZ = std::max(0, surfaceHeight(world, world.width / 2, world.height / 2) - 4);
+    }
+    
+    if(!convertName.empty())
+    {
+        if(!saveMap(world, convertName))
         {
-            //calculate ray position and direction
-            double cameraX = 2 * x / double(w) - 1; //x-coordinate in camera space
-            double rayPosX = posX;
-            double rayPosY = posY;
-
-            double rayDirX = dirX + planeX * cameraX;
-            double rayDirY = dirY + planeY * cameraX;
-
-            //which box of the map we're in
-            int mapX = int(rayPosX), tmapX;
-            int mapY = int(rayPosY), tmapY;
-
-            //length of ray from current position to next x or y-side
-            double sideDistX, tsideDistX;
-            double sideDistY, tsideDistY;
-
-            //length of ray from one x or y-side to next x or y-side
-            double deltaDistX = sqrt(1 + (rayDirY * rayDirY) / (rayDirX * rayDirX));
-            double deltaDistY = sqrt(1 + (rayDirX * rayDirX) / (rayDirY * rayDirY));
-            double perpWallDist, tperpWallDist;
-            int lineHeight, tlineHeight;
-            
-            //what direction to step in x or y-direction (either +1 or -1)
-            int stepX;
-            int stepY;
-
-            int hit = 1; //was there a wall hit?
-            int side, tside; //was a NS or a EW wall hit?
-            
-            std::fill_n(depth, windowHeight, 100000); //memset(&depth, 1, sizeof(double)*384);
-            std::fill_n(depthrear, windowHeight, 100000); //memset(&depth, 1, sizeof(double)*384);
-            
-            //std::cout << "Pointer : " << (uint64_t)depth << "\n";
-            
-            int count = 0;
-            
-            //calculate step and initial sideDist
-            if (rayDirX < 0)
-            {
-                stepX = -1;
-                sideDistX = (rayPosX - mapX) * deltaDistX;
-            }
-            else
-            {
-                stepX = 1;
-                sideDistX = (mapX + 1.0 - rayPosX) * deltaDistX;
-            }
-            if (rayDirY < 0)
-            {
-                stepY = -1;
-                sideDistY = (rayPosY - mapY) * deltaDistY;
-            }
-            else
-            {
-                stepY = 1;
-                sideDistY = (mapY + 1.0 - rayPosY) * deltaDistY;
-            }
-
-            //First run
-            //jump to next map square, OR in x-direction, OR in y-direction
-            if(sideDistX < sideDistY)
-            {
-                sideDistX += deltaDistX;
-                mapX += stepX;
-                side = 0;
-            }
-            else
-            {
-                sideDistY += deltaDistY;
-                mapY += stepY;
-                side = 1;
-            }
-
-            if(mapX < 0) mapX = 0;
-            if(mapY < 0) mapY = 0;
-
-            if(mapX > mapHeight-1) mapX = mapHeight-1;
-            if(mapY > mapWidth-1) mapY = mapWidth-1;
-            
-            //Calculate distance projected on camera direction (oblique distance will give fisheye effect!)
-            if (side == 0) perpWallDist = (mapX - rayPosX + (1 - stepX) / 2) / rayDirX;// /2; //why did I have these
-            else           perpWallDist = (mapY - rayPosY + (1 - stepY) / 2) / rayDirY;// /2;
-
-            //Calculate height of line to draw on screen
-            lineHeight = (int)(h / perpWallDist); //This needs to be divided by 2 to make square voxels, but then it crashes. ??? wait nvm
-                
-            //perform DDA
-            while (mapX < 0 || mapY < 0 || (count < windowHeight && hit < 900))
-            {
-                hit += 1;
-                
-                //Calculate next DDA for horizontal fill
-                tmapX = mapX;
-                tmapY = mapY;
-                tside = side;
-                tsideDistX = sideDistX;
-                tsideDistY = sideDistY;
-                
-                //jump to next map square, OR in x-direction, OR in y-direction
-                if(sideDistX < sideDistY)
-                {
-                    tsideDistX += deltaDistX;    
-                    tmapX += stepX;
-                    tside = 0;
-                }
-                else
-                {
-                    tsideDistY += deltaDistY;
-                    tmapY += stepY;
-                    tside = 1;
-                }
-
-                if(tmapX < 0) tmapX = 0;
-                if(tmapY < 0) tmapY = 0;
-
-                if(tmapX > mapHeight-1) tmapX = mapHeight-1;
-                if(tmapY > mapWidth-1) tmapY = mapWidth-1;
-                
-                //Calculate distance projected on camera direction (oblique distance will give fisheye effect!)
-                if (tside == 0) tperpWallDist = (tmapX - rayPosX + (1 - stepX) / 2) / rayDirX;// /2; //why did I have these
-                else           tperpWallDist = (tmapY - rayPosY + (1 - stepY) / 2) / rayDirY;// /2;
-
-                //Calculate height of line to draw on screen
-                int tlineHeight = (int)(h / tperpWallDist); //This needs to be divided by 2 to make square voxels, but then it crashes. ??? wait nvm
-                    
-                for(int b=0;b<mapDepth;b++)
-                {
-                    int ob = b;
-                    
-                    //calculate lowest and highest pixel to fill in current stripe
-                    int drawStart = ((lineHeight)*(ob-posZ)) + pitch;
-                    if(drawStart < 0)drawStart = 0;
-                    
-                    b += (worldMap[mapX][mapY][ob].runLength)-1;
-                    if(b < 0) b = 0;
-                    
-                    int drawEnd = lineHeight + ((lineHeight)*(b-posZ)) + pitch;
-                    if(drawEnd >= h)drawEnd = h - 1;
-                    
-                    //choose wall color
-                    ColorRGB color = worldMap[mapX][mapY][b].color;
-
-                    //give x and y sides different brightness
-                    if (side == 1) {color = color / 2;}
-
-                    //draw the pixels of the stripe as a vertical line
-                    if(color != RGB_Black)
-                    {
-                        verLineTriDepth(x, drawStart, drawEnd, color, depth, windowHeight, &count, 0, depthrear);
-                    }
-                         
-                    //calculate lowest and highest pixel to fill in current stripe
-                    int tdrawStart = ((tlineHeight)*(ob-posZ)) + pitch;
-                    if(tdrawStart < 0)tdrawStart = 0;
-                    int tdrawEnd = tlineHeight + ((tlineHeight)*(b-posZ)) + pitch;
-                    if(tdrawEnd >= h)tdrawEnd = h - 1;
-                    
-                    //choose wall color
-                    ColorRGB tcolor = worldMap[mapX][mapY][b].color;
-
-                    //give x and y sides different brightness
-                    {tcolor = tcolor / 3;}
-
-                    //draw the pixels of the stripe as a vertical line
-                    if(tcolor != RGB_Black)
-                    {
-                        verLineTriDepth(x, (b<posZ)?drawStart:tdrawStart, (b<posZ)?tdrawEnd:drawEnd, tcolor, depth, windowHeight, &count, 1, depthrear);
-                    }
-                }
-                
-                memcpy(depth, depthrear, windowHeight * sizeof(int));
-                lineHeight = tlineHeight;
-                perpWallDist = tperpWallDist;
-                sideDistX = tsideDistX;
-                sideDistY = tsideDistY;
-                side = tside;
-                mapX = tmapX;
-                mapY = tmapY;
-            }
+            std::cout << "Could not write " << convertName << "\n";
+            return 1;
         }
         
-        //timing for input and FPS counter
-        oldTime = time;
-        time = getTicks();
-        double frameTime = (time - oldTime) / 1000.0; //frameTime is the time this frame has taken, in seconds
-        print(1.0 / frameTime); //FPS counter
-        print(std::string("X: " + std::to_string(posX) + "  Y: " + std::to_string(posY)), 300, 0);
-        
-        redraw();
+        std::cout << "Saved to " << convertName << "\n";
+        return 0;
+    }
 
-        //EDIT MODE
-        if(keyDown(SDLK_p))
-        {
-            print("EDIT MODE", 256, 120);
-            redraw();
-            std::cout << "Edit mode enabled.\n";
-            
-            bool editing = true;
+    screenOptions(false, 1, buffers); //renderView draws every pixel, so the buffers don't need clearing
+    framePacing(pacing, pacingRate);
+    screen(windowWidth, windowHeight, 0, "Vox7 Application");
+    
+    profRaySetup = profileRegister("ray setup");
+    profDDA = profileRegister("dda");
+    profSpans = profileRegister("spans");
+    profVerLine = profileRegister("verline");
+    int profPresent = profileRegister("present");
+    int profHUD = profileRegister("hud");
+    int profStream = profileRegister("stream");
+    double lastX = posX, lastY = posY;
+    int lastSaveState = SAVE_IDLE;
+    double saveMessageUntil = 0; //the result of a save stays on the HUD for a few seconds
+    bool showProfile = false;
+    int frameNumber = 0;
+    int heatmapMode = 0; //cycled with H, L writes the statistics of the next frame to files
+    bool dumpStats = false;
+    profileEnable(!profileName.empty());
+    if(!profileName.empty() && !perfOpen()) std::cout << "Hardware counters unavailable - profiling time only\n";
             
-            while(editing)
-            {
-                std::cout << ">";
-                
-                std::string input, part;
-                std::vector<std::string> args;
-                
-                getline(std::cin, input);
-                
-                std::istringstream inp(input);
-                while(getline(inp, part, ' '))
-                    args.push_back(part);
-                
-                if(args.size() > 0)
-                {
-                    if(args[0] == "q")
-                    {
-                        editing = false;
-                    }
-                    else if(args[0] == "w")
-                    {
-                        worldMap[std::stoi(args[1])][std::stoi(args[2])][std::stoi(args[3])].color = ColorRGB{(unsigned char)std::stoi(args[4]), (unsigned char)std::stoi(args[5]), (unsigned char)std::stoi(args[6])};
-                        std::cout << "Voxel written\n";
-                    }
-                    else if(args[0] == "s")
-                    {
-                        std::vector<unsigned char> wdata;
-                        
-                        for(int x=0;x<mapWidth;x++)
-                        {
-                            for(int y=0;y<mapHeight;y++)
-                            {
-                                for(int z=0;z<mapDepth;z++)
-                                {
-                                    wdata.push_back(worldMap[x][y][z].color.r);
-                                    wdata.push_back(worldMap[x][y][z].color.g);
-                                    wdata.push_back(worldMap[x][y][z].color.b);
-                                }
-                            }
-                        }
-                        
-                        std::ofstream file;
-                        file.open(args[1].c_str(), std::ios::out|std::ios::binary);
-                        file.write((char*)&wdata[0], std::streamsize(wdata.size()));
-                        file.close();
-                        
-                        std::cout << "Saved to " << args[1] << "\n";
-                    }
-                }
-            }
-        }
+    while(!done()) //waits for the frame as set by --fps or --vsync, then reads the input
+    {
+        frameNumber++;
         
-        cls();
+        //timing for input and FPS counter
+        time = getTicks();
+        double frameTime = getSmoothFrameTime(); //frameTime is the time the last frames have taken, in seconds
         
+        //the keys were read by done() just now, so the camera moves right before the frame is traced
         //speed modifiers
         double moveSpeed = frameTime * 10.0; //the constant value is in squares/second
         double rotSpeed = frameTime * 3.0; //the constant value is in radians/second
-        readKeys();
         
         //move forward if no wall in front of you
         if (keyDown(SDLK_UP))
         {
-            if(worldMap[int(posX + dirX * moveSpeed)][int(posY)][10].color == RGB_Black) posX += dirX * moveSpeed;
-            if(worldMap[int(posX)][int(posY + dirY * moveSpeed)][10].color == RGB_Black) posY += dirY * moveSpeed;
+            if(walkable(posX + dirX * moveSpeed, posY)) posX += dirX * moveSpeed;
+            if(walkable(posX, posY + dirY * moveSpeed)) posY += dirY * moveSpeed;
         }
         
         //move backwards if no wall behind you
         if (keyDown(SDLK_DOWN))
         {
-            if(worldMap[int(posX - dirX * moveSpeed)][int(posY)][10].color == RGB_Black) posX -= dirX * moveSpeed;
-            if(worldMap[int(posX)][int(posY - dirY * moveSpeed)][10].color == RGB_Black) posY -= dirY * moveSpeed;
+            if(walkable(posX - dirX * moveSpeed, posY)) posX -= dirX * moveSpeed;
+            if(walkable(posX, posY - dirY * moveSpeed)) posY -= dirY * moveSpeed;
         }
         
         //rotate to the right
@@ -416,7 +328,7 @@ int main(int argc, char** argv)
         if (keyDown(SDLK_j))
         {
             posZ += .1;
-            if(posZ > mapDepth) posZ = mapDepth;
+            if(posZ > world.depth) posZ = world.depth;
         }        
         
         //pitch up
@@ -430,73 +342,784 @@ int main(int argc, char** argv)
         {
             pitch -= 10;
         }
+        
+        //positional sounds are heard from the camera and pan toward the right of the screen
+        audioListener(posX, posY, posZ, planeX, planeY, 0);
+        
+        //profiler overlay
+        if (keyPressed(SDLK_o))
+        {
+            showProfile = !showProfile;
+            profileEnable(showProfile || !profileName.empty());
+            if(showProfile && !perfAvailable()) perfOpen();
+        }
+        
+        //ray statistics heatmap
+        if (keyPressed(SDLK_h))
+        {
+            heatmapMode = (heatmapMode + 1) % heatmapModes;
+        }
+        
+        //write the ray statistics of the next frame
+        if (keyPressed(SDLK_l))
+        {
+            dumpStats = true;
+        }
+        
+        bool collectStats = heatmapMode != 0 || dumpStats;
+        
+        renderView(Camera{posX, posY, posZ, dirX, dirY, planeX, planeY, pitch}, collectStats, frameNumber);
+        
+        profileSampleCounters(true);
+        
+        if(dumpStats)
+        {
+            if(writeRayStats("raystats_" + std::to_string(frameNumber))) std::cout << "Wrote raystats_" << frameNumber << "_columns.csv and _pixels.csv\n";
+            else std::cout << "Could not write ray statistics\n";
+            dumpStats = false;
+        }
+        
+        if(heatmapMode != 0) drawHeatmap(heatmapMode);
+        
+        if(collectStats)
+        {
+            std::fill_n(pixelStep, windowWidth*windowHeight, 0);
+            std::fill_n(pixelCalls, windowWidth*windowHeight, 0);
+        }
+        
+        {
+            ProfileScope hudScope(profHUD);
+            //formatted on the stack, the HUD doesn't allocate
+            print(TextLine().add(frameTime > 0 ? 1.0 / frameTime : 0.0, 1)); //FPS counter
+            FramePacingStats pacingStats = framePacingStats();
+            print(TextLine().add(pacingStats.meanMs, 2).add(" ms +-").add(pacingStats.jitterMs, 2).add(", ").add(pacingStats.late).add(" late"), 0, 8);
+            print(TextLine().add("X: ").add(posX, 6).add("  Y: ").add(posY, 6), 300, 0);
+            if(world.stream) print(TextLine().add(world.stream->resident.size()).add(" chunks, ").add(streamQueued(*world.stream)).add(" queued"), 300, 8);
+            
+            int saveState = saveStatus(saver);
+            if(saveState != lastSaveState && (saveState == SAVE_DONE || saveState == SAVE_FAILED)) saveMessageUntil = time + 3000;
+            lastSaveState = saveState;
+            
+            if(saveState == SAVE_COPYING || saveState == SAVE_WRITING) print(TextLine().add("Saving ").add(saver.filename).add("..."), 300, 16);
+            else if(saveState == SAVE_DONE && time < saveMessageUntil) print(TextLine().add("Saved ").add(saver.filename).add(" in ").add(saver.seconds, 2).add(" s"), 300, 16);
+            else if(saveState == SAVE_FAILED && time < saveMessageUntil) print(TextLine().add("Could not save ").add(saver.filename), 300, 16);
+            if(showProfile) profileDrawGraph(0, h - 160, 256, 160);
+        }
+        
+        {
+            ProfileScope presentScope(profPresent);
+            redraw();
+        }
+
+        //EDIT MODE
+        if(keyDown(SDLK_p))
+        {
+            print("EDIT MODE", 256, 120);
+            redraw();
+            std::cout << "Edit mode enabled.\n";
+            
+            bool editing = true;
+            
+            while(editing)
+            {
+                std::cout << ">";
+                
+                std::string input, part;
+                std::vector<std::string> args;
+                
+                getline(std::cin, input);
+                
+                std::istringstream inp(input);
+                while(getline(inp, part, ' '))
+                    args.push_back(part);
+                
+                if(args.size() > 0)
+                {
+                    if(args[0] == "q")
+                    {
+                        editing = false;
+                    }
+                    else if(args[0] == "w")
+                    {
+                        int x = std::stoi(args[1]), y = std::stoi(args[2]), z = std::stoi(args[3]);
+                        
+                        if(world.stream)
+                            std::cout << "Streamed maps can't be edited\n";
+                        else if(world.inside(x, y, z))
+                        {
+                            saveSnapshotTaken(saver); //a save in progress has to copy the world first
+                            if(journalSetVoxel(journal, world, x, y, z, ColorRGB{(unsigned char)std::stoi(args[4]), (unsigned char)std::stoi(args[5]), (unsigned char)std::stoi(args[6])}))
+                                std::cout << "Voxel written\n";
+                            else
+                                std::cout << "Voxel written, but not to the journal\n";
+                        }
+                        else std::cout << "Voxel is outside the world\n";
+                    }
+                    else if(args[0] == "e" && args.size() >= 8)
+                    {
+                        //exports the box between two corners to a prefab file
+                        Prefab prefab;
+                        if(world.stream)
+                            std::cout << "Streamed maps can't be exported from\n";
+                        else if(!copyPrefab(world, prefab, std::stoi(args[1]), std::stoi(args[2]), std::stoi(args[3]), std::stoi(args[4]), std::stoi(args[5]), std::stoi(args[6])))
+                            std::cout << "Box is outside the world\n";
+                        else if(!savePrefab(prefab, args[7]))
+                            std::cout << "Could not write " << args[7] << "\n";
+                        else
+                            std::cout << "Exported " << prefab.width << "x" << prefab.height << "x" << prefab.depth << " voxels to " << args[7] << "\n";
+                    }
+                    else if(args[0] == "p" && args.size() >= 5)
+                    {
+                        //pastes a prefab file with its first voxel at x y z, clipped to the world
+                        Prefab prefab;
+                        if(world.stream)
+                            std::cout << "Streamed maps can't be edited\n";
+                        else if(!loadPrefab(prefab, args[1]))
+                            std::cout << "Could not read " << args[1] << "\n";
+                        else
+                        {
+                            saveSnapshotTaken(saver);
+                            if(journalPastePrefab(journal, world, prefab, std::stoi(args[2]), std::stoi(args[3]), std::stoi(args[4])))
+                                std::cout << "Prefab pasted\n";
+                            else
+                                std::cout << "Prefab pasted, but not to the journal\n";
+                        }
+                    }
+                    else if(args[0] == "s")
+                    {
+                        //copied and written on another thread, the HUD says when it's done. Saving over the map
+                        //itself compacts the journal, or the saved edits would be replayed on top of it again
+                        if(journalIsMap(journal, args[1]))
+                        {
+                            if(journalCompact(journal, saver, world, saveMap))
+                                std::cout << "Saving to " << args[1] << " in the background\n";
+                            else
+                                std::cout << "Can't save over the map while a save is running\n";
+                        }
+                        else if(saveAsync(saver, world, args[1], saveMap))
+                            std::cout << "Saving to " << args[1] << " in the background\n";
+                        else if(world.stream)
+                            std::cout << "Streamed maps can't be saved\n";
+                        else
+                            std::cout << "Still saving to " << saver.filename << "\n";
+                    }
+                    else if(args[0] == "c")
+                    {
+                        //folds the journal into the map now instead of waiting for it to fill up
+                        if(journalCompact(journal, saver, world, saveMap))
+                            std::cout << "Compacting the journal into " << journal.mapName << "\n";
+                        else if(journal.mapName.empty())
+                            std::cout << "No journal is open\n";
+                        else
+                            std::cout << "Can't compact while a save is running\n";
+                    }
+                }
+            }
+        }
+        
+        profileFrame();
+        
+        //queue the chunks the next frames will need, never waits for the disk
+        if(world.stream)
+        {
+            ProfileScope streamScope(profStream);
+            double seconds = std::max(frameTime, 0.001);
+            streamUpdate(*world.stream, posX, posY, (posX - lastX) / seconds, (posY - lastY) / seconds);
+            lastX = posX;
+            lastY = posY;
+        }
+        
+        journalUpdate(journal, saver, world, saveMap);
+    }
+    
+    if(world.stream) streamClose(streaming, world);
+    
+    if(saveStatus(saver) == SAVE_COPYING || saveStatus(saver) == SAVE_WRITING)
+    {
+        std::cout << "Waiting for " << saver.filename << " to be saved\n";
+        saveWait(saver);
+    }
+    
+    if(journal.compacting) journalUpdate(journal, saver, world, saveMap); //deletes the old journal if the map was written
+    journalClose(journal);
+    
+    if(!profileName.empty())
+    {
+        if(profileDumpCSV(profileName)) std::cout << "Wrote frame profile to " << profileName << "\n";
+        else std::cout << "Could not write frame profile to " << profileName << "\n";
     }
 }
 
+void renderView(const Camera& camera, bool collectStats, int frameNumber)
+{
+    double posX = camera.posX, posY = camera.posY, posZ = camera.posZ;
+    double dirX = camera.dirX, dirY = camera.dirY;
+    double planeX = camera.planeX, planeY = camera.planeY;
+    int pitch = camera.pitch;
+    Framebuffer fb = framebuffer();
+    Uint32 black = fb.pack(RGB_Black);
+    ColumnSpan gaps[windowHeight / 2 + 1]; //rows of a column no stripe covered, at most every other one
+    
+    for(int x = 0; x < w; x++)
+    {
+        profileSampleCounters((x & 15) == (frameNumber & 15)); //hardware counters for every 16th column
+        ProfileScope rayScope(profRaySetup); //everything in the column that isn't a DDA step
+        
+        //calculate ray position and direction
+        double cameraX = 2 * x / double(w) - 1; //x-coordinate in camera space
+        double rayPosX = posX;
+        double rayPosY = posY;
+
+        double rayDirX = dirX + planeX * cameraX;
+        double rayDirY = dirY + planeY * cameraX;
+
+        //which box of the map we're in
+        int mapX = int(rayPosX), tmapX;
+        int mapY = int(rayPosY), tmapY;
+
+        //length of ray from current position to next x or y-side
+        double sideDistX, tsideDistX;
+        double sideDistY, tsideDistY;
+
+        //length of ray from one x or y-side to next x or y-side
+        double deltaDistX = sqrt(1 + (rayDirY * rayDirY) / (rayDirX * rayDirX));
+        double deltaDistY = sqrt(1 + (rayDirX * rayDirX) / (rayDirY * rayDirY));
+        double perpWallDist, tperpWallDist;
+        int lineHeight, tlineHeight;
+        
+        //what direction to step in x or y-direction (either +1 or -1)
+        int stepX;
+        int stepY;
+
+        int hit = 1; //was there a wall hit?
+        int side, tside; //was a NS or a EW wall hit?
+        
+        std::fill_n(depth, windowHeight, 100000); //memset(&depth, 1, sizeof(double)*384);
+        std::fill_n(depthrear, windowHeight, 100000); //memset(&depth, 1, sizeof(double)*384);
+        
+        //std::cout << "Pointer : " << (uint64_t)depth << "\n";
+        
+        int count = 0;
+        int spanIterations = 0, verLineCalls = 0;
+        
+        //calculate step and initial sideDist
+        if (rayDirX < 0)
+        {
+            stepX = -1;
+            sideDistX = (rayPosX - mapX) * deltaDistX;
+        }
+        else
+        {
+            stepX = 1;
+            sideDistX = (mapX + 1.0 - rayPosX) * deltaDistX;
+        }
+        if (rayDirY < 0)
+        {
+            stepY = -1;
+            sideDistY = (rayPosY - mapY) * deltaDistY;
+        }
+        else
+        {
+            stepY = 1;
+            sideDistY = (mapY + 1.0 - rayPosY) * deltaDistY;
+        }
+
+        //First run
+        //jump to next map square, OR in x-direction, OR in y-direction
+        if(sideDistX < sideDistY)
+        {
+            sideDistX += deltaDistX;
+            mapX += stepX;
+            side = 0;
+        }
+        else
+        {
+            sideDistY += deltaDistY;
+            mapY += stepY;
+            side = 1;
+        }
+
+        if(mapX < 0) mapX = 0;
+        if(mapY < 0) mapY = 0;
+
+        if(mapX > world.width-1) mapX = world.width-1;
+        if(mapY > world.height-1) mapY = world.height-1;
+        
+        //Calculate distance projected on camera direction (oblique distance will give fisheye effect!)
+        if (side == 0) perpWallDist = (mapX - rayPosX + (1 - stepX) / 2) / rayDirX;// /2; //why did I have these
+        else           perpWallDist = (mapY - rayPosY + (1 - stepY) / 2) / rayDirY;// /2;
+
+        //Calculate height of line to draw on screen
+        lineHeight = (int)(h / perpWallDist); //This needs to be divided by 2 to make square voxels, but then it crashes. ??? wait nvm
+            
+        //perform DDA
+        while (mapX < 0 || mapY < 0 || (count < windowHeight - 1 && hit < maxDDASteps)) //every row that can be drawn is covered
+        {
+            ProfileScope ddaScope(profDDA);
+            hit += 1;
+            
+            //Calculate next DDA for horizontal fill
+            tmapX = mapX;
+            tmapY = mapY;
+            tside = side;
+            tsideDistX = sideDistX;
+            tsideDistY = sideDistY;
+            
+            //jump to next map square, OR in x-direction, OR in y-direction
+            if(sideDistX < sideDistY)
+            {
+                tsideDistX += deltaDistX;    
+                tmapX += stepX;
+                tside = 0;
+            }
+            else
+            {
+                tsideDistY += deltaDistY;
+                tmapY += stepY;
+                tside = 1;
+            }
+
+            if(tmapX < 0) tmapX = 0;
+            if(tmapY < 0) tmapY = 0;
+
+            if(tmapX > world.width-1) tmapX = world.width-1;
+            if(tmapY > world.height-1) tmapY = world.height-1;
+            
+            //Calculate distance projected on camera direction (oblique distance will give fisheye effect!)
+            if (tside == 0) tperpWallDist = (tmapX - rayPosX + (1 - stepX) / 2) / rayDirX;// /2; //why did I have these
+            else           tperpWallDist = (tmapY - rayPosY + (1 - stepY) / 2) / rayDirY;// /2;
+
+            //Calculate height of line to draw on screen
+            int tlineHeight = (int)(h / tperpWallDist); //This needs to be divided by 2 to make square voxels, but then it crashes. ??? wait nvm
+            
+            ProfileScope spanScope(profSpans);
+            const VoxelCell* column = world.column(mapX, mapY);
+                
+            for(int b=0;b<world.depth;b++)
+            {
+                int ob = b;
+                spanIterations++;
+                
+                //calculate lowest and highest pixel to fill in current stripe
+                int drawStart = ((lineHeight)*(ob-posZ)) + pitch;
+                if(drawStart < 0)drawStart = 0;
+                
+                //a run never reaches past the bottom of the column, not even in a damaged .vxn file
+                b += std::max(1, std::min(int(column[ob].runLength), world.depth - ob)) - 1;
+                
+                int drawEnd = lineHeight + ((lineHeight)*(b-posZ)) + pitch;
+                if(drawEnd >= h)drawEnd = h - 1;
+                
+                //choose wall color
+                Color32 color = column[b].packedColor();
+
+                //give x and y sides different brightness
+                if (side == 1) {color = shade(color, 32768);} //halves every channel
+
+                //draw the pixels of the stripe as a vertical line
+                if(!color.isBlack())
+                {
+                    ProfileScope lineScope(profVerLine);
+                    verLineTriDepth(fb, x, drawStart, drawEnd, fb.pack(color), depth, windowHeight, &count, 0, depthrear);
+                    verLineCalls++;
+                    if(collectStats) countStripe(x, drawStart, drawEnd);
+                }
+                     
+                //calculate lowest and highest pixel to fill in current stripe
+                int tdrawStart = ((tlineHeight)*(ob-posZ)) + pitch;
+                if(tdrawStart < 0)tdrawStart = 0;
+                int tdrawEnd = tlineHeight + ((tlineHeight)*(b-posZ)) + pitch;
+                if(tdrawEnd >= h)tdrawEnd = h - 1;
+                
+                //choose wall color
+                Color32 tcolor = column[b].packedColor();
+
+                //give x and y sides different brightness
+                {tcolor = shade(tcolor, 21846);} //a third of every channel, exactly
+
+                //draw the pixels of the stripe as a vertical line
+                if(!tcolor.isBlack())
+                {
+                    ProfileScope lineScope(profVerLine);
+                    verLineTriDepth(fb, x, (b<posZ)?drawStart:tdrawStart, (b<posZ)?tdrawEnd:drawEnd, fb.pack(tcolor), depth, windowHeight, &count, 1, depthrear);
+                    verLineCalls++;
+                    if(collectStats) countStripe(x, (b<posZ)?drawStart:tdrawStart, (b<posZ)?tdrawEnd:drawEnd);
+                }
+            }
+            
+            //pixels filled during this step (verLineTriDepth draws depth row y on screen row y+1)
+            if(collectStats)
+            {
+                for(int y = 0; y < windowHeight - 1; y++)
+                    if(depthrear[y] == 0 && pixelStep[(y+1)*windowWidth + x] == 0) pixelStep[(y+1)*windowWidth + x] = hit - 1;
+            }
+            
+            memcpy(depth, depthrear, windowHeight * sizeof(int));
+            lineHeight = tlineHeight;
+            perpWallDist = tperpWallDist;
+            sideDistX = tsideDistX;
+            sideDistY = tsideDistY;
+            side = tside;
+            mapX = tmapX;
+            mapY = tmapY;
+        }
+        
+        //the rows no stripe covered are cleared here instead of clearing the whole screen before every frame
+        //(depth row y is screen row y+1, so screen row 0 is always cleared)
+        int numGaps = 0;
+        for(int y = -1; y < windowHeight - 1;)
+        {
+            if(y >= 0 && depthrear[y] == 0)
+            {
+                y++;
+                continue;
+            }
+            
+            int start = y;
+            while(y < windowHeight - 1 && (y < 0 || depthrear[y] != 0)) y++;
+            gaps[numGaps++] = ColumnSpan{start + 1, y, black};
+        }
+        fb.verSpans(x, gaps, numGaps);
+        
+        columnStats[x] = ColumnStats{hit - 1, spanIterations, verLineCalls, mapX, mapY, hit >= maxDDASteps};
+    }
+}
+
+//maps a .vxn map, loads a .vxc map of any size, imports a Voxlap .vxl map, or loads a headerless dump of
+//mapWidth*mapHeight*mapDepth RGB voxels, returns false if the file is corrupt or too small
+bool loadMap(const std::string& filename)
+{
+    if(filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".vxl") == 0)
+        return loadVXL(world, filename);
+    
+    if(isNativeMap(filename))
+        return mapWorld(world, filename);
+    
+    if(isChunkedMap(filename))
+        return loadChunked(world, filename);
+    
+    return loadVX5(world, filename, mapWidth, mapHeight, mapDepth);
+}
+
+//.vxc files are written in the chunked format, .vxn files in the native one, everything else as a headerless dump
+bool saveMap(const World& map, const std::string& filename)
+{
+    if(map.stream)
+        return false; //only part of it is in memory
+    
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+    
+    if(extension == "vxc")
+        return saveChunked(map, filename);
+    
+    if(extension == "vxn")
+        return saveNative(map, filename);
+    
+    return saveVX5(map, filename);
+}
+
+//the camera can move into a cell if it's inside the world and empty at the height the collision checks use
+bool walkable(double x, double y)
+{
+    int z = std::min(10, world.depth - 1);
+    return world.inside(int(x), int(y), z) && world.at(int(x), int(y), z).empty();
+}
+
 void defaultMap()
 {
     // Default map. Grey walls, green ceiling and floor, and some weird statues.
+    freeWorld(world);
+    createWorld(world, mapWidth, mapHeight, mapDepth);
+    
     for(int i=0;i<mapHeight;i++)
     {
         for(int j=0;j<mapWidth;j++)
         {
             if(j==0||j==mapWidth-1||i==0||i==mapHeight-1)
             {
-                worldMap[j][i][0] = {RGB_Green, 1};
+                world.at(j, i, 0).setColor(RGB_Green);
                 
                 for(int r=0;r<mapDepth-2;r++)
-                    worldMap[j][i][r+1] = {RGB_Grey, 1};
+                    world.at(j, i, r+1).setColor(RGB_Grey);
                     
-                worldMap[j][i][11] = {RGB_Green, 1};
+                world.at(j, i, 11).setColor(RGB_Green);
             }
             else
             {
-                worldMap[j][i][0] = {RGB_Green, 1};
+                world.at(j, i, 0).setColor(RGB_Green);
                 
                 for(int r=0;r<mapDepth-2;r++)
-                    worldMap[j][i][r+1] = {RGB_Black, 1};
+                    world.at(j, i, r+1).setColor(RGB_Black);
                     
-                worldMap[j][i][11] = {RGB_Green, 1};
+                world.at(j, i, 11).setColor(RGB_Green);
             }
         }
     }
 
-    worldMap[60][60][4] = {RGB_Blue, 1};
-    worldMap[60][60][5] = {RGB_White, 2};
-    worldMap[60][60][6] = {RGB_White, 1};
-    worldMap[60][60][7] = {RGB_Blue, 1};
-    worldMap[60][61][5] = {RGB_White, 2};
-    worldMap[60][61][6] = {RGB_White, 1};
-    worldMap[61][60][4] = {RGB_Blue, 1};
-    worldMap[61][60][7] = {RGB_Blue, 1};
-    worldMap[62][60][4] = {RGB_Blue, 1};
-    worldMap[62][60][7] = {RGB_Blue, 1};
-    worldMap[63][60][4] = {RGB_Blue, 1};
-    worldMap[63][60][7] = {RGB_Blue, 1};
-    worldMap[63][66][3] = {RGB_Red, 1};
-    worldMap[63][66][5] = {RGB_White, 1};
-    worldMap[63][66][7] = {RGB_Blue, 1};
+    world.at(60, 60, 4).setColor(RGB_Blue);
+    world.at(60, 60, 5).setColor(RGB_White);
+    world.at(60, 60, 6).setColor(RGB_White);
+    world.at(60, 60, 7).setColor(RGB_Blue);
+    world.at(60, 61, 5).setColor(RGB_White);
+    world.at(60, 61, 6).setColor(RGB_White);
+    world.at(61, 60, 4).setColor(RGB_Blue);
+    world.at(61, 60, 7).setColor(RGB_Blue);
+    world.at(62, 60, 4).setColor(RGB_Blue);
+    world.at(62, 60, 7).setColor(RGB_Blue);
+    world.at(63, 60, 4).setColor(RGB_Blue);
+    world.at(63, 60, 7).setColor(RGB_Blue);
+    world.at(63, 66, 3).setColor(RGB_Red);
+    world.at(63, 66, 5).setColor(RGB_White);
+    world.at(63, 66, 7).setColor(RGB_Blue);
+    
+    encodeWorld(world);
+}
+
+//counts the pixels verLineTriDepth tests for this stripe, with the same clipping and row offset
+void countStripe(int x, int y1, int y2)
+{
+    if(y2 < y1) std::swap(y1, y2);
+    if(y2 < 0 || y1 >= h || x < 0 || x >= w) return;
+    if(y1 < 0) y1 = 0;
+    if(y2 >= h) y2 = h - 1;
+    
+    for(int y = y1; y <= y2 && y < windowHeight - 1; y++)
+        pixelCalls[(y+1)*windowWidth + x]++;
 }
 
-void encodeMap()
+//false color from blue (low) to red (high), black for 0
+ColorRGB heatColor(int value, int maximum)
 {
-    for(int i=0;i<mapHeight;i++)
+    if(value <= 0 || maximum <= 0) return RGB_Black;
+    double t = std::min(1.0, double(value) / maximum);
+    return HSVtoRGB(ColorHSV(int(170 * (1.0 - t)), 255, 255));
+}
+
+void drawHeatmap(int mode)
+{
+    int maximum = 0, capped = 0;
+    
+    for(int x = 0; x < windowWidth; x++)
     {
-        for(int j=0;j<mapWidth;j++)
+        const ColumnStats& stats = columnStats[x];
+        if(mode == 1) maximum = std::max(maximum, stats.ddaSteps);
+        if(mode == 2) maximum = std::max(maximum, stats.spanIterations);
+        if(mode == 3) maximum = std::max(maximum, stats.verLineCalls);
+        if(stats.capped) capped++;
+    }
+    
+    if(mode >= 4)
+    {
+        const int* values = (mode == 4) ? pixelStep : pixelCalls;
+        maximum = *std::max_element(values, values + windowWidth*windowHeight);
+        
+        for(int y = 0; y < windowHeight; y++)
+            for(int x = 0; x < windowWidth; x++)
+                pset(x, y, heatColor(values[y*windowWidth + x], maximum));
+    }
+    else
+    {
+        for(int x = 0; x < windowWidth; x++)
         {
-            for(int b=0;b<mapDepth;b++)
+            const ColumnStats& stats = columnStats[x];
+            int value = (mode == 1) ? stats.ddaSteps : (mode == 2) ? stats.spanIterations : stats.verLineCalls;
+            verLine(x, 0, windowHeight - 1, heatColor(value, maximum));
+        }
+    }
+    
+    //columns that ran into the DDA step limit get a white bar at the bottom
+    for(int x = 0; x < windowWidth; x++)
+        if(columnStats[x].capped) verLine(x, windowHeight - 4, windowHeight - 1, RGB_White);
+    
+    print(TextLine().add(heatmapNames[mode]).add(", max ").add(maximum).add(", ").add(capped).add(" capped"), 0, windowHeight - 16, RGB_White, 1);
+}
+
+//writes the statistics of the last frame as <prefix>_columns.csv and <prefix>_pixels.csv
+bool writeRayStats(const std::string& prefix)
+{
+    std::ofstream columns((prefix + "_columns.csv").c_str());
+    columns << "x,dda_steps,span_iterations,verline_calls,end_x,end_y,capped\n";
+    
+    for(int x = 0; x < windowWidth; x++)
+    {
+        const ColumnStats& stats = columnStats[x];
+        columns << x << "," << stats.ddaSteps << "," << stats.spanIterations << "," << stats.verLineCalls << ","
+                << stats.endX << "," << stats.endY << "," << (stats.capped ? 1 : 0) << "\n";
+    }
+    
+    std::ofstream pixels((prefix + "_pixels.csv").c_str());
+    pixels << "x,y,fill_step,verline_calls\n";
+    
+    for(int y = 0; y < windowHeight; y++)
+        for(int x = 0; x < windowWidth; x++)
+            pixels << x << "," << y << "," << pixelStep[y*windowWidth + x] << "," << pixelCalls[y*windowWidth + x] << "\n";
+    
+    return columns.good() && pixels.good();
+}
+
+//camera looking along angle (radians), with the same field of view as the default camera
+Camera makeCamera(double x, double y, double z, double angle, int pitch)
+{
+    double dirX = cos(angle), dirY = sin(angle);
+    return Camera{x, y, z, dirX, dirY, dirY * 0.66, -dirX * 0.66, pitch};
+}
+
+bool writePPM(const std::string& filename, const std::vector<Uint32>& pixels, int width, int height)
+{
+    std::ofstream file(filename.c_str(), std::ios::out|std::ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    
+    for(int i = 0; i < width*height; i++)
+    {
+        unsigned char rgb[3] = {(unsigned char)(pixels[i] >> 16), (unsigned char)(pixels[i] >> 8), (unsigned char)pixels[i]};
+        file.write((char*)rgb, 3);
+    }
+    
+    return file.good();
+}
+
+bool readPPM(const std::string& filename, std::vector<Uint32>& pixels, int width, int height)
+{
+    std::ifstream file(filename.c_str(), std::ios::in|std::ios::binary);
+    std::string magic;
+    int fileWidth = 0, fileHeight = 0, maxValue = 0;
+    file >> magic >> fileWidth >> fileHeight >> maxValue;
+    file.get(); //single whitespace before the pixels
+    
+    if(!file || magic != "P6" || fileWidth != width || fileHeight != height || maxValue != 255)
+        return false;
+    
+    std::vector<unsigned char> rgb(width*height*3);
+    file.read((char*)&rgb[0], rgb.size());
+    pixels.resize(width*height);
+    
+    for(int i = 0; i < width*height; i++)
+        pixels[i] = (rgb[i*3] << 16) | (rgb[i*3+1] << 8) | rgb[i*3+2];
+    
+    return bool(file);
+}
+
+/*
+Golden-image regression run: renders a fixed set of camera poses over the default map and
+over a generated world with a fixed seed, without opening a window. With record, the images are written to directory
+as references; otherwise each image is compared against its reference, allowing every channel
+to differ by at most tolerance, and a _diff.ppm is written next to every reference that fails.
+Render times go to timings.csv in the same directory. Returns the exit code for main.
+*/
+int runGolden(const std::string& directory, bool record, int tolerance)
+{
+    const Camera defaultPoses[] =
+    {
+        makeCamera(40, 40, mapDepth/2, M_PI, 200), //the start position
+        makeCamera(50.5, 61.5, 6, 0, 200), //facing the statues
+        makeCamera(30.2, 30.7, 2.5, M_PI/4, 260), //high up, diagonal
+        makeCamera(58.3, 64.1, 9.5, 0.9, 120), //low and close to the statues
+        makeCamera(2.5, 3.5, 6, 1.2, 200) //in a corner, along a wall
+    };
+    const char* scenes[] = {"default", "generated"};
+    const int runs = 5; //the fastest run counts
+    
+    mkdir(directory.c_str(), 0755);
+    screenHeadless(windowWidth, windowHeight);
+    
+    std::ofstream timings((directory + "/timings.csv").c_str());
+    timings << "map,pose,ms\n";
+    
+    int failures = 0, compared = 0;
+    
+    for(const char* scene : scenes)
+    {
+        std::string label = scene;
+        std::vector<Camera> poses;
+        
+        if(label == "default")
+        {
+            defaultMap();
+            poses.assign(defaultPoses, defaultPoses + sizeof(defaultPoses) / sizeof(defaultPoses[0]));
+        }
+        else
+        {
+            //terrain, caves and buildings, which the default map doesn't have; the seed keeps it the same every run
+            GeneratorSettings settings = defaultGeneratorSettings();
+            settings.seed = 29;
+            freeWorld(world);
+            createWorld(world, 256, 256, 64);
+            generateWorld(world, settings);
+            
+            //a few voxels above the ground, like main starts in a world that isn't the default size
+            auto above = [](double x, double y) { return std::max(0, surfaceHeight(world, int(x), int(y)) - 4); };
+            poses.push_back(makeCamera(128.5, 128.5, above(128.5, 128.5), 0, 200)); //the middle
+            poses.push_back(makeCamera(40.5, 200.5, above(40.5, 200.5), 2.1, 260)); //tilted up
+            poses.push_back(makeCamera(220.5, 60.5, above(220.5, 60.5), M_PI, 140)); //tilted down
+            poses.push_back(makeCamera(100.5, 30.5, 2, M_PI/3, 200)); //high above the terrain
+        }
+        
+        for(int pose = 0; pose < int(poses.size()); pose++)
+        {
+            Uint64 fastest = ~Uint64(0);
+            
+            for(int run = 0; run < runs; run++)
+            {
+                Uint64 start = getNanoseconds(); //renderView clears what it doesn't draw, so the previous pose can't show through
+                renderView(poses[pose], false, 0);
+                fastest = std::min(fastest, getNanoseconds() - start);
+            }
+            
+            timings << label << "," << pose << "," << fastest / 1000000.0 << "\n";
+            
+            std::vector<Uint32> image, reference;
+            getScreenBuffer(image);
+            std::string name = directory + "/" + label + "_" + std::to_string(pose);
+            
+            if(record)
             {
-                ColorRGB cache = worldMap[i][j][b].color;
-                worldMap[i][j][b].runLength = 0;
-                int nb = b;
+                if(!writePPM(name + ".ppm", image, windowWidth, windowHeight))
+                {
+                    std::cout << "Could not write " << name << ".ppm\n";
+                    failures++;
+                }
+                continue;
+            }
+            
+            compared++;
+            
+            if(!readPPM(name + ".ppm", reference, windowWidth, windowHeight))
+            {
+                std::cout << "FAIL " << name << ": no reference image\n";
+                failures++;
+                continue;
+            }
+            
+            //differing pixels are white in the diff image
+            int differing = 0, worst = 0;
+            std::vector<Uint32> diff(image.size(), 0);
+            
+            for(size_t i = 0; i < image.size(); i++)
+            {
+                int delta = 0;
+                for(int shift = 0; shift < 24; shift += 8)
+                    delta = std::max(delta, std::abs(int((image[i] >> shift) & 255) - int((reference[i] >> shift) & 255)));
                 
-                while(worldMap[i][j][nb].color == cache && nb < mapDepth)
+                worst = std::max(worst, delta);
+                if(delta > tolerance)
                 {
-                    nb++;
-                    worldMap[i][j][b].runLength++;
+                    differing++;
+                    diff[i] = 0xFFFFFF;
                 }
             }
+            
+            if(differing)
+            {
+                std::cout << "FAIL " << name << ": " << differing << " pixels differ, by up to " << worst << "\n";
+                writePPM(name + "_diff.ppm", diff, windowWidth, windowHeight);
+                failures++;
+            }
+            else std::cout << "ok   " << name << " (" << fastest / 1000000.0 << " ms)\n";
         }
     }
-}
     
+    if(record) std::cout << "Recorded reference images in " << directory << "\n";
+    else std::cout << (compared - failures) << " of " << compared << " images match\n";
+    
+    return failures ? 1 : 0;
+}
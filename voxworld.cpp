@@ -0,0 +1,1875 @@
+/*
+
+VoxWorld - voxel world storage, loading and generation for the voxel renderers
+Written by John Lemme, see voxworld.h for the layout.
+
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include "voxworld.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VOXWORLD_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace QuickCG;
+
+bool createWorld(World& world, int width, int height, int depth)
+{
+    world.width = world.height = world.depth = 0;
+    world.cells = 0;
+    world.mapping = 0;
+    world.mappingSize = 0;
+    world.mappingWritable = false;
+    world.stream = 0;
+
+    if(width <= 0 || height <= 0 || depth <= 0)
+        return false;
+
+    //no constructor on VoxelCell, so the cells stay untouched until something fills them
+    world.cells = new(std::nothrow) VoxelCell[size_t(width) * height * depth];
+    if(!world.cells)
+        return false;
+
+    world.width = width;
+    world.height = height;
+    world.depth = depth;
+    return true;
+}
+
+void freeWorld(World& world)
+{
+#ifdef VOXWORLD_POSIX
+    if(world.mapping)
+        munmap(world.mapping, world.mappingSize);
+    else
+#endif
+    delete[] world.cells;
+
+    world.cells = 0;
+    world.mapping = 0;
+    world.mappingSize = 0;
+    world.mappingWritable = false;
+    world.stream = 0;
+    world.width = world.height = world.depth = 0;
+}
+
+void clearWorld(World& world)
+{
+    parallelFor(0, world.width, [&](int x)
+    {
+        VoxelCell* cells = world.column(x, 0);
+        size_t count = size_t(world.height) * world.depth;
+        for(size_t i = 0; i < count; i++)
+            cells[i] = VoxelCell{0, 0, 0, 1};
+        for(int y = 0; y < world.height; y++)
+            encodeColumn(world.column(x, y), world.depth);
+    });
+}
+
+void encodeColumn(VoxelCell* column, int depth)
+{
+    int run = 0;
+
+    //walk up from the bottom, so every run length is the one below it plus one
+    for(int z = depth - 1; z >= 0; z--)
+    {
+        //column[z + 1] only exists above the bottom voxel
+        bool same = z + 1 < depth && column[z].r == column[z + 1].r && column[z].g == column[z + 1].g && column[z].b == column[z + 1].b;
+
+        if(!same)
+            run = 1;
+        else if(run < 255)
+            run++;
+
+        column[z].runLength = run;
+    }
+}
+
+void encodeWorld(World& world)
+{
+    parallelFor(0, world.width, [&](int x)
+    {
+        for(int y = 0; y < world.height; y++)
+            encodeColumn(world.column(x, y), world.depth);
+    });
+}
+
+int surfaceHeight(const World& world, int x, int y)
+{
+    const VoxelCell* column = world.column(x, y);
+    int z = 0;
+
+    while(z < world.depth && column[z].empty())
+        z++;
+
+    return z;
+}
+
+ColorRGB solidColor(int r, int g, int b)
+{
+    r = std::max(0, std::min(255, r));
+    g = std::max(0, std::min(255, g));
+    b = std::max(0, std::min(255, b));
+
+    if(r == 0 && g == 0 && b == 0)
+        b = 1;
+
+    return ColorRGB(r, g, b);
+}
+
+void parallelFor(int begin, int end, const std::function<void(int)>& body)
+{
+    int threads = std::max(1, int(std::thread::hardware_concurrency()));
+    threads = std::min(threads, end - begin);
+
+    if(threads <= 1)
+    {
+        for(int i = begin; i < end; i++)
+            body(i);
+        return;
+    }
+
+    //hand out one index at a time, so a thread that got cheap indices just takes more of them
+    std::atomic<int> next(begin);
+    auto worker = [&]()
+    {
+        for(int i = next++; i < end; i = next++)
+            body(i);
+    };
+
+    std::vector<std::thread> pool;
+    for(int t = 1; t < threads; t++)
+        pool.emplace_back(worker);
+
+    worker();
+
+    for(std::thread& thread : pool)
+        thread.join();
+}
+
+bool loadVX5(World& world, const std::string& filename, int width, int height, int depth)
+{
+    std::vector<unsigned char> mapFile;
+    loadFile(mapFile, filename);
+
+    if(mapFile.size() < size_t(width) * height * depth * 3)
+        return false;
+
+    freeWorld(world);
+    if(!createWorld(world, width, height, depth))
+        return false;
+
+    size_t count = world.columns() * depth;
+    for(size_t i = 0; i < count; i++)
+        world.cells[i] = VoxelCell{mapFile[i*3], mapFile[i*3+1], mapFile[i*3+2], 1};
+
+    encodeWorld(world);
+    return true;
+}
+
+bool saveVX5(const World& world, const std::string& filename)
+{
+    std::ofstream file(filename.c_str(), std::ios::out|std::ios::binary);
+    std::vector<unsigned char> wdata(size_t(world.height) * world.depth * 3);
+
+    //one x slice at a time, so the buffer stays small
+    for(int x = 0; x < world.width && file.good(); x++)
+    {
+        const VoxelCell* cells = world.column(x, 0);
+
+        for(size_t i = 0; i < wdata.size() / 3; i++)
+        {
+            wdata[i*3] = cells[i].r;
+            wdata[i*3+1] = cells[i].g;
+            wdata[i*3+2] = cells[i].b;
+        }
+
+        file.write((char*)&wdata[0], std::streamsize(wdata.size()));
+    }
+
+    return file.good();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//BACKGROUND SAVING/////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+bool syncFile(const std::string& filename)
+{
+#ifdef VOXWORLD_POSIX
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#else
+    return true;
+#endif
+}
+
+bool syncDirectory(const std::string& filename)
+{
+#ifdef VOXWORLD_POSIX
+    size_t slash = filename.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : filename.substr(0, slash);
+    int fd = open(directory.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#else
+    return true;
+#endif
+}
+
+static void saveThread(WorldSaver* saver, const World* world, SaveFunction save)
+{
+    auto start = std::chrono::steady_clock::now();
+    bool ok = createWorld(saver->snapshot, world->width, world->height, world->depth);
+
+    if(ok)
+    {
+        size_t slice = size_t(world->height) * world->depth * sizeof(VoxelCell);
+        parallelFor(0, world->width, [&](int x) { memcpy(saver->snapshot.column(x, 0), world->column(x, 0), slice); });
+    }
+
+    saver->state = SAVE_WRITING;
+
+    //the new file only replaces the old one once it's safely on disk; the temporary keeps the extension, which
+    //is how the save functions pick a format
+    std::string temporary = saver->filename;
+    size_t dot = temporary.find_last_of('.'), slash = temporary.find_last_of("/\\");
+    if(dot != std::string::npos && (slash == std::string::npos || dot > slash)) temporary.insert(dot, ".tmp");
+    else temporary += ".tmp";
+    ok = ok && save(saver->snapshot, temporary) && syncFile(temporary) && std::rename(temporary.c_str(), saver->filename.c_str()) == 0;
+    if(!ok)
+        std::remove(temporary.c_str());
+    else
+        ok = syncDirectory(saver->filename); //the rename itself only survives a crash once the directory is synced
+
+    freeWorld(saver->snapshot);
+    saver->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    saver->state = ok ? SAVE_DONE : SAVE_FAILED;
+}
+
+bool saveAsync(WorldSaver& saver, const World& world, const std::string& filename, const SaveFunction& save)
+{
+    int state = saveStatus(saver);
+    if(state == SAVE_COPYING || state == SAVE_WRITING || world.stream)
+        return false;
+
+    saver.filename = filename;
+    saver.state = SAVE_COPYING;
+    saver.thread = std::thread(saveThread, &saver, &world, save);
+    return true;
+}
+
+void saveSnapshotTaken(WorldSaver& saver)
+{
+    while(saver.state == SAVE_COPYING)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+int saveStatus(WorldSaver& saver)
+{
+    int state = saver.state;
+    if((state == SAVE_DONE || state == SAVE_FAILED) && saver.thread.joinable())
+        saver.thread.join();
+    return state;
+}
+
+void saveWait(WorldSaver& saver)
+{
+    if(saver.thread.joinable())
+        saver.thread.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//CHUNKED MAP FILES/////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static void putU32(unsigned char* p, Uint32 v)
+{
+    for(int i = 0; i < 4; i++) p[i] = (v >> (i * 8)) & 255;
+}
+
+static void putU64(unsigned char* p, Uint64 v)
+{
+    for(int i = 0; i < 8; i++) p[i] = (v >> (i * 8)) & 255;
+}
+
+static Uint32 getU32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (Uint32(p[3]) << 24);
+}
+
+static Uint64 getU64(const unsigned char* p)
+{
+    return getU32(p) | (Uint64(getU32(p + 4)) << 32);
+}
+
+//appends the runs of one column
+static void encodeRuns(const VoxelCell* column, int depth, std::vector<unsigned char>& out)
+{
+    int z = 0;
+
+    while(z < depth)
+    {
+        int length = 1;
+        while(z + length < depth && column[z + length].r == column[z].r && column[z + length].g == column[z].g && column[z + length].b == column[z].b)
+            length++;
+
+        for(Uint32 v = length; ; v >>= 7)
+        {
+            if(v < 128) { out.push_back(v); break; }
+            out.push_back((v & 127) | 128);
+        }
+
+        out.push_back(column[z].r);
+        out.push_back(column[z].g);
+        out.push_back(column[z].b);
+        z += length;
+    }
+}
+
+//decodes the runs of one column and fills in the run lengths, returns the position after them or 0 if they're corrupt
+static const unsigned char* decodeRuns(const unsigned char* p, const unsigned char* end, VoxelCell* column, int depth)
+{
+    int z = 0;
+
+    while(z < depth)
+    {
+        Uint32 length = 0;
+        for(int shift = 0; ; shift += 7)
+        {
+            if(p >= end || shift > 28) return 0;
+            length |= Uint32(*p & 127) << shift;
+            if(!(*p++ & 128)) break;
+        }
+
+        if(length == 0 || length > Uint32(depth - z) || end - p < 3) return 0;
+
+        for(Uint32 i = 0; i < length; i++)
+            column[z + i] = VoxelCell{p[0], p[1], p[2], Uint8(std::min<Uint32>(length - i, 255))};
+
+        p += 3;
+        z += length;
+    }
+
+    return p;
+}
+
+void compressLZ(const unsigned char* data, size_t size, std::vector<unsigned char>& out)
+{
+    const int hashBits = 14;
+    std::vector<int> table(1 << hashBits, -1);
+    size_t anchor = 0, i = 0;
+
+    auto read32 = [&](size_t at) { Uint32 v; memcpy(&v, data + at, 4); return v; };
+    auto putLength = [&](size_t length)
+    {
+        while(length >= 255) { out.push_back(255); length -= 255; }
+        out.push_back(length);
+    };
+
+    //a match needs 4 bytes, and the last 5 bytes are always literals so the decoder's end test stays simple
+    while(size >= 12 && i + 5 + 4 <= size)
+    {
+        Uint32 h = (read32(i) * 2654435761u) >> (32 - hashBits);
+        int candidate = table[h];
+        table[h] = int(i);
+
+        if(candidate < 0 || i - candidate > 65535 || read32(candidate) != read32(i))
+        {
+            i += 1 + ((i - anchor) >> 6); //skip faster through data that doesn't compress
+            continue;
+        }
+
+        size_t match = 4;
+        while(i + match + 5 < size && data[candidate + match] == data[i + match])
+            match++;
+
+        size_t literals = i - anchor;
+        out.push_back((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(match - 4, 15));
+        if(literals >= 15) putLength(literals - 15);
+        out.insert(out.end(), data + anchor, data + i);
+        out.push_back((i - candidate) & 255);
+        out.push_back((i - candidate) >> 8);
+        if(match - 4 >= 15) putLength(match - 4 - 15);
+
+        i += match;
+        anchor = i;
+    }
+
+    //the last sequence is only literals
+    size_t literals = size - anchor;
+    out.push_back(std::min<size_t>(literals, 15) << 4);
+    if(literals >= 15) putLength(literals - 15);
+    out.insert(out.end(), data + anchor, data + size);
+}
+
+bool decompressLZ(const unsigned char* data, size_t size, unsigned char* out, size_t rawSize)
+{
+    const unsigned char* p = data;
+    const unsigned char* end = data + size;
+    size_t o = 0;
+
+    auto getLength = [&](size_t& length)
+    {
+        unsigned char byte = 255;
+        while(byte == 255)
+        {
+            if(p >= end) return false;
+            byte = *p++;
+            length += byte;
+        }
+        return true;
+    };
+
+    while(p < end)
+    {
+        unsigned char token = *p++;
+        size_t literals = token >> 4;
+        if(literals == 15 && !getLength(literals)) return false;
+        if(size_t(end - p) < literals || rawSize - o < literals) return false;
+
+        memcpy(out + o, p, literals);
+        p += literals;
+        o += literals;
+
+        if(p == end) break;
+
+        if(end - p < 2) return false;
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+
+        size_t match = token & 15;
+        if(match == 15 && !getLength(match)) return false;
+        match += 4;
+
+        if(offset == 0 || offset > o || rawSize - o < match) return false;
+
+        //byte by byte, the match can overlap what it's copying
+        const unsigned char* from = out + o - offset;
+        for(size_t i = 0; i < match; i++)
+            out[o + i] = from[i];
+        o += match;
+    }
+
+    return o == rawSize;
+}
+
+bool isChunkedMap(const std::string& filename)
+{
+    char magic[4] = {0};
+    std::ifstream file(filename.c_str(), std::ios::in|std::ios::binary);
+    file.read(magic, 4);
+    return file.good() && memcmp(magic, "VOXC", 4) == 0;
+}
+
+bool openChunked(ChunkedMap& map, const std::string& filename)
+{
+    unsigned char header[chunkedHeaderSize];
+
+    map.file.close();
+    map.file.clear();
+    map.file.open(filename.c_str(), std::ios::in|std::ios::binary);
+    map.file.read((char*)header, chunkedHeaderSize);
+
+    if(!map.file.good() || memcmp(header, "VOXC", 4) != 0 || getU32(header + 4) > chunkedVersion)
+        return false;
+
+    map.width = getU32(header + 8);
+    map.height = getU32(header + 12);
+    map.depth = getU32(header + 16);
+    map.chunkSize = getU32(header + 20);
+    map.chunksX = getU32(header + 24);
+    map.chunksY = getU32(header + 28);
+
+    if(map.width <= 0 || map.height <= 0 || map.depth <= 0 || map.chunkSize <= 0
+       || map.chunksX != (Sint64(map.width) + map.chunkSize - 1) / map.chunkSize
+       || map.chunksY != (Sint64(map.height) + map.chunkSize - 1) / map.chunkSize)
+        return false;
+
+    //a damaged header could ask for a huge index or one past the end, check both before allocating
+    map.file.seekg(0, std::ios::end);
+    Uint64 fileSize = Uint64(std::streamoff(map.file.tellg()));
+    size_t chunks = size_t(map.chunksX) * map.chunksY;
+    Uint64 indexOffset = getU64(header + 32);
+    if(!map.file.good() || chunks > fileSize / chunkedIndexEntrySize
+       || indexOffset > fileSize - chunks * chunkedIndexEntrySize)
+        return false;
+
+    std::vector<unsigned char> index(chunks * chunkedIndexEntrySize);
+    map.file.seekg(std::streamoff(indexOffset));
+    map.file.read((char*)&index[0], std::streamsize(index.size()));
+
+    if(!map.file.good())
+        return false;
+
+    map.index.resize(chunks);
+    for(size_t i = 0; i < chunks; i++)
+    {
+        const unsigned char* entry = &index[i * chunkedIndexEntrySize];
+        map.index[i] = ChunkEntry{getU64(entry), getU32(entry + 8), getU32(entry + 12), getU32(entry + 16)};
+    }
+
+    return true;
+}
+
+//decodes a chunk that has already been read from the file, column(x, y) says where each column goes
+static bool decodeChunk(const ChunkedMap& map, int cx, int cy, const unsigned char* data, const ChunkEntry& entry,
+                        const std::function<VoxelCell*(int, int)>& column)
+{
+    std::vector<unsigned char> raw;
+    const unsigned char* runs = data;
+
+    //every voxel a run of its own is the worst case
+    if(entry.rawSize > Uint64(map.chunkSize) * map.chunkSize * map.depth * 4)
+        return false;
+
+    if(entry.codec == 1)
+    {
+        raw.resize(entry.rawSize);
+        if(!decompressLZ(data, entry.size, raw.data(), raw.size()))
+            return false;
+        runs = raw.data();
+    }
+    else if(entry.codec != 0 || entry.size != entry.rawSize)
+        return false;
+
+    const unsigned char* end = runs + entry.rawSize;
+    int x1 = std::min(map.width, (cx + 1) * map.chunkSize), y1 = std::min(map.height, (cy + 1) * map.chunkSize);
+
+    for(int x = cx * map.chunkSize; x < x1; x++)
+    {
+        for(int y = cy * map.chunkSize; y < y1; y++)
+        {
+            runs = decodeRuns(runs, end, column(x, y), map.depth);
+            if(!runs) return false;
+        }
+    }
+
+    return runs == end;
+}
+
+bool readChunk(ChunkedMap& map, int cx, int cy, VoxelCell* cells)
+{
+    if(cx < 0 || cy < 0 || cx >= map.chunksX || cy >= map.chunksY)
+        return false;
+
+    const ChunkEntry& entry = map.index[size_t(cx) * map.chunksY + cy];
+    std::vector<unsigned char> data(entry.size);
+    map.file.clear();
+    map.file.seekg(std::streamoff(entry.offset));
+    map.file.read((char*)data.data(), std::streamsize(data.size()));
+
+    if(!map.file.good())
+        return false;
+
+    std::fill_n(cells, size_t(map.chunkSize) * map.chunkSize * map.depth, VoxelCell{0, 0, 0, 1});
+    encodeColumn(&cells[0], map.depth);
+    for(size_t column = 1; column < size_t(map.chunkSize) * map.chunkSize; column++)
+        memcpy(&cells[column * map.depth], &cells[0], map.depth * sizeof(VoxelCell));
+
+    return decodeChunk(map, cx, cy, data.data(), entry, [&](int x, int y)
+    {
+        return &cells[(size_t(x - cx * map.chunkSize) * map.chunkSize + (y - cy * map.chunkSize)) * map.depth];
+    });
+}
+
+bool loadChunked(World& world, const std::string& filename, int x0, int y0, int width, int height)
+{
+    ChunkedMap map;
+    if(!openChunked(map, filename))
+        return false;
+
+    if(width <= 0) width = map.width - x0;
+    if(height <= 0) height = map.height - y0;
+    if(x0 < 0 || y0 < 0 || width <= 0 || height <= 0 || x0 + width > map.width || y0 + height > map.height)
+        return false;
+
+    int cx0 = x0 / map.chunkSize, cy0 = y0 / map.chunkSize;
+    int cx1 = (x0 + width - 1) / map.chunkSize, cy1 = (y0 + height - 1) / map.chunkSize;
+
+    freeWorld(world);
+    if(!createWorld(world, width, height, map.depth))
+        return false;
+
+    //read a row of chunks in file order, then decode it on all cores, so only one row of compressed data is held
+    std::vector<std::vector<unsigned char>> rowData(cy1 - cy0 + 1);
+    bool ok = true;
+
+    for(int cx = cx0; cx <= cx1 && ok; cx++)
+    {
+        for(int cy = cy0; cy <= cy1 && ok; cy++)
+        {
+            const ChunkEntry& entry = map.index[size_t(cx) * map.chunksY + cy];
+            std::vector<unsigned char>& data = rowData[cy - cy0];
+            data.resize(entry.size);
+            map.file.seekg(std::streamoff(entry.offset));
+            map.file.read((char*)data.data(), std::streamsize(data.size()));
+            ok = map.file.good();
+        }
+
+        std::atomic<bool> decoded(ok);
+        parallelFor(cy0, ok ? cy1 + 1 : cy0, [&](int cy)
+        {
+            const ChunkEntry& entry = map.index[size_t(cx) * map.chunksY + cy];
+            std::vector<VoxelCell> outside(map.depth); //columns of edge chunks that aren't in the region decode here
+
+            if(!decodeChunk(map, cx, cy, rowData[cy - cy0].data(), entry, [&](int x, int y)
+            {
+                if(x >= x0 && y >= y0 && x < x0 + width && y < y0 + height) return world.column(x - x0, y - y0);
+                return outside.data();
+            }))
+                decoded = false;
+        });
+        ok = decoded;
+    }
+
+    if(!ok)
+        freeWorld(world);
+
+    return ok;
+}
+
+bool saveChunked(const World& world, const std::string& filename, int chunkSize)
+{
+    std::ofstream file(filename.c_str(), std::ios::out|std::ios::binary);
+    int chunksX = (world.width + chunkSize - 1) / chunkSize, chunksY = (world.height + chunkSize - 1) / chunkSize;
+    std::vector<ChunkEntry> index(size_t(chunksX) * chunksY);
+
+    unsigned char header[chunkedHeaderSize];
+    memcpy(header, "VOXC", 4);
+    putU32(header + 4, chunkedVersion);
+    putU32(header + 8, world.width);
+    putU32(header + 12, world.height);
+    putU32(header + 16, world.depth);
+    putU32(header + 20, chunkSize);
+    putU32(header + 24, chunksX);
+    putU32(header + 28, chunksY);
+    putU64(header + 32, chunkedHeaderSize);
+    file.write((char*)header, chunkedHeaderSize);
+
+    //the index goes right after the header, it's written once the chunk offsets are known
+    std::vector<unsigned char> indexData(index.size() * chunkedIndexEntrySize);
+    file.write((char*)indexData.data(), std::streamsize(indexData.size()));
+    Uint64 offset = chunkedHeaderSize + indexData.size();
+
+    //compress a row of chunks on all cores, then write it out in order
+    std::vector<std::vector<unsigned char>> rowData(chunksY);
+
+    for(int cx = 0; cx < chunksX && file.good(); cx++)
+    {
+        parallelFor(0, chunksY, [&](int cy)
+        {
+            std::vector<unsigned char> runs, packed;
+            int x1 = std::min(world.width, (cx + 1) * chunkSize), y1 = std::min(world.height, (cy + 1) * chunkSize);
+
+            for(int x = cx * chunkSize; x < x1; x++)
+                for(int y = cy * chunkSize; y < y1; y++)
+                    encodeRuns(world.column(x, y), world.depth, runs);
+
+            compressLZ(runs.data(), runs.size(), packed);
+
+            ChunkEntry& entry = index[size_t(cx) * chunksY + cy];
+            entry.rawSize = runs.size();
+            entry.codec = packed.size() < runs.size() ? 1 : 0;
+            rowData[cy].swap(entry.codec ? packed : runs);
+            entry.size = rowData[cy].size();
+        });
+
+        for(int cy = 0; cy < chunksY; cy++)
+        {
+            ChunkEntry& entry = index[size_t(cx) * chunksY + cy];
+            entry.offset = offset;
+            offset += entry.size;
+            file.write((char*)rowData[cy].data(), std::streamsize(rowData[cy].size()));
+        }
+    }
+
+    for(size_t i = 0; i < index.size(); i++)
+    {
+        unsigned char* entry = &indexData[i * chunkedIndexEntrySize];
+        putU64(entry, index[i].offset);
+        putU32(entry + 8, index[i].size);
+        putU32(entry + 12, index[i].rawSize);
+        putU32(entry + 16, index[i].codec);
+        putU32(entry + 20, 0);
+    }
+
+    file.seekp(chunkedHeaderSize);
+    file.write((char*)indexData.data(), std::streamsize(indexData.size()));
+    return file.good();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//NATIVE MAP FILES//////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+bool isNativeMap(const std::string& filename)
+{
+    char magic[4] = {0};
+    std::ifstream file(filename.c_str(), std::ios::in|std::ios::binary);
+    file.read(magic, 4);
+    return file.good() && memcmp(magic, "VOXN", 4) == 0;
+}
+
+//checks a header and returns the size of the whole file it describes, 0 if it isn't a map this build can use
+static size_t nativeFileSize(const unsigned char* header, int& width, int& height, int& depth)
+{
+    Uint32 fields[7];
+    memcpy(fields, header, sizeof(fields));
+
+    if(memcmp(header, "VOXN", 4) != 0 || fields[1] > nativeVersion || fields[5] != sizeof(VoxelCell) || fields[6] != 0x01020304)
+        return 0;
+
+    width = fields[2];
+    height = fields[3];
+    depth = fields[4];
+
+    if(width <= 0 || height <= 0 || depth <= 0)
+        return 0;
+
+    size_t columns = size_t(width) * height; //both are below 2^31, this can't overflow yet
+    if(columns > (size_t(-1) - nativeHeaderSize) / sizeof(VoxelCell) / depth)
+        return 0;
+
+    return nativeHeaderSize + columns * depth * sizeof(VoxelCell);
+}
+
+bool mapWorld(World& world, const std::string& filename)
+{
+    unsigned char header[nativeHeaderSize];
+    int width, height, depth;
+
+    freeWorld(world);
+
+#ifdef VOXWORLD_POSIX
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat info;
+    size_t size = 0;
+
+    if(read(fd, header, nativeHeaderSize) == nativeHeaderSize && fstat(fd, &info) == 0)
+        size = nativeFileSize(header, width, height, depth);
+
+    if(size == 0 || size_t(info.st_size) < size)
+    {
+        close(fd);
+        return false;
+    }
+
+    //read only until the first edit (see makeWritable), so the whole file isn't counted against memory up front
+    void* mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(mapping == MAP_FAILED)
+        return false;
+
+    world.width = width;
+    world.height = height;
+    world.depth = depth;
+    world.cells = (VoxelCell*)((unsigned char*)mapping + nativeHeaderSize);
+    world.mapping = mapping;
+    world.mappingSize = size;
+    world.mappingWritable = false;
+    return true;
+#else
+    std::ifstream file(filename.c_str(), std::ios::in|std::ios::binary);
+    file.read((char*)header, nativeHeaderSize);
+
+    if(!file.good() || nativeFileSize(header, width, height, depth) == 0 || !createWorld(world, width, height, depth))
+        return false;
+
+    file.read((char*)world.cells, std::streamsize(world.columns() * depth * sizeof(VoxelCell)));
+    if(!file.good())
+    {
+        freeWorld(world);
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+bool makeWritable(World& world)
+{
+#ifdef VOXWORLD_POSIX
+    if(world.mapping && !world.mappingWritable)
+    {
+        //still private, so edited pages become copies that are never written back to the file
+        if(mprotect(world.mapping, world.mappingSize, PROT_READ|PROT_WRITE) != 0)
+            return false;
+        world.mappingWritable = true;
+    }
+#endif
+    return true;
+}
+
+bool saveNative(const World& world, const std::string& filename)
+{
+    unsigned char header[nativeHeaderSize] = {0};
+    Uint32 fields[7] = {0, nativeVersion, Uint32(world.width), Uint32(world.height), Uint32(world.depth), sizeof(VoxelCell), 0x01020304};
+    memcpy(fields, "VOXN", 4);
+    memcpy(header, fields, sizeof(fields));
+
+    std::ofstream file(filename.c_str(), std::ios::out|std::ios::binary);
+    file.write((char*)header, nativeHeaderSize);
+    file.write((char*)world.cells, std::streamsize(world.columns() * world.depth * sizeof(VoxelCell)));
+    return file.good();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//PREFABS///////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+#define prefabHeaderSize 24
+
+bool copyPrefab(const World& world, Prefab& prefab, int x0, int y0, int z0, int x1, int y1, int z1)
+{
+    if(x0 > x1) std::swap(x0, x1);
+    if(y0 > y1) std::swap(y0, y1);
+    if(z0 > z1) std::swap(z0, z1);
+
+    //chunks that aren't resident read as summaries or air, which would be exported as if they were the real voxels
+    if(world.stream || !world.inside(x0, y0, z0) || !world.inside(x1, y1, z1))
+        return false;
+
+    prefab.width = x1 - x0 + 1;
+    prefab.height = y1 - y0 + 1;
+    prefab.depth = z1 - z0 + 1;
+    prefab.cells.resize(size_t(prefab.width) * prefab.height * prefab.depth);
+
+    for(int x = 0; x < prefab.width; x++)
+        for(int y = 0; y < prefab.height; y++)
+            memcpy(&prefab.cells[(size_t(x) * prefab.height + y) * prefab.depth], world.column(x0 + x, y0 + y) + z0, prefab.depth * sizeof(VoxelCell));
+
+    return true;
+}
+
+void pastePrefab(World& world, const Prefab& prefab, int x, int y, int z)
+{
+    if(world.stream || !makeWritable(world))
+        return;
+
+    //the part of the prefab that lands inside the world
+    int px0 = std::max(0, -x), px1 = std::min(prefab.width, world.width - x);
+    int py0 = std::max(0, -y), py1 = std::min(prefab.height, world.height - y);
+    int pz0 = std::max(0, -z), pz1 = std::min(prefab.depth, world.depth - z);
+    if(px0 >= px1 || py0 >= py1 || pz0 >= pz1)
+        return;
+
+    for(int px = px0; px < px1; px++)
+    {
+        for(int py = py0; py < py1; py++)
+        {
+            VoxelCell* column = world.column(x + px, y + py);
+            memcpy(column + z + pz0, &prefab.cells[(size_t(px) * prefab.height + py) * prefab.depth + pz0], (pz1 - pz0) * sizeof(VoxelCell));
+            encodeColumn(column, world.depth); //the runs above and below the prefab change too
+        }
+    }
+}
+
+void encodePrefab(const Prefab& prefab, std::vector<unsigned char>& out)
+{
+    std::vector<unsigned char> runs;
+    for(size_t column = 0; column < size_t(prefab.width) * prefab.height; column++)
+        encodeRuns(&prefab.cells[column * prefab.depth], prefab.depth, runs);
+
+    size_t start = out.size();
+    out.resize(start + prefabHeaderSize);
+    memcpy(&out[start], "VOXP", 4);
+    putU32(&out[start + 4], prefabVersion);
+    putU32(&out[start + 8], prefab.width);
+    putU32(&out[start + 12], prefab.height);
+    putU32(&out[start + 16], prefab.depth);
+    putU32(&out[start + 20], runs.size());
+    compressLZ(runs.data(), runs.size(), out);
+}
+
+bool decodePrefab(Prefab& prefab, const unsigned char* data, size_t size)
+{
+    if(size < prefabHeaderSize || memcmp(data, "VOXP", 4) != 0 || getU32(data + 4) != prefabVersion)
+        return false;
+
+    //every column takes at least 4 bytes of runs, and the codec can't pack more than 255 bytes into one; a corrupt
+    //header mustn't make us allocate more than that, or more than a gigabyte of cells
+    Uint32 width = getU32(data + 8), height = getU32(data + 12), depth = getU32(data + 16), rawSize = getU32(data + 20);
+    if(width == 0 || height == 0 || depth == 0 || width > 65536 || height > 65536 || depth > 65536
+    || rawSize / 4 < size_t(width) * height || rawSize / 255 > size
+    || size_t(width) * height * depth > (size_t(1) << 28))
+        return false;
+
+    std::vector<unsigned char> runs(rawSize);
+    if(!decompressLZ(data + prefabHeaderSize, size - prefabHeaderSize, runs.data(), runs.size()))
+        return false;
+
+    std::vector<VoxelCell> cells(size_t(width) * height * depth);
+    const unsigned char* p = runs.data(), *end = runs.data() + runs.size();
+    for(size_t column = 0; column < size_t(width) * height; column++)
+        if(!(p = decodeRuns(p, end, &cells[column * depth], depth)))
+            return false;
+
+    prefab.width = width;
+    prefab.height = height;
+    prefab.depth = depth;
+    prefab.cells.swap(cells);
+    return true;
+}
+
+bool savePrefab(const Prefab& prefab, const std::string& filename)
+{
+    std::vector<unsigned char> data;
+    encodePrefab(prefab, data);
+
+    std::ofstream file(filename.c_str(), std::ios::out|std::ios::binary);
+    file.write((const char*)data.data(), data.size());
+    file.close();
+    return file.good();
+}
+
+bool loadPrefab(Prefab& prefab, const std::string& filename)
+{
+    std::vector<unsigned char> data;
+    loadFile(data, filename);
+    return decodePrefab(prefab, data.data(), data.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//EDIT JOURNAL//////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+#define journalVoxelSize 17
+#define journalBoxSize 29
+#define journalPrefabSize 18 //plus the prefab
+
+static bool appendRecord(Journal& journal, unsigned char* record, size_t size)
+{
+    if(journal.mapName.empty())
+        return true;
+
+    unsigned char sum = 0;
+    for(size_t i = 0; i < size - 1; i++)
+        sum += record[i];
+    record[size - 1] = sum;
+
+    //flushed right away so the edit survives the viewer crashing, fsync is left to compaction
+    journal.file.write((char*)record, size);
+    journal.file.flush();
+    journal.records++;
+    return journal.file.good();
+}
+
+//applies one box of edits and re-encodes the columns it touched, the box must be inside the world
+static void applyBox(World& world, int x0, int y0, int z0, int x1, int y1, int z1, const ColorRGB& color)
+{
+    if(!makeWritable(world))
+        return;
+
+    for(int x = x0; x <= x1; x++)
+    {
+        for(int y = y0; y <= y1; y++)
+        {
+            VoxelCell* column = world.column(x, y);
+            for(int z = z0; z <= z1; z++)
+                column[z].setColor(color);
+            encodeColumn(column, world.depth);
+        }
+    }
+}
+
+//opens the journal for appending, starting it with only the header if there's no valid data to keep
+static bool openJournalFile(Journal& journal, const std::string& mapName, const std::vector<unsigned char>& keep)
+{
+    std::string filename = mapName + ".journal";
+
+    if(keep.size() < 8)
+    {
+        unsigned char header[8];
+        memcpy(header, "VOXJ", 4);
+        putU32(header + 4, journalVersion);
+        saveFile(std::vector<unsigned char>(header, header + 8), filename);
+    }
+    else saveFile(keep, filename);
+
+    journal.file.open(filename.c_str(), std::ios::out|std::ios::binary|std::ios::app);
+    journal.mapName = mapName;
+    journal.records = 0;
+    journal.compacting = false;
+    return journal.file.good();
+}
+
+void journalClose(Journal& journal)
+{
+    journal.file.close();
+    journal.file.clear();
+    journal.mapName.clear();
+}
+
+//replays one journal file, stopping at the first record that's torn or out of the world; data is left holding
+//the valid part of the file
+static int replayFile(World& world, const std::string& filename, std::vector<unsigned char>& data)
+{
+    loadFile(data, filename);
+
+    if(data.size() < 8 || memcmp(&data[0], "VOXJ", 4) != 0 || getU32(&data[4]) > journalVersion)
+    {
+        data.clear();
+        return 0;
+    }
+
+    int records = 0;
+    size_t p = 8;
+
+    while(p < data.size())
+    {
+        size_t size = data[p] == 1 ? journalVoxelSize : data[p] == 2 ? journalBoxSize : 0;
+        if(data[p] == 3 && data.size() - p >= journalPrefabSize)
+            size = journalPrefabSize + getU32(&data[p + 13]);
+        if(size == 0 || data.size() - p < size)
+            break;
+
+        unsigned char sum = 0;
+        for(size_t i = 0; i < size - 1; i++)
+            sum += data[p + i];
+        if(sum != data[p + size - 1])
+            break;
+
+        if(data[p] == 3)
+        {
+            //prefabs are clipped to the world like any paste, they may stick out of it
+            Prefab prefab;
+            if(!decodePrefab(prefab, &data[p + 17], size - journalPrefabSize))
+                break;
+
+            pastePrefab(world, prefab, int(getU32(&data[p + 1])), int(getU32(&data[p + 5])), int(getU32(&data[p + 9])));
+            records++;
+            p += size;
+            continue;
+        }
+
+        int c[6];
+        int coordinates = data[p] == 1 ? 3 : 6;
+        for(int i = 0; i < coordinates; i++)
+            c[i] = int(getU32(&data[p + 1 + 4 * i]));
+        if(coordinates == 3)
+            for(int i = 0; i < 3; i++) c[i + 3] = c[i];
+
+        const unsigned char* rgb = &data[p + 1 + 4 * coordinates];
+        if(!world.inside(c[0], c[1], c[2]) || !world.inside(c[3], c[4], c[5]) || c[0] > c[3] || c[1] > c[4] || c[2] > c[5])
+            break;
+
+        applyBox(world, c[0], c[1], c[2], c[3], c[4], c[5], ColorRGB(rgb[0], rgb[1], rgb[2]));
+        records++;
+        p += size;
+    }
+
+    data.resize(p);
+    return records;
+}
+
+int journalOpen(Journal& journal, World& world, const std::string& mapName)
+{
+    journalClose(journal);
+    if(world.stream)
+        return -1; //replaying would write through shared columns
+
+    //the old journal is only there if a compaction didn't finish, its edits come first
+    std::vector<unsigned char> data;
+    int records = replayFile(world, mapName + ".journal.old", data);
+    records += replayFile(world, mapName + ".journal", data);
+
+    //a torn record at the end is cut off, or new records would be appended after it and never replayed
+    if(!openJournalFile(journal, mapName, data))
+    {
+        journalClose(journal);
+        return -1;
+    }
+
+    journal.records = records;
+    return records;
+}
+
+bool journalSetVoxel(Journal& journal, World& world, int x, int y, int z, const ColorRGB& color)
+{
+    if(world.stream || !world.inside(x, y, z) || !makeWritable(world))
+        return false;
+
+    applyBox(world, x, y, z, x, y, z, color);
+
+    unsigned char record[journalVoxelSize];
+    record[0] = 1;
+    putU32(record + 1, x);
+    putU32(record + 5, y);
+    putU32(record + 9, z);
+    record[13] = color.r;
+    record[14] = color.g;
+    record[15] = color.b;
+    return appendRecord(journal, record, journalVoxelSize);
+}
+
+bool journalFillBox(Journal& journal, World& world, int x0, int y0, int z0, int x1, int y1, int z1, const ColorRGB& color)
+{
+    if(x0 > x1) std::swap(x0, x1);
+    if(y0 > y1) std::swap(y0, y1);
+    if(z0 > z1) std::swap(z0, z1);
+
+    if(world.stream || !world.inside(x0, y0, z0) || !world.inside(x1, y1, z1) || !makeWritable(world))
+        return false;
+
+    applyBox(world, x0, y0, z0, x1, y1, z1, color);
+
+    unsigned char record[journalBoxSize];
+    int c[6] = {x0, y0, z0, x1, y1, z1};
+    record[0] = 2;
+    for(int i = 0; i < 6; i++)
+        putU32(record + 1 + 4 * i, c[i]);
+    record[25] = color.r;
+    record[26] = color.g;
+    record[27] = color.b;
+    return appendRecord(journal, record, journalBoxSize);
+}
+
+bool journalPastePrefab(Journal& journal, World& world, const Prefab& prefab, int x, int y, int z)
+{
+    if(world.stream || !makeWritable(world))
+        return false;
+
+    pastePrefab(world, prefab, x, y, z);
+
+    std::vector<unsigned char> record(journalPrefabSize - 1);
+    record[0] = 3;
+    putU32(&record[1], x);
+    putU32(&record[5], y);
+    putU32(&record[9], z);
+    encodePrefab(prefab, record); //appended after the header
+    putU32(&record[13], record.size() - (journalPrefabSize - 1));
+    record.push_back(0); //the checksum
+    return appendRecord(journal, record.data(), record.size());
+}
+
+bool journalIsMap(const Journal& journal, const std::string& filename)
+{
+    if(journal.mapName.empty())
+        return false;
+    if(filename == journal.mapName)
+        return true;
+
+#ifdef VOXWORLD_POSIX
+    //the same file under another name, like ./map.vxn
+    struct stat a, b;
+    return stat(filename.c_str(), &a) == 0 && stat(journal.mapName.c_str(), &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+#else
+    return false;
+#endif
+}
+
+bool journalCompact(Journal& journal, WorldSaver& saver, const World& world, const SaveFunction& save)
+{
+    int state = saveStatus(saver);
+    if(journal.mapName.empty() || journal.compacting || state == SAVE_COPYING || state == SAVE_WRITING)
+        return false;
+
+    //a crash before the map is written leaves the old journal to be replayed
+    std::string mapName = journal.mapName, filename = mapName + ".journal";
+    journalClose(journal);
+
+    std::vector<unsigned char> old, current;
+    loadFile(old, filename + ".old");
+    loadFile(current, filename);
+    bool rotated;
+    if(old.size() >= 8)
+    {
+        //an earlier compaction failed, its edits have to stay in the old journal along with these
+        if(current.size() > 8) old.insert(old.end(), current.begin() + 8, current.end());
+        saveFile(old, filename + ".old");
+        rotated = syncFile(filename + ".old");
+    }
+    else rotated = std::rename(filename.c_str(), (filename + ".old").c_str()) == 0 && syncDirectory(filename);
+
+    //if the journal couldn't be moved aside it's kept as it is, and edits keep going into it
+    size_t records = journal.records;
+    openJournalFile(journal, mapName, rotated ? std::vector<unsigned char>() : current);
+    if(!rotated)
+    {
+        journal.records = records;
+        return false;
+    }
+
+    journal.compacting = saveAsync(saver, world, mapName, save);
+    return journal.compacting;
+}
+
+void journalUpdate(Journal& journal, WorldSaver& saver, const World& world, const SaveFunction& save)
+{
+    if(journal.mapName.empty())
+        return;
+
+    if(journal.compacting)
+    {
+        int state = saveStatus(saver);
+        if(state == SAVE_DONE)
+            std::remove((journal.mapName + ".journal.old").c_str());
+        if(state == SAVE_DONE || state == SAVE_FAILED)
+            journal.compacting = false; //after a failure the old journal stays, and is replayed with the new one
+    }
+    else if(journal.records >= journalCompactRecords)
+        journalCompact(journal, saver, world, save);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//VOXLAP MAPS///////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+//finds where every column starts, false if the file doesn't hold exactly columns columns
+static bool scanVXL(const std::vector<unsigned char>& data, size_t columns, std::vector<size_t>& offsets)
+{
+    size_t p = 0;
+    offsets.resize(columns);
+
+    for(size_t column = 0; column < columns; column++)
+    {
+        offsets[column] = p;
+
+        for(;;)
+        {
+            //p can be past the end after a bad span length, so check that before subtracting
+            if(p > data.size() || data.size() - p < 4) return false;
+            size_t length = data[p];
+            if(length == 0)
+            {
+                if(data[p + 2] + 1 < data[p + 1]) return false;
+                length = data[p + 2] - data[p + 1] + 2;
+                if(data.size() - p < 4 * length) return false;
+                p += 4 * length;
+                break;
+            }
+            p += 4 * length;
+        }
+    }
+
+    return p == data.size();
+}
+
+static bool decodeVXLColumn(const unsigned char* v, const unsigned char* end, VoxelCell* column, int depth)
+{
+    const VoxelCell air = {0, 0, 0, 1};
+    VoxelCell solid = {128, 128, 128, 1}; //for hidden voxels, the color of the last visible voxel above them
+    int z = 0;
+
+    auto color = [&](const unsigned char* c)
+    {
+        ColorRGB rgb = solidColor(c[2], c[1], c[0]);
+        return VoxelCell{Uint8(rgb.r), Uint8(rgb.g), Uint8(rgb.b), 1};
+    };
+
+    for(;;)
+    {
+        if(end - v < 4) return false;
+
+        int length = v[0], top = v[1], bottom = v[2];
+        int topColors = bottom - top + 1;
+        if(top < z || topColors < 0 || bottom >= depth || end - v < 4 + 4 * topColors) return false;
+
+        while(z < top) column[z++] = air;
+        for(int i = 0; i < topColors; i++) column[z++] = solid = color(v + 4 + 4 * i);
+
+        if(length == 0)
+        {
+            while(z < depth) column[z++] = solid;
+            return true;
+        }
+
+        int bottomColors = length - 1 - topColors;
+        const unsigned char* colors = v + 4 + 4 * topColors;
+        v += 4 * length;
+        if(bottomColors < 0 || end - v < 4) return false;
+
+        int ceilingEnd = v[3], ceilingStart = ceilingEnd - bottomColors;
+        if(ceilingStart < z || ceilingEnd > depth) return false;
+
+        while(z < ceilingStart) column[z++] = solid;
+        for(int i = 0; i < bottomColors; i++) column[z++] = solid = color(colors + 4 * i);
+    }
+}
+
+bool loadVXL(World& world, const std::string& filename)
+{
+    const int sizes[][2] = {{1024, 256}, {512, 64}};
+    std::vector<unsigned char> data;
+    std::vector<size_t> offsets;
+    loadFile(data, filename);
+
+    //the columns have to be found one after the other, but then they decode independently
+    for(const int* size : sizes)
+    {
+        int width = size[0], depth = size[1];
+        if(!scanVXL(data, size_t(width) * width, offsets))
+            continue;
+
+        freeWorld(world);
+        if(!createWorld(world, width, width, depth))
+            return false;
+
+        std::atomic<bool> ok(true);
+        parallelFor(0, width, [&](int y)
+        {
+            for(int x = 0; x < width; x++)
+            {
+                VoxelCell* column = world.column(x, y);
+                if(!decodeVXLColumn(&data[offsets[size_t(y) * width + x]], data.data() + data.size(), column, depth))
+                    ok = false;
+                encodeColumn(column, depth);
+            }
+        });
+
+        if(!ok)
+            freeWorld(world);
+
+        return ok;
+    }
+
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//HEIGHTMAPS////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+bool loadHeightmap(World& world, const std::string& heightFile, const std::string& colorFile, int depth)
+{
+    std::vector<unsigned char> file, heights, colors;
+    unsigned long width, height, colorWidth = 0, colorHeight = 0;
+
+    //16 bit grey is kept as it is, GIS exports use the extra precision; anything else is read as RGBA
+    loadFile(file, heightFile);
+    bool wide = file.size() > 25 && file[24] == 16 && file[25] == 0;
+    if(decodePNG(heights, width, height, file.data(), file.size(), !wide) || width == 0 || height == 0)
+        return false;
+
+    if(!colorFile.empty())
+    {
+        loadFile(file, colorFile);
+        if(decodePNG(colors, colorWidth, colorHeight, file) || colorWidth == 0 || colorHeight == 0)
+            return false;
+    }
+
+    freeWorld(world);
+    if(depth <= 0 || !createWorld(world, int(width), int(height), depth))
+        return false;
+
+    //the columns are written as the renderer stores them, runs included, so they don't need encodeColumn
+    parallelFor(0, int(width), [&](int x)
+    {
+        for(int y = 0; y < int(height); y++)
+        {
+            size_t pixel = size_t(y) * width + x;
+            double value = wide ? (heights[2 * pixel] * 256 + heights[2 * pixel + 1]) / 65535.0 : heights[4 * pixel] / 255.0;
+            int surface = depth - 1 - int(value * (depth - 1) + 0.5);
+
+            ColorRGB color;
+            if(colors.empty())
+                color = solidColor(64 + int(value * 191), 64 + int(value * 191), 64 + int(value * 191));
+            else
+            {
+                const unsigned char* c = &colors[4 * (size_t(y) * colorHeight / height * colorWidth + size_t(x) * colorWidth / width)];
+                color = solidColor(c[0], c[1], c[2]);
+            }
+
+            VoxelCell* column = world.column(x, y);
+            for(int z = 0; z < surface; z++)
+                column[z] = VoxelCell{0, 0, 0, Uint8(std::min(surface - z, 255))};
+            for(int z = surface; z < depth; z++)
+                column[z] = VoxelCell{Uint8(color.r), Uint8(color.g), Uint8(color.b), Uint8(std::min(depth - z, 255))};
+        }
+    });
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//STREAMING/////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+#define maxQueuedChunks 64 //requests beyond this would only be reordered away again next frame
+
+//one column for the whole chunk: at every height, the average color if at least half the columns are solid there
+static void summarizeChunk(const VoxelCell* cells, int columns, int depth, VoxelCell* summary)
+{
+    for(int z = 0; z < depth; z++)
+    {
+        int solid = 0, r = 0, g = 0, b = 0;
+
+        for(int column = 0; column < columns; column++)
+        {
+            const VoxelCell& cell = cells[size_t(column) * depth + z];
+            if(cell.empty()) continue;
+            solid++;
+            r += cell.r;
+            g += cell.g;
+            b += cell.b;
+        }
+
+        summary[z] = VoxelCell{0, 0, 0, 1};
+        if(solid * 2 >= columns)
+            summary[z].setColor(solidColor(r / solid, g / solid, b / solid));
+    }
+
+    encodeColumn(summary, depth);
+}
+
+static void streamThread(StreamingWorld* stream)
+{
+    size_t columns = size_t(stream->chunkSize) * stream->chunkSize;
+
+    for(;;)
+    {
+        int chunk;
+        {
+            std::unique_lock<std::mutex> guard(stream->lock);
+            stream->wake.wait(guard, [&]() { return stream->quit || !stream->requests.empty(); });
+            if(stream->quit) return;
+            chunk = stream->requests.front();
+            stream->requests.pop_front();
+            stream->reading = chunk;
+        }
+
+        LoadedChunk loaded = {chunk, new(std::nothrow) VoxelCell[columns * stream->depth], new(std::nothrow) VoxelCell[stream->depth]};
+
+        if(!loaded.cells || !loaded.summary || !readChunk(stream->map, chunk / stream->chunksY, chunk % stream->chunksY, loaded.cells))
+        {
+            delete[] loaded.cells;
+            delete[] loaded.summary;
+            loaded.cells = loaded.summary = 0;
+        }
+        else summarizeChunk(loaded.cells, int(columns), stream->depth, loaded.summary);
+
+        std::lock_guard<std::mutex> guard(stream->lock);
+        stream->loaded.push_back(loaded);
+        stream->reading = -1;
+    }
+}
+
+bool streamOpen(StreamingWorld& stream, World& world, const std::string& filename, size_t budget, int keepRadius)
+{
+    if(!openChunked(stream.map, filename) || (stream.map.chunkSize & (stream.map.chunkSize - 1)) != 0)
+        return false;
+
+    stream.chunkSize = stream.map.chunkSize;
+    stream.chunkShift = 0;
+    while((1 << stream.chunkShift) < stream.chunkSize)
+        stream.chunkShift++;
+
+    stream.chunksX = stream.map.chunksX;
+    stream.chunksY = stream.map.chunksY;
+    stream.depth = stream.map.depth;
+    stream.chunks.assign(size_t(stream.chunksX) * stream.chunksY, StreamChunk{0, 0, 0, false, false});
+    stream.emptyColumn.assign(stream.depth, VoxelCell{0, 0, 0, 1});
+    encodeColumn(stream.emptyColumn.data(), stream.depth);
+    stream.resident.clear();
+    stream.missed.clear();
+    stream.chunkBytes = size_t(stream.chunkSize) * stream.chunkSize * stream.depth * sizeof(VoxelCell);
+    stream.budget = std::max(budget, stream.chunkBytes);
+    stream.frame = 1;
+    stream.loads = stream.evictions = stream.failures = 0;
+
+    //the chunks that are always kept have to fit in the budget, with room to spare for the ones in view
+    size_t capacity = stream.budget / stream.chunkBytes;
+    stream.keepRadius = keepRadius;
+    while(stream.keepRadius > 0 && size_t(2 * stream.keepRadius + 1) * (2 * stream.keepRadius + 1) * 2 > capacity)
+        stream.keepRadius--;
+
+    stream.requests.clear();
+    stream.loaded.clear();
+    stream.quit = false;
+    stream.reading = -1;
+    stream.io = std::thread(streamThread, &stream);
+
+    freeWorld(world);
+    world.width = stream.map.width;
+    world.height = stream.map.height;
+    world.depth = stream.depth;
+    world.stream = &stream;
+    return true;
+}
+
+void streamClose(StreamingWorld& stream, World& world)
+{
+    {
+        std::lock_guard<std::mutex> guard(stream.lock);
+        stream.quit = true;
+    }
+    stream.wake.notify_all();
+    if(stream.io.joinable())
+        stream.io.join();
+
+    for(LoadedChunk& loaded : stream.loaded)
+    {
+        delete[] loaded.cells;
+        delete[] loaded.summary;
+    }
+
+    for(StreamChunk& chunk : stream.chunks)
+    {
+        delete[] chunk.cells;
+        delete[] chunk.summary;
+    }
+
+    stream.loaded.clear();
+    stream.chunks.clear();
+    stream.resident.clear();
+    stream.map.file.close();
+
+    if(world.stream == &stream)
+        freeWorld(world);
+}
+
+void streamUpdate(StreamingWorld& stream, double x, double y, double velocityX, double velocityY)
+{
+    std::vector<LoadedChunk> loaded;
+    size_t inFlight;
+    {
+        std::lock_guard<std::mutex> guard(stream.lock);
+        loaded.swap(stream.loaded);
+        inFlight = stream.reading >= 0 ? 1 : 0;
+
+        //everything that isn't being read right now gets requested again below, in the new order
+        for(int chunk : stream.requests)
+            stream.chunks[chunk].queued = false;
+        stream.requests.clear();
+    }
+
+    for(LoadedChunk& chunk : loaded)
+    {
+        StreamChunk& target = stream.chunks[chunk.chunk];
+        target.queued = false;
+
+        if(!chunk.cells)
+        {
+            target.failed = true;
+            stream.failures++;
+            continue;
+        }
+
+        target.cells = chunk.cells;
+        target.lastUsed = stream.frame;
+        delete[] target.summary;
+        target.summary = chunk.summary;
+        stream.resident.push_back(chunk.chunk);
+        stream.loads++;
+    }
+
+    int cameraX = int(x) >> stream.chunkShift, cameraY = int(y) >> stream.chunkShift;
+    std::vector<std::pair<double, int>> wanted;
+
+    auto want = [&](int cx, int cy, double priority)
+    {
+        if(cx < 0 || cy < 0 || cx >= stream.chunksX || cy >= stream.chunksY) return;
+        int index = cx * stream.chunksY + cy;
+        StreamChunk& chunk = stream.chunks[index];
+        if(!chunk.queued && !chunk.cells && !chunk.failed) wanted.push_back(std::make_pair(priority, index));
+    };
+
+    //the chunks around the camera come first, and count as used so they're never evicted
+    for(int dx = -stream.keepRadius; dx <= stream.keepRadius; dx++)
+    {
+        for(int dy = -stream.keepRadius; dy <= stream.keepRadius; dy++)
+        {
+            int cx = cameraX + dx, cy = cameraY + dy;
+            if(cx >= 0 && cy >= 0 && cx < stream.chunksX && cy < stream.chunksY && stream.chunks[cx * stream.chunksY + cy].cells)
+                stream.chunks[cx * stream.chunksY + cy].lastUsed = stream.frame;
+            want(cx, cy, std::sqrt(double(dx * dx + dy * dy)));
+        }
+    }
+
+    //then where the camera will be in half a second, one second and two seconds
+    for(double t : {0.5, 1.0, 2.0})
+    {
+        int cx = int(x + velocityX * t) >> stream.chunkShift, cy = int(y + velocityY * t) >> stream.chunkShift;
+        for(int dx = -1; dx <= 1; dx++)
+            for(int dy = -1; dy <= 1; dy++)
+                want(cx + dx, cy + dy, stream.keepRadius + 1 + t + std::sqrt(double(dx * dx + dy * dy)));
+    }
+
+    //then whatever the rays ran into, nearest first
+    for(int index : stream.missed)
+    {
+        int cx = index / stream.chunksY, cy = index % stream.chunksY;
+        want(cx, cy, stream.keepRadius + 4 + std::sqrt(double((cx - cameraX) * (cx - cameraX) + (cy - cameraY) * (cy - cameraY))));
+    }
+    stream.missed.clear();
+
+    //evict the least recently rendered chunks down to the budget, but never one that was used this frame
+    size_t capacity = stream.budget / stream.chunkBytes;
+    std::sort(stream.resident.begin(), stream.resident.end(), [&](int a, int b) { return stream.chunks[a].lastUsed < stream.chunks[b].lastUsed; });
+
+    size_t evict = 0;
+    while(stream.resident.size() - evict > capacity && stream.chunks[stream.resident[evict]].lastUsed < stream.frame)
+    {
+        StreamChunk& chunk = stream.chunks[stream.resident[evict]];
+        delete[] chunk.cells;
+        chunk.cells = 0;
+        evict++;
+    }
+    stream.resident.erase(stream.resident.begin(), stream.resident.begin() + evict);
+    stream.evictions += evict;
+
+    //only ask for as many chunks as can be loaded without evicting one that's in use
+    size_t evictable = 0;
+    while(evictable < stream.resident.size() && stream.chunks[stream.resident[evictable]].lastUsed < stream.frame)
+        evictable++;
+
+    size_t room = capacity + evictable - std::min(capacity + evictable, stream.resident.size() + inFlight);
+    room = std::min<size_t>(room, maxQueuedChunks);
+
+    std::sort(wanted.begin(), wanted.end());
+    {
+        std::lock_guard<std::mutex> guard(stream.lock);
+
+        for(size_t i = 0; i < wanted.size() && stream.requests.size() < room; i++)
+        {
+            StreamChunk& chunk = stream.chunks[wanted[i].second];
+            if(chunk.queued) continue; //wanted for more than one reason
+            chunk.queued = true;
+            stream.requests.push_back(wanted[i].second);
+        }
+    }
+    stream.wake.notify_one();
+
+    stream.frame++;
+}
+
+void streamPreload(StreamingWorld& stream, double x, double y)
+{
+    int cameraX = int(x) >> stream.chunkShift, cameraY = int(y) >> stream.chunkShift;
+
+    for(;;)
+    {
+        streamUpdate(stream, x, y, 0, 0);
+
+        bool ready = true;
+        for(int cx = std::max(0, cameraX - stream.keepRadius); cx <= std::min(stream.chunksX - 1, cameraX + stream.keepRadius); cx++)
+        {
+            for(int cy = std::max(0, cameraY - stream.keepRadius); cy <= std::min(stream.chunksY - 1, cameraY + stream.keepRadius); cy++)
+            {
+                const StreamChunk& chunk = stream.chunks[cx * stream.chunksY + cy];
+                if(!chunk.cells && !chunk.failed) ready = false;
+            }
+        }
+
+        if(ready) return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+}
+
+size_t streamQueued(StreamingWorld& stream)
+{
+    std::lock_guard<std::mutex> guard(stream.lock);
+    return stream.requests.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//PROCEDURAL GENERATION/////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+GeneratorSettings defaultGeneratorSettings()
+{
+    return GeneratorSettings{1, 0.6, 0.5, 0.3};
+}
+
+//integer hash of a lattice point, every (x, y, seed) gives an unrelated value
+static inline Uint32 hashPoint(int x, int y, Uint32 seed)
+{
+    Uint32 h = Uint32(x) * 0x8DA6B343u ^ Uint32(y) * 0xD8163841u ^ seed * 0xCB1AB31Fu;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    h *= 0x297A2D39u;
+    h ^= h >> 15;
+    return h;
+}
+
+//smooth value noise in [-1, 1], with a feature size of 1
+static double valueNoise(double x, double y, Uint32 seed)
+{
+    int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+    double fx = x - x0, fy = y - y0;
+    fx = fx * fx * (3 - 2 * fx);
+    fy = fy * fy * (3 - 2 * fy);
+
+    double v00 = hashPoint(x0, y0, seed) / 2147483647.5 - 1.0;
+    double v10 = hashPoint(x0 + 1, y0, seed) / 2147483647.5 - 1.0;
+    double v01 = hashPoint(x0, y0 + 1, seed) / 2147483647.5 - 1.0;
+    double v11 = hashPoint(x0 + 1, y0 + 1, seed) / 2147483647.5 - 1.0;
+
+    double top = v00 + (v10 - v00) * fx;
+    double bottom = v01 + (v11 - v01) * fx;
+    return top + (bottom - top) * fy;
+}
+
+//octaves of value noise, every one twice the frequency and half the amplitude of the last
+static double fractalNoise(double x, double y, int octaves, Uint32 seed)
+{
+    double sum = 0, amplitude = 1, total = 0;
+
+    for(int i = 0; i < octaves; i++)
+    {
+        sum += valueNoise(x, y, seed + i) * amplitude;
+        total += amplitude;
+        amplitude *= 0.5;
+        x *= 2;
+        y *= 2;
+    }
+
+    return sum / total;
+}
+
+//terrain height above the bottom of the world, in voxels
+static int terrainHeight(int x, int y, int depth, const GeneratorSettings& settings)
+{
+    double relief = fractalNoise(x / 256.0, y / 256.0, 5, settings.seed) * 0.3 * settings.hills;
+    double detail = fractalNoise(x / 24.0, y / 24.0, 2, settings.seed + 10) * 0.02;
+    int height = int(depth * (0.35 + relief + detail));
+    return std::max(2, std::min(depth - 2, height));
+}
+
+#define lotSize 64 //buildings are placed one per lot of lotSize x lotSize columns
+#define storyHeight 6
+
+typedef struct Building
+{
+    bool present;
+    int x0, y0, x1, y1; //footprint in lot coordinates, inclusive
+    int ground; //z of the ground floor, the foundation is below it
+    int roof; //z of the roof
+    ColorRGB wall, floor;
+} Building;
+
+static Building planBuilding(int lotX, int lotY, int depth, const GeneratorSettings& settings)
+{
+    static const ColorRGB walls[] = {ColorRGB(150, 70, 50), ColorRGB(200, 180, 140), ColorRGB(220, 220, 210), ColorRGB(110, 120, 140)};
+    Building building;
+    Uint32 h = hashPoint(lotX, lotY, settings.seed + 7), shape = hashPoint(lotX, lotY, settings.seed + 8);
+
+    building.present = (h & 0xFFFF) < settings.buildings * 65536.0;
+    if(!building.present)
+        return building;
+
+    building.x0 = 4 + shape % 12;
+    building.y0 = 4 + (shape >> 4) % 12;
+    building.x1 = lotSize - 5 - (shape >> 8) % 12;
+    building.y1 = lotSize - 5 - (shape >> 12) % 12;
+
+    int center = depth - terrainHeight(lotX * lotSize + lotSize / 2, lotY * lotSize + lotSize / 2, depth, settings);
+    int stories = 2 + (h >> 16) % 8;
+    building.ground = center;
+    building.roof = std::max(1, center - stories * storyHeight);
+    building.wall = walls[(h >> 24) % 4];
+    building.floor = ColorRGB(90, 90, 95);
+    return building;
+}
+
+static void generateColumn(VoxelCell* column, int x, int y, int depth, const GeneratorSettings& settings)
+{
+    const VoxelCell air = {0, 0, 0, 1};
+    int lotX = x / lotSize, lotY = y / lotSize, localX = x % lotSize, localY = y % lotSize;
+    Building building = planBuilding(lotX, lotY, depth, settings);
+
+    if(building.present && localX >= building.x0 && localX <= building.x1 && localY >= building.y0 && localY <= building.y1)
+    {
+        bool wall = localX == building.x0 || localX == building.x1 || localY == building.y0 || localY == building.y1;
+        int along = (localX == building.x0 || localX == building.x1) ? localY : localX;
+        ColorRGB foundation(100, 100, 100), roof(70, 60, 60);
+
+        for(int z = 0; z < depth; z++)
+        {
+            ColorRGB color = RGB_Black;
+            int story = building.ground - 1 - z; //voxels above the ground floor
+
+            if(z >= building.ground) color = foundation;
+            else if(z == building.roof) color = roof;
+            else if(z > building.roof)
+            {
+                bool window = (story % storyHeight == 2 || story % storyHeight == 3) && along % 4 >= 2;
+                if(wall && !window) color = building.wall;
+                else if(story % storyHeight == storyHeight - 1) color = building.floor;
+            }
+
+            column[z] = VoxelCell{Uint8(color.r), Uint8(color.g), Uint8(color.b), 1};
+        }
+
+        encodeColumn(column, depth);
+        return;
+    }
+
+    int top = depth - terrainHeight(x, y, depth, settings); //z of the surface voxel
+    double tint = fractalNoise(x / 32.0, y / 32.0, 2, settings.seed + 20);
+    int strata = int(8 * valueNoise(x / 64.0, y / 64.0, settings.seed + 30));
+    ColorRGB grass = (top < depth * 0.45) ? solidColor(230, 230, 235) : solidColor(50 + int(20 * tint), 130 + int(30 * tint), 40);
+    ColorRGB dirt(110, 80, 50), stone(120, 120, 125), darkStone(105, 105, 112), bedrock(50, 50, 55);
+
+    for(int z = 0; z < depth; z++)
+    {
+        ColorRGB color = RGB_Black;
+
+        if(z == depth - 1) color = bedrock;
+        else if(z == top) color = grass;
+        else if(z > top && z <= top + 3) color = dirt;
+        else if(z > top) color = (((z + strata) / 6) & 1) ? stone : darkStone;
+
+        column[z] = VoxelCell{Uint8(color.r), Uint8(color.g), Uint8(color.b), 1};
+    }
+
+    //three layers of tunnels, each following the ridges of its own noise
+    if(settings.caves > 0)
+    {
+        double width = 0.02 + 0.08 * settings.caves;
+
+        for(int layer = 0; layer < 3; layer++)
+        {
+            double ridge = std::fabs(fractalNoise(x / 96.0, y / 96.0, 3, settings.seed + 100 + layer));
+            if(ridge >= width)
+                continue;
+
+            double t = 1.0 - ridge / width;
+            int radius = int(1 + t * (2 + 4 * settings.caves));
+            int center = top + int((depth - top) * (layer + 1) / 4.0 + 6 * valueNoise(x / 40.0, y / 40.0, settings.seed + 200 + layer));
+
+            for(int z = std::max(top, center - radius); z <= std::min(depth - 2, center + radius); z++)
+                column[z] = air;
+        }
+    }
+
+    encodeColumn(column, depth);
+}
+
+void generateWorld(World& world, const GeneratorSettings& settings)
+{
+    parallelFor(0, world.width, [&](int x)
+    {
+        for(int y = 0; y < world.height; y++)
+            generateColumn(world.column(x, y), x, y, world.depth, settings);
+    });
+}
@@ -0,0 +1,394 @@
+/*
+
+VoxWorld - voxel world storage, loading and generation for the voxel renderers
+Written by John Lemme, see voxel7.cpp for the renderer that uses it.
+
+A world is a runtime-sized grid of columns. Every column is depth voxels long, stored
+top (z = 0) to bottom, and columns are stored one after the other, x-major:
+column (x, y) starts at cell (x * height + y) * depth. Empty voxels are black.
+
+*/
+
+#ifndef _voxworld_h_included
+#define _voxworld_h_included
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include "quickcg.h"
+
+//one voxel: its color, and how many voxels from here down the column have the same color
+typedef struct VoxelCell
+{
+    Uint8 r, g, b;
+    Uint8 runLength; //filled in by encodeColumn, at least 1, runs longer than 255 are counted as 255
+
+    QuickCG::ColorRGB color() const { return QuickCG::ColorRGB(r, g, b); }
+    QuickCG::Color32 packedColor() const { return QuickCG::Color32(r, g, b); }
+    void setColor(const QuickCG::ColorRGB& color) { r = color.r; g = color.g; b = color.b; }
+    bool empty() const { return (r | g | b) == 0; }
+} VoxelCell;
+
+struct StreamingWorld;
+
+typedef struct World
+{
+    int width = 0, height = 0, depth = 0; //x, y and z size in voxels
+    VoxelCell* cells = 0;
+    void* mapping = 0; //set if the cells live in a mapped file, see mapWorld
+    size_t mappingSize = 0;
+    bool mappingWritable = false; //mappings start read only, see makeWritable
+    StreamingWorld* stream = 0; //set if the columns come from a streamed file, cells is 0 then
+
+    VoxelCell* column(int x, int y) const; //defined at the end of this file
+    VoxelCell& at(int x, int y, int z) const { return column(x, y)[z]; }
+    bool inside(int x, int y, int z) const { return x >= 0 && y >= 0 && z >= 0 && x < width && y < height && z < depth; }
+    size_t columns() const { return size_t(width) * height; }
+} World;
+
+//allocates the cells without touching them, so the OS only commits what gets written; false if out of memory
+bool createWorld(World& world, int width, int height, int depth);
+void freeWorld(World& world); //frees or unmaps the cells
+void clearWorld(World& world); //every voxel empty
+
+void encodeColumn(VoxelCell* column, int depth); //recomputes the run lengths of one column
+void encodeWorld(World& world); //recomputes every run length, in parallel
+int surfaceHeight(const World& world, int x, int y); //z of the topmost solid voxel, depth if the column is empty
+QuickCG::ColorRGB solidColor(int r, int g, int b); //clamps to 0-255 and keeps the color from being black, which means empty
+
+//calls body(i) for every i in [begin, end) on all cores, handing out the indices one at a time
+void parallelFor(int begin, int end, const std::function<void(int)>& body);
+
+//headerless .vx5 files: width*height*depth RGB voxels in the same order as the cells
+bool loadVX5(World& world, const std::string& filename, int width, int height, int depth);
+bool saveVX5(const World& world, const std::string& filename);
+
+////////////////////////////////////////////////////////////////////////////////
+//BACKGROUND SAVING/////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+enum SaveState {SAVE_IDLE, SAVE_COPYING, SAVE_WRITING, SAVE_DONE, SAVE_FAILED};
+
+typedef struct WorldSaver
+{
+    std::thread thread;
+    std::atomic<int> state{SAVE_IDLE};
+    std::string filename;
+    World snapshot; //the copy that's being written
+    double seconds = 0; //how long the whole save took, once it's done
+} WorldSaver;
+
+typedef std::function<bool(const World&, const std::string&)> SaveFunction;
+
+//saves world with save on a background thread: the world is first copied on that thread, then the copy is written
+//to a temporary file next to it, fsynced and renamed over filename, and the directory is fsynced so the rename
+//sticks: a crash never leaves half a map behind. The world mustn't change until saveSnapshotTaken returns. False if
+//a save is already running.
+bool saveAsync(WorldSaver& saver, const World& world, const std::string& filename, const SaveFunction& save);
+void saveSnapshotTaken(WorldSaver& saver); //blocks until the copy has been taken
+int saveStatus(WorldSaver& saver); //one of SaveState, the thread is joined once it's done
+void saveWait(WorldSaver& saver); //blocks until the save is done
+bool syncFile(const std::string& filename); //fsyncs a file that's been written and closed
+bool syncDirectory(const std::string& filename); //fsyncs the directory a file is in, so a rename to it is on disk too
+
+////////////////////////////////////////////////////////////////////////////////
+//CHUNKED MAP FILES/////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+.vxc files, all numbers little endian:
+
+header, 40 bytes: "VOXC", version, width, height, depth, chunkSize, chunksX, chunksY (all 32 bit),
+                  offset of the index (64 bit)
+index: chunksX * chunksY entries of 24 bytes, chunk (cx, cy) is entry cx * chunksY + cy:
+       offset (64 bit), stored size, raw size, codec, reserved (32 bit)
+chunks: the columns of one chunkSize x chunkSize square, clipped to the world, x-major. Every column
+        is a list of runs covering it top to bottom: length (LEB128 varint), r, g, b. With codec 1 the
+        runs are compressed with compressLZ, with codec 0 they are stored as is.
+*/
+
+#define chunkedVersion 1
+#define chunkedHeaderSize 40
+#define chunkedIndexEntrySize 24
+
+typedef struct ChunkEntry
+{
+    Uint64 offset;
+    Uint32 size, rawSize; //stored and uncompressed size in bytes
+    Uint32 codec;
+} ChunkEntry;
+
+//an open .vxc file, only the header and the index are read up front
+typedef struct ChunkedMap
+{
+    std::ifstream file;
+    int width, height, depth;
+    int chunkSize, chunksX, chunksY;
+    std::vector<ChunkEntry> index;
+} ChunkedMap;
+
+bool isChunkedMap(const std::string& filename); //checks the magic
+bool openChunked(ChunkedMap& map, const std::string& filename); //false if the file is missing, truncated or a newer version
+//reads and decodes one chunk into chunkSize * chunkSize encoded columns, column (lx, ly) at (lx * chunkSize + ly) * depth,
+//columns past the edge of the world are empty
+bool readChunk(ChunkedMap& map, int cx, int cy, VoxelCell* cells);
+
+//loads the region of width x height columns at (x0, y0) into a world of that size, reading only the chunks it
+//overlaps; a width or height of 0 extends the region to the edge of the map
+bool loadChunked(World& world, const std::string& filename, int x0 = 0, int y0 = 0, int width = 0, int height = 0);
+bool saveChunked(const World& world, const std::string& filename, int chunkSize = 32);
+
+//byte-oriented LZ77 in the style of LZ4: sequences of literals and matches up to 64 KB back
+void compressLZ(const unsigned char* data, size_t size, std::vector<unsigned char>& out);
+//rawSize must be the exact uncompressed size, false if the data is corrupt
+bool decompressLZ(const unsigned char* data, size_t size, unsigned char* out, size_t rawSize);
+
+////////////////////////////////////////////////////////////////////////////////
+//NATIVE MAP FILES//////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+.vxn files are the cells exactly as the renderer keeps them in memory, run lengths included, behind a
+header padded to nativeHeaderSize so the cells start page aligned: "VOXN", version, width, height,
+depth, the size of a cell and 0x01020304 to check the byte order (all 32 bit, in the byte order of the
+machine that wrote the file). They're big, but mapWorld renders straight from the page cache.
+*/
+
+#define nativeVersion 1
+#define nativeHeaderSize 4096
+
+bool isNativeMap(const std::string& filename); //checks the magic
+//maps a .vxn file into memory without reading it, pages are faulted in when the renderer first touches them.
+//Only the header is checked, the renderer clamps run lengths to their column so a damaged file can't hang it.
+//The mapping is private and read only: untouched pages are shared with every other process mapping the file.
+//Falls back to reading the file where there's no mmap.
+bool mapWorld(World& world, const std::string& filename);
+//makes a mapped world writable before its first edit, edits go to copies of the pages that are never written back.
+//The edit functions call it, false if the system refuses (the map may be bigger than it will commit to)
+bool makeWritable(World& world);
+bool saveNative(const World& world, const std::string& filename);
+
+////////////////////////////////////////////////////////////////////////////////
+//PREFABS///////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+A prefab is a box of voxels cut out of a world, to be pasted back anywhere any number of times. .vxp files:
+"VOXP", version, width, height, depth, size of the runs (all 32 bit, little endian), then the runs of every
+column in x-major order, encoded like the chunks of .vxc files and compressed with the same LZ codec.
+*/
+
+#define prefabVersion 1
+
+typedef struct Prefab
+{
+    int width = 0, height = 0, depth = 0;
+    std::vector<VoxelCell> cells; //x-major columns of depth cells, like World
+} Prefab;
+
+//copies the box (x0, y0, z0)-(x1, y1, z1), inclusive, false if it isn't inside the world or the world is streamed
+bool copyPrefab(const World& world, Prefab& prefab, int x0, int y0, int z0, int x1, int y1, int z1);
+//copies the prefab over the world with its first voxel at (x, y, z), empty voxels included, clipped to the world.
+//Only the columns it touched are re-encoded. Does nothing to a streamed world
+void pastePrefab(World& world, const Prefab& prefab, int x, int y, int z);
+void encodePrefab(const Prefab& prefab, std::vector<unsigned char>& out); //appends the contents of a .vxp file to out
+bool decodePrefab(Prefab& prefab, const unsigned char* data, size_t size);
+bool savePrefab(const Prefab& prefab, const std::string& filename);
+bool loadPrefab(Prefab& prefab, const std::string& filename);
+
+////////////////////////////////////////////////////////////////////////////////
+//EDIT JOURNAL//////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+Edits are appended to <map>.journal instead of rewriting the map: "VOXJ" and a version (32 bit), then
+records of a type byte, little endian 32 bit coordinates, r, g, b and a checksum byte (the sum of the
+record's other bytes). Type 1 sets one voxel (x, y, z), type 2 fills the box (x0, y0, z0)-(x1, y1, z1),
+inclusive. Type 3 pastes a prefab at (x, y, z): the coordinates are followed by the size of the prefab (32 bit)
+and the prefab as it's stored in a .vxp file. Records only ever set voxels, so replaying one twice does no
+harm, and a record that was torn by a crash fails its checksum and ends the replay.
+
+Compaction folds the journal into the map: the journal is renamed to <map>.journal.old and a new one is
+started, then the world is saved over the map in the background. The old journal is deleted once the map
+is safely on disk; until then loading replays both. If a save fails, the next compaction appends the new
+journal to the old one instead.
+*/
+
+#define journalVersion 2 //version 1 had no prefab records
+#define journalCompactRecords 4096 //compact automatically once the journal has this many records
+
+typedef struct Journal
+{
+    std::string mapName; //empty if there's no journal
+    std::ofstream file;
+    size_t records = 0;
+    bool compacting = false;
+} Journal;
+
+//replays the journals of mapName onto world and opens the journal for appending, creating it if needed;
+//returns the number of records replayed, -1 if the journal can't be written
+int journalOpen(Journal& journal, World& world, const std::string& mapName);
+void journalClose(Journal& journal);
+//both write the edit to the world, re-encode the columns it touched and append it to the journal, if one is open.
+//They return false without editing a streamed world, which can't be edited
+bool journalSetVoxel(Journal& journal, World& world, int x, int y, int z, const QuickCG::ColorRGB& color);
+bool journalFillBox(Journal& journal, World& world, int x0, int y0, int z0, int x1, int y1, int z1, const QuickCG::ColorRGB& color);
+bool journalPastePrefab(Journal& journal, World& world, const Prefab& prefab, int x, int y, int z);
+//whether filename is the map the journal belongs to, so saving there should compact it instead
+bool journalIsMap(const Journal& journal, const std::string& filename);
+//starts folding the journal into the map with save, false if a save is already running
+bool journalCompact(Journal& journal, WorldSaver& saver, const World& world, const SaveFunction& save);
+//call every frame: deletes the old journal once compaction has written the map, and starts compaction when the
+//journal has grown past journalCompactRecords
+void journalUpdate(Journal& journal, WorldSaver& saver, const World& world, const SaveFunction& save);
+
+////////////////////////////////////////////////////////////////////////////////
+//VOXLAP MAPS///////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+Voxlap .vxl files: one list of slabs per column, columns in y-major order, z = 0 at the top like ours.
+Each slab is a 4 byte header (length in dwords or 0 for the last slab, first and last z of the colored
+top of the floor, z where the ceiling above the floor ends), the floor colors and then the colors of the
+ceiling on the underside of the next slab. Colors are 4 bytes: blue, green, red and shading, which is
+dropped. Solid voxels that aren't visible from anywhere have no color in the file; they get the color of
+the voxel above them, which keeps the runs long.
+*/
+
+//imports a 1024x1024x256 .vxl map, or the 512x512x64 variant Ace of Spades uses, decoding the columns in parallel
+bool loadVXL(World& world, const std::string& filename);
+
+////////////////////////////////////////////////////////////////////////////////
+//HEIGHTMAPS////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+A height PNG and a color PNG become a world of solid columns. Every pixel of the height PNG is one column: its
+value, scaled from the full range of the image (16 or 8 bit grey, or the red channel of any other PNG) to the
+depth of the world, is the height of the surface, and everything below the surface is filled with the color of
+the matching pixel of the color PNG. A color PNG of another size is stretched over the height PNG; without one
+the columns are shaded by height.
+*/
+
+//builds a world the size of the height PNG and depth voxels deep, writing the columns in parallel; false if a PNG
+//can't be decoded or the world doesn't fit in memory
+bool loadHeightmap(World& world, const std::string& heightFile, const std::string& colorFile, int depth);
+
+////////////////////////////////////////////////////////////////////////////////
+//STREAMING/////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+Streams a .vxc map that doesn't have to fit in memory. Only the chunks around the camera and the ones the
+rays have recently touched are resident; a background thread reads and decodes chunks in order of how
+soon the camera will need them, and the least recently rendered chunks are evicted to stay within the
+memory budget. A chunk that isn't resident renders as one summary column repeated over the whole chunk,
+made when the chunk was first loaded (empty before that), so the renderer never waits for the disk.
+
+The renderer and streamUpdate must run on the same thread: only streamUpdate installs and frees chunks.
+*/
+
+typedef struct StreamChunk
+{
+    VoxelCell* cells; //chunkSize * chunkSize columns while resident, 0 otherwise
+    VoxelCell* summary; //stands in for every column of the chunk while it isn't resident
+    Uint64 lastUsed; //frame the renderer last read the chunk
+    bool queued; //waiting for or being read by the I/O thread
+    bool failed; //couldn't be read, it's never requested again
+} StreamChunk;
+
+typedef struct LoadedChunk
+{
+    int chunk;
+    VoxelCell* cells;
+    VoxelCell* summary;
+} LoadedChunk;
+
+typedef struct StreamingWorld
+{
+    ChunkedMap map; //only read by the I/O thread once it's running
+    int chunkSize, chunkShift, chunksX, chunksY, depth;
+    int keepRadius; //chunks around the camera that are always loaded first
+    std::vector<StreamChunk> chunks;
+    std::vector<VoxelCell> emptyColumn;
+    std::vector<int> resident;
+    std::vector<int> missed; //chunks the rays touched this frame that weren't resident
+    size_t budget, chunkBytes;
+    Uint64 frame;
+    Uint64 loads, evictions, failures;
+
+    //shared with the I/O thread
+    std::thread io;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<int> requests; //most urgent first, rebuilt every update
+    std::vector<LoadedChunk> loaded;
+    int reading; //chunk the thread is reading, -1 if none
+    bool quit;
+} StreamingWorld;
+
+//opens a .vxc map with chunks a power of two wide and points world at it; budget is in bytes
+bool streamOpen(StreamingWorld& stream, World& world, const std::string& filename, size_t budget, int keepRadius = 4);
+void streamClose(StreamingWorld& stream, World& world);
+//call once a frame: installs the chunks that have been read, evicts down to the budget and queues the chunks
+//around (x, y), the ones ahead of it along (velocityX, velocityY) in squares per second, and the ones the rays
+//touched but found missing
+void streamUpdate(StreamingWorld& stream, double x, double y, double velocityX, double velocityY);
+void streamPreload(StreamingWorld& stream, double x, double y); //blocks until the chunks around (x, y) are resident
+size_t streamQueued(StreamingWorld& stream);
+
+//the column at (x, y) for reading: the chunk's own cells if it's resident, otherwise a summary or empty column
+//that many columns share, so it's never written to
+inline const VoxelCell* streamColumn(StreamingWorld& stream, int x, int y)
+{
+    size_t index = size_t(x >> stream.chunkShift) * stream.chunksY + (y >> stream.chunkShift);
+    StreamChunk& chunk = stream.chunks[index];
+
+    if(chunk.cells)
+    {
+        int mask = stream.chunkSize - 1;
+        chunk.lastUsed = stream.frame;
+        return chunk.cells + (size_t(x & mask) * stream.chunkSize + (y & mask)) * stream.depth;
+    }
+
+    if(chunk.lastUsed != stream.frame)
+    {
+        chunk.lastUsed = stream.frame;
+        stream.missed.push_back(int(index));
+    }
+
+    return chunk.summary ? chunk.summary : stream.emptyColumn.data();
+}
+
+inline VoxelCell* World::column(int x, int y) const
+{
+    //streamed worlds are read only, every function that edits a world refuses them
+    if(stream) return const_cast<VoxelCell*>(streamColumn(*stream, x, y));
+    return cells + (size_t(x) * height + y) * depth;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//PROCEDURAL GENERATION/////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct GeneratorSettings
+{
+    unsigned seed;
+    double hills; //0-1, height of the terrain relief relative to the world depth
+    double caves; //0-1, amount and width of the tunnels under the surface
+    double buildings; //0-1, share of the building lots that get a building
+} GeneratorSettings;
+
+GeneratorSettings defaultGeneratorSettings();
+
+//fills an already created world with noise terrain, caves and buildings, every column is
+//generated independently from the settings so the work is spread over all cores
+void generateWorld(World& world, const GeneratorSettings& settings);
+
+#endif